@@ -0,0 +1,420 @@
+// Benchmarks of the update, the dump and the driver on the simulated badge. Times are simulated time at 921600 baud, with
+// the flash timing of sim.h, unless they are said to be host CPU time.
+
+#include <malloc.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "image_files.h"
+#include "rp2040.h"
+#include "rp2040bl.h"
+#include "rp2040source.h"
+#include "rp2040update.h"
+#include "sim/sim.h"
+
+#define IMAGE_SIZE (200 * 1024)
+
+static uint8_t     image[IMAGE_SIZE];
+static RP2040      device;
+static rp2040_bl_t bl;
+static const char* build_dir = ".";
+
+static void fill_image(uint32_t seed) {
+    srand(seed);
+    for (size_t index = 0; index < sizeof(image); index++) image[index] = rand();
+}
+
+static void boot(void) {
+    sim_power_on(0x15);
+    rp2040_deinit(&device);
+    device = (RP2040) {.i2c_address = 0x17, .pin_interrupt = -1};
+    if (rp2040_init(&device) != ESP_OK) abort();
+    bl = (rp2040_bl_t) RP2040_BL_DEFAULT_CONFIG();
+}
+
+// Runs an update to completion, aborts the benchmarks if it fails
+static void update(rp2040_update_t* update) {
+    if (rp2040_update_init(update) != ESP_OK || rp2040_update_run(update) != ESP_OK) {
+        fprintf(stderr, "Update failed\n");
+        exit(1);
+    }
+    rp2040_update_deinit(update);
+    uint8_t version;
+    rp2040_get_firmware_version(&device, &version);
+}
+
+static long ms(int64_t us) { return (long) (us / 1000); }
+
+// Host time, for work that takes no simulated time
+static int64_t host_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static uint8_t* read_file(const char* name, uint32_t* length) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s", build_dir, name);
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "Missing %s, run the benchmarks through run.sh\n", path);
+        exit(1);
+    }
+    fseek(file, 0, SEEK_END);
+    *length         = ftell(file);
+    uint8_t* buffer = malloc(*length);
+    fseek(file, 0, SEEK_SET);
+    if (fread(buffer, 1, *length, file) != *length) exit(1);
+    fclose(file);
+    return buffer;
+}
+
+static void bench_update(void) {
+    boot();
+    fill_image(1);
+    rp2040_source_t source;
+    rp2040_source_from_buffer(&source, image, sizeof(image));
+    rp2040_update_t full = {.device = &device, .bl = &bl, .source = &source};
+    update(&full);
+    rp2040_update_t unchanged = {.device = &device, .bl = &bl, .source = &source};
+    update(&unchanged);
+    printf("Update of a 200 KB image\n");
+    printf("  full update        %6ld ms, %u bytes/s while writing, link limit %u bytes/s\n", ms(full.stats.duration_us),
+           full.stats.transfer_bytes_per_second, full.stats.link_bytes_per_second);
+    printf("  unchanged image    %6ld ms, of which %ld ms until the bootloader answered\n", ms(unchanged.stats.duration_us),
+           ms(unchanged.stats.bootloader_time_us));
+    rp2040_source_close(&source);
+}
+
+// Round trip of single blocking commands, from sending the command until its reply is parsed
+static void bench_commands(void) {
+    sim_power_on(0x15);
+    sim.in_bootloader = true;
+    bl                = (rp2040_bl_t) RP2040_BL_DEFAULT_CONFIG();
+    rp2040_bl_install_uart(&bl);
+    rp2040_bl_sync(&bl);
+    fill_image(5);
+    const int rounds = 1000;
+    int64_t   sync_us = 0, info_us = 0, crc_us = 0, write_us = 0;
+    for (int round = 0; round < rounds; round++) {
+        uint32_t flash_start, flash_size, erase_size, write_size, max_data_len, crc;
+        int64_t  start = sim_now();
+        if (!rp2040_bl_sync(&bl)) exit(1);
+        sync_us += sim_now() - start;
+        start    = sim_now();
+        if (!rp2040_bl_get_info(&bl, &flash_start, &flash_size, &erase_size, &write_size, &max_data_len)) exit(1);
+        info_us += sim_now() - start;
+        start    = sim_now();
+        if (!rp2040_bl_crc(&bl, SIM_FLASH_START, SIM_ERASE_SIZE, &crc)) exit(1);
+        crc_us += sim_now() - start;
+        // Every write goes to flash that is still erased, the rounds fill most of it
+        start = sim_now();
+        if (!rp2040_bl_write(&bl, SIM_FLASH_START + round * SIM_MAX_DATA_LEN, SIM_MAX_DATA_LEN, image, &crc)) exit(1);
+        write_us += sim_now() - start;
+    }
+    printf("Mean round trip of %d single commands\n", rounds);
+    printf("  SYNC               %6ld us\n", (long) (sync_us / rounds));
+    printf("  INFO               %6ld us\n", (long) (info_us / rounds));
+    printf("  CRCC of 4 KB       %6ld us\n", (long) (crc_us / rounds));
+    printf("  WRIT of %u bytes %6ld us\n", SIM_MAX_DATA_LEN, (long) (write_us / rounds));
+}
+
+static void bench_phases(void) {
+    boot();
+    fill_image(2);
+    rp2040_source_t source;
+    rp2040_source_from_buffer(&source, image, 150 * 1024);
+    rp2040_update_t full = {.device = &device, .bl = &bl, .source = &source};
+    update(&full);
+    printf("Bootloader commands per phase of a 150 KB update\n");
+    for (rp2040_bl_phase_t phase = 0; phase < RP2040_BL_PHASE_COUNT; phase++) {
+        const rp2040_bl_phase_stats_t* stats = &bl.stats.phases[phase];
+        printf("  %-6s %4u commands %7u bytes  send %5ld ms  wait %5ld ms  %6u bytes/s\n", rp2040_bl_phase_to_name(phase), stats->commands, stats->bytes,
+               ms(stats->send_us), ms(stats->wait_us), rp2040_bl_phase_bytes_per_second(stats));
+    }
+    rp2040_source_close(&source);
+}
+
+static void bench_steps(void) {
+    boot();
+    fill_image(3);
+    rp2040_source_t source;
+    rp2040_source_from_buffer(&source, image, 100 * 1024);
+    rp2040_update_t stepped = {.device = &device, .bl = &bl, .source = &source};
+    rp2040_update_init(&stepped);
+    int     steps   = 0;
+    int64_t longest = 0, start = sim_now();
+    for (esp_err_t res = ESP_ERR_NOT_FINISHED; res == ESP_ERR_NOT_FINISHED; steps++) {
+        rp2040_update_state_t state = stepped._state;
+        int64_t               begin = sim_now();
+        res                         = rp2040_update_step(&stepped);
+        if (state >= RP2040_UPDATE_STATE_COMPARE && state <= RP2040_UPDATE_STATE_VERIFY && sim_now() - begin > longest) longest = sim_now() - begin;
+    }
+    rp2040_update_deinit(&stepped);
+    printf("100 KB update stepped by the caller: %d steps, longest erase or write step %ld ms, %ld ms total\n", steps, ms(longest),
+           ms(sim_now() - start));
+    rp2040_source_close(&source);
+}
+
+static double   decompress_cost_us;  // Charged to the simulated clock per KB decompressed
+static uint32_t decompress_position;
+
+static bool charged_read(void* arg, uint8_t* buffer, uint32_t length) {
+    rp2040_source_t* decompressed = arg;
+    const uint8_t*   data         = decompressed->fetch(decompressed, decompress_position, buffer, length);
+    if (data == NULL) return false;
+    if (data != buffer) memcpy(buffer, data, length);
+    decompress_position += length;
+    sim_advance((int64_t) (decompress_cost_us * length / 1024));
+    return true;
+}
+
+static int64_t decompress_run(const uint8_t* compressed, uint32_t compressed_length, uint32_t image_length, uint32_t* heap_bytes) {
+    boot();
+    rp2040_source_t container, decompressed, charged;
+    rp2040_source_from_buffer(&container, compressed, compressed_length);
+    if (rp2040_source_decompress(&decompressed, &container) != ESP_OK) exit(1);
+    decompress_position = 0;
+    rp2040_source_from_stream(&charged, image_length, charged_read, &decompressed);
+    rp2040_update_t charged_update = {.device = &device, .bl = &bl, .source = &charged, .full_write = true};
+    update(&charged_update);
+    *heap_bytes = decompressed.heap_bytes;
+    rp2040_source_close(&decompressed);
+    return charged_update.stats.duration_us;
+}
+
+static void bench_decompress(void) {
+    uint32_t image_length, compressed_length;
+    uint8_t* raw        = read_file("image.bin", &image_length);
+    uint8_t* compressed = read_file("image.rphs", &compressed_length);
+
+    // Host CPU time of decompression, charged to the simulated clock of the update task below
+    static uint8_t  buffer[1024];
+    rp2040_source_t container, source;
+    rp2040_source_from_buffer(&container, compressed, compressed_length);
+    int64_t start = host_us();
+    for (int round = 0; round < 100; round++) {
+        if (rp2040_source_decompress(&source, &container) != ESP_OK) exit(1);
+        for (uint32_t offset = 0; offset < image_length; offset += sizeof(buffer)) source.fetch(&source, offset, buffer, sizeof(buffer));
+        rp2040_source_close(&source);
+    }
+    double measured_us = (double) (host_us() - start) / 100 / (image_length / 1024);
+
+    boot();
+    rp2040_source_from_buffer(&source, raw, image_length);
+    rp2040_update_t plain = {.device = &device, .bl = &bl, .source = &source, .full_write = true};
+    update(&plain);
+
+    printf("Update of a 64 KB image compressed to %u bytes, decompression takes %.1f us of host CPU time per KB\n", compressed_length, measured_us);
+    printf("  uncompressed                      %6ld ms\n", ms(plain.stats.duration_us));
+    static const double factors[] = {1, 10, 100};
+    for (size_t index = 0; index < sizeof(factors) / sizeof(factors[0]); index++) {
+        uint32_t heap_bytes;
+        decompress_cost_us = measured_us * factors[index];
+        int64_t duration   = decompress_run(compressed, compressed_length, image_length, &heap_bytes);
+        printf("  compressed, %3.0fx host cost %6.0f us/KB %6ld ms, heap %u bytes\n", factors[index], decompress_cost_us, ms(duration), heap_bytes);
+    }
+    free(raw);
+    free(compressed);
+}
+
+static void bench_erase(void) {
+    boot();
+    fill_image(4);
+    rp2040_source_t source;
+    rp2040_source_from_buffer(&source, image, sizeof(image));
+    rp2040_update_t batched = {.device = &device, .bl = &bl, .source = &source};
+    printf("Erasing a 200 KB image at 0x%08X\n", SIM_FLASH_START);
+    update(&batched);
+    printf("  fresh image        %6ld ms, %u erase commands, %u blocks, erase wait %ld ms\n", ms(batched.stats.duration_us), sim.erase_commands,
+           sim.blocks_erased, ms(bl.stats.phases[RP2040_BL_PHASE_ERASE].wait_us));
+
+    // The sectors of the first block that is completely covered by the image
+    uint32_t  block     = 0x10010000 - SIM_FLASH_START;
+    const int changed[] = {14, 15};
+    for (size_t index = 0; index < 2; index++) {
+        for (int sector = 0; sector < changed[index]; sector++) image[block + sector * SIM_ERASE_SIZE]++;
+        sim_clear_counters();
+        update(&batched);
+        printf("  %2d of 16 changed   %6ld ms, %u blocks, %u sectors rewritten\n", changed[index], ms(batched.stats.duration_us), sim.blocks_erased,
+               batched.stats.sectors_rewritten);
+    }
+    for (int sector = 0; sector < 3; sector++) image[block + sector * 5 * SIM_ERASE_SIZE]++;
+    sim_clear_counters();
+    update(&batched);
+    printf("   3 of 16 changed   %6ld ms, %u blocks, %u sectors erased\n", ms(batched.stats.duration_us), sim.blocks_erased, sim.sectors_erased);
+    rp2040_source_close(&source);
+}
+
+static void bench_verify(void) {
+    static const char* names[] = {"write CRC", "image CRC", "sampled", "full"};
+    rp2040_source_t    source;
+    rp2040_source_from_buffer(&source, image, sizeof(image));
+    printf("Verification of a 200 KB image\n");
+    for (rp2040_update_verify_t verify = RP2040_UPDATE_VERIFY_WRITE_CRC; verify <= RP2040_UPDATE_VERIFY_FULL; verify++) {
+        boot();
+        fill_image(5 + verify);
+        rp2040_update_t verified = {.device = &device, .bl = &bl, .source = &source, .verify = verify};
+        update(&verified);
+        int64_t estimate = rp2040_update_estimate_verify_time(&bl, verify, sizeof(image), SIM_MAX_DATA_LEN, RP2040_UPDATE_VERIFY_SAMPLES);
+        printf("  %-10s %6ld ms, estimated %6ld ms\n", names[verify], ms(verified.stats.verify_duration_us), ms(estimate));
+    }
+    rp2040_source_close(&source);
+}
+
+static void bench_check(void) {
+    fill_image(9);
+    rp2040_update_manifest_t manifest = {.version = 0x15, .length = sizeof(image), .crc = sim_crc32(image, sizeof(image))};
+    bool                     needed;
+    boot();
+    memcpy(sim.flash, image, sizeof(image));
+    int64_t start = sim_now();
+    rp2040_update_check(&device, &bl, &manifest, &needed);
+    printf("Manifest check of a 200 KB image\n");
+    printf("  unambiguous match  %6ld us\n", (long) (sim_now() - start));
+    manifest.ambiguous = true;
+    start              = sim_now();
+    rp2040_update_check(&device, &bl, &manifest, &needed);
+    printf("  ambiguous match    %6ld us, firmware running again\n", (long) (sim_now() - start));
+    sim.flash[1000]++;
+    rp2040_update_check(&device, &bl, &manifest, &needed);
+    start = sim_now();
+    rp2040_update_check(&device, &bl, &manifest, &needed);
+    printf("  ambiguous mismatch %6ld us, from the bootloader left running by the previous check\n", (long) (sim_now() - start));
+}
+
+static void bench_dump(void) {
+    static uint8_t out[300 * 1024];
+    sim_power_on(0x15);
+    sim.in_bootloader = true;
+    bl                = (rp2040_bl_t) RP2040_BL_DEFAULT_CONFIG();
+    rp2040_bl_install_uart(&bl);
+    rp2040_bl_sync(&bl);
+    rp2040_sink_t sink;
+    rp2040_sink_to_buffer(&sink, out);
+    rp2040_bl_dump_stats_t stats;
+    if (!rp2040_bl_dump(&bl, SIM_FLASH_START, sizeof(out), &sink, &stats)) exit(1);
+    printf("Dump of 300 KB: %ld ms, %u bytes/s in %u byte chunks, link limit %u bytes/s\n", ms(stats.duration_us), stats.bytes_per_second, stats.chunk_size,
+           RP2040_BL_BAUDRATE / 10);
+}
+
+static void bench_sparse(void) {
+    // 64 KB of data in three ranges over a 329 KB span, as in test_image.c
+    fill_image(10);
+    const image_range_t ranges[] = {
+        {.address = 0x10008000, .length = 24 * 1024, .data = image},
+        {.address = 0x10030000, .length = 20 * 1024, .data = image + 24 * 1024},
+        {.address = 0x10055400, .length = 20 * 1024, .data = image + 44 * 1024},
+    };
+    uint8_t*        files[2];
+    uint32_t        lengths[2] = {build_uf2(ranges, 3, false, &files[0]), build_elf(ranges, 3, &files[1])};
+    rp2040_source_t file_sources[2], sparse[2], padded;
+    rp2040_image_t  loaded[2];
+    for (size_t index = 0; index < 2; index++) {
+        rp2040_source_from_buffer(&file_sources[index], files[index], lengths[index]);
+        if (rp2040_image_load(&loaded[index], &file_sources[index]) != ESP_OK) exit(1);
+        if (rp2040_source_from_image(&sparse[index], &file_sources[index], &loaded[index]) != ESP_OK) exit(1);
+    }
+
+    // The same image as a .bin padded with 0xFF, which has no notion of sectors without data
+    static uint8_t bin[0x1005A400 - SIM_FLASH_START];
+    memset(bin, 0xFF, sizeof(bin));
+    for (size_t index = 0; index < 3; index++) memcpy(bin + ranges[index].address - SIM_FLASH_START, ranges[index].data, ranges[index].length);
+    rp2040_source_from_buffer(&padded, bin, sizeof(bin));
+
+    printf("Image with 64 KB of data in a 329 KB span\n");
+    rp2040_source_t* sources[] = {&padded, &sparse[0], &sparse[1]};
+    const char*      names[]   = {"padded .bin", "UF2", "ELF"};
+    for (size_t index = 0; index < 3; index++) {
+        // Over older firmware, erased flash would already match the padding
+        boot();
+        memset(sim.flash, 0xA5, sizeof(bin));
+        rp2040_update_t flashed = {.device = &device, .bl = &bl, .source = sources[index]};
+        update(&flashed);
+        printf("  %-12s %6u bytes written in %6ld ms\n", names[index], sim.bytes_written, ms(flashed.stats.duration_us));
+    }
+    for (size_t index = 0; index < 2; index++) {
+        rp2040_image_free(&loaded[index]);
+        free(files[index]);
+    }
+}
+
+static int64_t production_cost_us;  // Emulated time to produce 1 KB, such as decompression or a slow file system
+
+static bool slow_read(void* arg, uint8_t* buffer, uint32_t length) {
+    uint32_t* position = arg;
+    int64_t   until    = sim_now() + production_cost_us * length / 1024;
+    memcpy(buffer, image + *position, length);
+    *position += length;
+    while (sim_now() < until) {
+    }
+    return true;
+}
+
+static int64_t prefetch_run(bool prefetch) {
+    boot();
+    sim_set_realtime(true);
+    uint32_t                 position = 0;
+    rp2040_source_t          stream, prefetched;
+    rp2040_prefetch_config_t config = RP2040_PREFETCH_DEFAULT_CONFIG();
+    rp2040_source_from_stream(&stream, 64 * 1024, slow_read, &position);
+    if (prefetch && rp2040_source_prefetch(&prefetched, &stream, &config) != ESP_OK) exit(1);
+    rp2040_update_t streamed = {.device = &device, .bl = &bl, .source = prefetch ? &prefetched : &stream};
+    update(&streamed);
+    if (prefetch) rp2040_source_close(&prefetched);
+    sim_set_realtime(false);
+    return streamed.stats.duration_us;
+}
+
+static void bench_prefetch(void) {
+    fill_image(11);
+    printf("64 KB from a stream that takes time to produce its data, real time\n");
+    printf("  cost/KB   single   prefetch  speedup\n");
+    static const int64_t costs[] = {0, 2000, 8000, 12000, 20000};
+    for (size_t index = 0; index < sizeof(costs) / sizeof(costs[0]); index++) {
+        production_cost_us = costs[index];
+        int64_t single = prefetch_run(false), prefetched = prefetch_run(true);
+        printf("  %2ld ms   %6ld ms  %6ld ms   %.2fx\n", ms(costs[index]), ms(single), ms(prefetched), (double) single / prefetched);
+    }
+}
+
+static void bench_cycles(void) {
+    sim_power_on(0x15);
+    rp2040_deinit(&device);
+    RP2040  cycled = {.i2c_address = 0x17, .pin_interrupt = 34, .callback = NULL};
+    int64_t init_us = 0, deinit_us = 0;
+    size_t  heap    = 0;
+    for (int cycle = 0; cycle < 2000; cycle++) {
+        int64_t start = sim_now();
+        rp2040_init(&cycled);
+        init_us += sim_now() - start;
+        start = sim_now();
+        rp2040_deinit(&cycled);
+        deinit_us += sim_now() - start;
+        if (cycle == 10) heap = mallinfo2().uordblks;
+    }
+    printf("2000 init and deinit cycles: init %ld us, deinit %ld us on average, heap grew by %ld bytes after the first 10\n", (long) (init_us / 2000),
+           (long) (deinit_us / 2000), (long) (mallinfo2().uordblks - heap));
+#if CONFIG_RP2040_STATIC_ALLOCATION
+    printf("RP2040_STATIC_FOOTPRINT %zu bytes\n", RP2040_STATIC_FOOTPRINT);
+#endif
+}
+
+int main(int argc, char** argv) {
+    if (argc > 1) build_dir = argv[1];
+    bench_update();
+    bench_commands();
+    bench_phases();
+    bench_steps();
+    bench_erase();
+    bench_verify();
+    bench_decompress();
+    bench_check();
+    bench_dump();
+    bench_sparse();
+    bench_cycles();
+    bench_prefetch();
+    rp2040_deinit(&device);
+    return 0;
+}
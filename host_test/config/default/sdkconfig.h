@@ -0,0 +1,11 @@
+// Menuconfig defaults of the component, built for the host
+#pragma once
+
+#define CONFIG_IDF_TARGET_LINUX            1
+#define CONFIG_RP2040_INTR_TASK_STACK_SIZE 4096
+#define CONFIG_RP2040_GPIO                 1
+#define CONFIG_RP2040_ADC                  1
+#define CONFIG_RP2040_IR                   1
+#define CONFIG_RP2040_WS2812               1
+#define CONFIG_RP2040_MSC                  1
+#define CONFIG_RP2040_BOOTLOADER           1
@@ -0,0 +1,5 @@
+// Every optional subsystem disabled, built for the host
+#pragma once
+
+#define CONFIG_IDF_TARGET_LINUX            1
+#define CONFIG_RP2040_INTR_TASK_STACK_SIZE 4096
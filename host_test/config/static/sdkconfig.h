@@ -0,0 +1,13 @@
+// Static allocation with a memory budget, built for the host
+#pragma once
+
+#define CONFIG_IDF_TARGET_LINUX            1
+#define CONFIG_RP2040_STATIC_ALLOCATION    1
+#define CONFIG_RP2040_STATIC_MEMORY_BUDGET 8192
+#define CONFIG_RP2040_INTR_TASK_STACK_SIZE 4096
+#define CONFIG_RP2040_GPIO                 1
+#define CONFIG_RP2040_ADC                  1
+#define CONFIG_RP2040_IR                   1
+#define CONFIG_RP2040_WS2812               1
+#define CONFIG_RP2040_MSC                  1
+#define CONFIG_RP2040_BOOTLOADER           1
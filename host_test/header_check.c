@@ -0,0 +1,6 @@
+// The public headers together, in the order that would hide the fewest missing includes. run.sh also compiles each one on its own.
+#include "rp2040update.h"
+#include "rp2040image.h"
+#include "rp2040source.h"
+#include "rp2040bl.h"
+#include "rp2040.h"
@@ -0,0 +1,7 @@
+// The public headers from C++17, which is what ESP-IDF components that do not opt in to C++20 are built with
+#include "rp2040.hpp"
+#include "rp2040update.h"
+#include "rp2040image.h"
+#include "rp2040source.h"
+#include "rp2040bl.h"
+#include "rp2040.h"
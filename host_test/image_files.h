@@ -0,0 +1,109 @@
+// Builds sparse UF2 and ELF files in memory for the image tests and benchmarks
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rp2040image.h"
+
+typedef struct {
+    uint32_t       address;
+    uint32_t       length;
+    const uint8_t* data;
+} image_range_t;
+
+static void put_u16(uint8_t* target, uint16_t value) {
+    target[0] = value;
+    target[1] = value >> 8;
+}
+
+static void put_u32(uint8_t* target, uint32_t value) {
+    put_u16(target, value);
+    put_u16(target + 2, value >> 16);
+}
+
+static void uf2_block(uint8_t* block, uint32_t flags, uint32_t address, const uint8_t* data, uint32_t length, uint32_t family) {
+    memset(block, 0, 512);
+    put_u32(block, 0x0A324655);
+    put_u32(block + 4, 0x9E5D5157);
+    put_u32(block + 8, flags);
+    put_u32(block + 12, address);
+    put_u32(block + 16, length);
+    put_u32(block + 28, family);
+    memcpy(block + 32, data, length);
+    put_u32(block + 508, 0x0AB16F30);
+}
+
+// 256 byte payloads like picotool writes them, optionally in shuffled order, with a block for another chip family, one for
+// RAM and one flagged as not for the main flash that must all be ignored. Returns the file length, the file is allocated.
+static uint32_t build_uf2(const image_range_t* ranges, size_t count, bool shuffle, uint8_t** file) {
+    uint32_t blocks = 3;
+    for (size_t index = 0; index < count; index++) blocks += (ranges[index].length + 255) / 256;
+    uint8_t* data = malloc(blocks * 512);
+    uint32_t used = 0;
+    for (size_t index = 0; index < count; index++) {
+        for (uint32_t offset = 0; offset < ranges[index].length; offset += 256) {
+            uint32_t length = ranges[index].length - offset < 256 ? ranges[index].length - offset : 256;
+            uf2_block(data + used++ * 512, 0x2000, ranges[index].address + offset, ranges[index].data + offset, length, RP2040_IMAGE_UF2_FAMILY_ID);
+        }
+    }
+    static const uint8_t junk[256] = {0x12, 0x34};
+    uf2_block(data + used++ * 512, 0x2000, ranges[0].address, junk, 256, 0x12345678);
+    uf2_block(data + used++ * 512, 0x2000, 0x20000000, junk, 256, RP2040_IMAGE_UF2_FAMILY_ID);
+    uf2_block(data + used++ * 512, 0x0001, ranges[0].address, junk, 256, 0);
+
+    srand(63);
+    uint8_t swap[512];
+    for (uint32_t index = 1; shuffle && index < blocks; index++) {
+        uint32_t other = rand() % (index + 1);
+        memcpy(swap, data + index * 512, 512);
+        memcpy(data + index * 512, data + other * 512, 512);
+        memcpy(data + other * 512, swap, 512);
+    }
+    *file = data;
+    return blocks * 512;
+}
+
+// One PT_LOAD segment per range, plus a RAM segment and a segment that is not loaded
+static uint32_t build_elf(const image_range_t* ranges, size_t count, uint8_t** file) {
+    uint32_t phnum  = count + 2;
+    uint32_t length = 52 + phnum * 32;
+    for (size_t index = 0; index < count; index++) length += ranges[index].length;
+    uint8_t* data = calloc(1, length);
+    memcpy(data, "\x7F" "ELF", 4);
+    data[4] = 1;  // 32 bit
+    data[5] = 1;  // Little endian
+    data[6] = 1;
+    put_u16(data + 16, 2);   // Executable
+    put_u16(data + 18, 40);  // ARM
+    put_u32(data + 28, 52);
+    put_u16(data + 40, 52);
+    put_u16(data + 42, 32);
+    put_u16(data + 44, phnum);
+
+    uint32_t offset = 52 + phnum * 32;
+    for (uint32_t index = 0; index < phnum; index++) {
+        uint8_t* phdr = data + 52 + index * 32;
+        uint32_t type = index == count + 1 ? 4 : 1;  // PT_NOTE or PT_LOAD
+        uint32_t address, size;
+        if (index < count) {
+            address = ranges[index].address;
+            size    = ranges[index].length;
+            memcpy(data + offset, ranges[index].data, size);
+        } else {
+            address = 0x20000000;
+            size    = 128;
+        }
+        put_u32(phdr, type);
+        put_u32(phdr + 4, offset);
+        put_u32(phdr + 8, address);
+        put_u32(phdr + 12, address);
+        put_u32(phdr + 16, size);
+        put_u32(phdr + 20, size);
+        offset += size;
+    }
+    *file = data;
+    return length;
+}
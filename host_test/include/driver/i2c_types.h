@@ -0,0 +1,5 @@
+// Host stand-in for the ESP-IDF header of the same name
+#pragma once
+
+typedef struct i2c_master_bus_t* i2c_master_bus_handle_t;
+typedef struct i2c_master_dev_t* i2c_master_dev_handle_t;
@@ -0,0 +1,37 @@
+// Host stand-in for the ESP-IDF header of the same name, only what the component and the tests use
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef int esp_err_t;
+
+#define ESP_OK                   0
+#define ESP_FAIL                 -1
+#define ESP_ERR_NO_MEM           0x101
+#define ESP_ERR_INVALID_ARG      0x102
+#define ESP_ERR_INVALID_STATE    0x103
+#define ESP_ERR_INVALID_SIZE     0x104
+#define ESP_ERR_NOT_FOUND        0x105
+#define ESP_ERR_NOT_SUPPORTED    0x106
+#define ESP_ERR_TIMEOUT          0x107
+#define ESP_ERR_INVALID_RESPONSE 0x108
+#define ESP_ERR_INVALID_CRC      0x109
+#define ESP_ERR_INVALID_VERSION  0x10A
+#define ESP_ERR_NOT_FINISHED     0x10C
+
+const char* esp_err_to_name(esp_err_t code);
+
+#define ESP_ERROR_CHECK(x)          \
+    do {                            \
+        if ((x) != ESP_OK) abort(); \
+    } while (0)
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,29 @@
+// Host stand-in for the ESP-IDF header of the same name. Messages go to stderr up to host_log_level.
+#pragma once
+
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern int host_log_level;  // 0 silent, 1 errors, 2 warnings, 3 info, 4 debug, 5 verbose. Set from HOST_TEST_LOG_LEVEL at start.
+
+#define HOST_LOG(level, letter, tag, ...)          \
+    do {                                           \
+        if (host_log_level >= (level)) {           \
+            fprintf(stderr, letter " (%s) ", tag); \
+            fprintf(stderr, __VA_ARGS__);          \
+            fputc('\n', stderr);                   \
+        }                                          \
+    } while (0)
+
+#define ESP_LOGE(tag, ...) HOST_LOG(1, "E", tag, __VA_ARGS__)
+#define ESP_LOGW(tag, ...) HOST_LOG(2, "W", tag, __VA_ARGS__)
+#define ESP_LOGI(tag, ...) HOST_LOG(3, "I", tag, __VA_ARGS__)
+#define ESP_LOGD(tag, ...) HOST_LOG(4, "D", tag, __VA_ARGS__)
+#define ESP_LOGV(tag, ...) HOST_LOG(5, "V", tag, __VA_ARGS__)
+
+#ifdef __cplusplus
+}
+#endif
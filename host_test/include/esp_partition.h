@@ -0,0 +1,35 @@
+// Host stand-in for the ESP-IDF header of the same name, every partition maps the simulated partition memory
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+    uint32_t address;
+    uint32_t size;
+    uint32_t erase_size;
+    char     label[17];
+} esp_partition_t;
+
+typedef uint32_t esp_partition_mmap_handle_t;
+
+typedef enum {
+    ESP_PARTITION_MMAP_DATA = 0,
+    ESP_PARTITION_MMAP_INST,
+} esp_partition_mmap_memory_t;
+
+esp_err_t esp_partition_mmap(const esp_partition_t* partition, size_t offset, size_t size, esp_partition_mmap_memory_t memory, const void** out_ptr,
+                             esp_partition_mmap_handle_t* out_handle);
+void      esp_partition_munmap(esp_partition_mmap_handle_t handle);
+esp_err_t esp_partition_write(const esp_partition_t* partition, size_t dst_offset, const void* src, size_t size);
+esp_err_t esp_partition_erase_range(const esp_partition_t* partition, size_t offset, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
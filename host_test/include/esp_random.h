@@ -0,0 +1,14 @@
+// Host stand-in for the ESP-IDF header of the same name, reproducible between runs
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+uint32_t esp_random(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,45 @@
+// Host stand-in for the FreeRTOS header of the same name, the simulated kernel is in sim/kernel.c
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_attr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef int          BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t     TickType_t;
+typedef uint32_t     StackType_t;
+
+#define pdFALSE              0
+#define pdTRUE               1
+#define pdFAIL               0
+#define pdPASS               1
+#define portMAX_DELAY        ((TickType_t) 0xFFFFFFFF)
+#define portTICK_PERIOD_MS   1
+#define pdMS_TO_TICKS(ms)    ((TickType_t) (ms))
+#define portYIELD_FROM_ISR() ((void) 0)
+#define tskNO_AFFINITY       0x7FFFFFFF
+
+#define configSTACK_DEPTH_TYPE uint32_t
+#ifndef configNUMBER_OF_CORES
+#define configNUMBER_OF_CORES 1  // Like the Linux target of ESP-IDF
+#endif
+
+// Large enough for the simulated objects, the sizes of the real ones differ
+typedef struct {
+    void* opaque[16];
+} StaticSemaphore_t;
+
+typedef struct {
+    void* opaque[48];
+} StaticTask_t;
+
+#ifdef __cplusplus
+}
+#endif
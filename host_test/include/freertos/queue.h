@@ -0,0 +1,14 @@
+// Host stand-in for the FreeRTOS header of the same name, the component only passes queue handles around
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct sim_queue* QueueHandle_t;
+
+#ifdef __cplusplus
+}
+#endif
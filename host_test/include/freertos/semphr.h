@@ -0,0 +1,21 @@
+// Host stand-in for the FreeRTOS header of the same name
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct sim_semaphore* SemaphoreHandle_t;
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void);
+SemaphoreHandle_t xSemaphoreCreateBinaryStatic(StaticSemaphore_t* buffer);
+BaseType_t        xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks_to_wait);
+BaseType_t        xSemaphoreGive(SemaphoreHandle_t semaphore);
+BaseType_t        xSemaphoreGiveFromISR(SemaphoreHandle_t semaphore, BaseType_t* higher_priority_task_woken);
+void              vSemaphoreDelete(SemaphoreHandle_t semaphore);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,38 @@
+// Host stand-in for the FreeRTOS header of the same name, tasks are threads
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct sim_task* TaskHandle_t;
+typedef void (*TaskFunction_t)(void* arg);
+
+typedef enum {
+    eRunning = 0,
+    eReady,
+    eBlocked,
+    eSuspended,
+    eDeleted,
+    eInvalid,
+} eTaskState;
+
+BaseType_t   xTaskCreate(TaskFunction_t function, const char* name, configSTACK_DEPTH_TYPE stack_depth, void* arg, UBaseType_t priority,
+                         TaskHandle_t* created_task);
+BaseType_t   xTaskCreatePinnedToCore(TaskFunction_t function, const char* name, configSTACK_DEPTH_TYPE stack_depth, void* arg, UBaseType_t priority,
+                                     TaskHandle_t* created_task, BaseType_t core_id);
+TaskHandle_t xTaskCreateStatic(TaskFunction_t function, const char* name, uint32_t stack_depth, void* arg, UBaseType_t priority, StackType_t* stack_buffer,
+                               StaticTask_t* task_buffer);
+TaskHandle_t xTaskGetCurrentTaskHandle(void);
+void         vTaskDelete(TaskHandle_t task);
+void         vTaskSuspend(TaskHandle_t task);
+eTaskState   eTaskGetState(TaskHandle_t task);
+void         vTaskDelay(TickType_t ticks);
+BaseType_t   xTaskNotifyGive(TaskHandle_t task);
+uint32_t     ulTaskNotifyTake(BaseType_t clear_on_exit, TickType_t ticks_to_wait);
+
+#ifdef __cplusplus
+}
+#endif
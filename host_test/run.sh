@@ -0,0 +1,140 @@
+#!/bin/sh
+# Builds the component against the host simulation and runs the tests and benchmarks
+#
+#   host_test/run.sh          tests and benchmarks
+#   host_test/run.sh tests    tests only, with the address and undefined behaviour sanitizers
+#   host_test/run.sh bench    benchmarks only, optimized
+#   host_test/run.sh size     flash and RAM of the component with each optional subsystem disabled in turn
+#
+# Needs a C17 and C++20 compiler and python3. CC, CXX and BUILD override the compilers and the build directory, SIZE the
+# size tool. The size report only compiles the component, so CC and SIZE may also be a cross toolchain such as
+# xtensa-esp32-elf-gcc and xtensa-esp32-elf-size.
+
+set -e
+
+HERE=$(cd "$(dirname "$0")" && pwd)
+ROOT=$(dirname "$HERE")
+BUILD=${BUILD:-$HERE/build}
+CC=${CC:-cc}
+CXX=${CXX:-c++}
+SIZE=${SIZE:-size}
+MODE=${1:-all}
+
+WARNINGS="-Wall -Wextra -Wno-unused-parameter -Wno-missing-field-initializers -Werror"
+SANITIZERS="-fsanitize=address,undefined -fno-omit-frame-pointer -fno-sanitize-recover=undefined"
+COMPONENT="rp2040.c rp2040bl.c rp2040image.c rp2040source.c rp2040update.c"
+SIM="kernel.c firmware.c bootloader.c storage.c"
+
+mkdir -p "$BUILD"
+
+includes() {
+    echo "-I$ROOT/include -I$HERE/include -I$HERE -I$HERE/config/$1"
+}
+
+# build <binary> <config> <flags> <test sources...>
+build() {
+    binary=$1
+    config=$2
+    flags=$3
+    shift 3
+    sources=""
+    if [ "$config" = minimal ]; then
+        sources="$ROOT/rp2040.c"
+    else
+        for file in $COMPONENT; do sources="$sources $ROOT/$file"; done
+    fi
+    for file in $SIM; do sources="$sources $HERE/sim/$file"; done
+    objects=""
+    for file in $sources "$@"; do
+        object="$BUILD/$binary.$(basename "$file").o"
+        case "$file" in
+            # GCC 12 at -O1 takes the malloc inlined into the operator new of a coroutine promise for a mismatch with its operator delete
+            *.cpp) $CXX -std=gnu++20 $flags $WARNINGS -Wno-mismatched-new-delete $(includes "$config") -c "$file" -o "$object" ;;
+            *) $CC -std=gnu17 $flags $WARNINGS $(includes "$config") -c "$file" -o "$object" ;;
+        esac
+        objects="$objects $object"
+    done
+    $CXX $flags $objects -o "$BUILD/$binary" -lpthread
+}
+
+images() {
+    # A deterministic image with a mix of repeating and random looking content, compressed, and a copy with a broken header CRC
+    python3 -c "
+import random
+random.seed(2022)
+data = bytearray()
+while len(data) < 65536:
+    data += bytes([random.randrange(256)] * random.randrange(1, 40)) if random.random() < 0.5 else random.randbytes(random.randrange(1, 40))
+open('$BUILD/image.bin', 'wb').write(data[:65536])
+"
+    python3 "$ROOT/tools/rp2040_compress.py" "$BUILD/image.bin" "$BUILD/image.rphs" > /dev/null
+    python3 -c "
+data = bytearray(open('$BUILD/image.rphs', 'rb').read())
+data[12] ^= 0x01
+open('$BUILD/image_bad.rphs', 'wb').write(data)
+"
+}
+
+tests() {
+    images
+    for config in default static minimal; do
+        for header in rp2040.h rp2040bl.h rp2040source.h rp2040image.h rp2040update.h; do
+            echo "#include \"$header\"" | $CC -x c -std=gnu17 $WARNINGS -Wpedantic $(includes $config) -fsyntax-only -
+        done
+        $CC -std=gnu17 $WARNINGS -Wpedantic $(includes $config) -fsyntax-only "$HERE/header_check.c"
+        $CXX -std=gnu++17 $WARNINGS $(includes $config) -fsyntax-only "$HERE/header_check.cpp"
+        build test_driver_$config $config "-g -O1 $SANITIZERS" "$HERE/test_driver.c"
+    done
+    for test in test_bootloader test_source test_update test_image test_resume; do
+        build $test default "-g -O1 $SANITIZERS" "$HERE/$test.c"
+    done
+    build test_coro default "-g -O1 $SANITIZERS" "$HERE/test_coro.cpp"
+
+    failed=0
+    for test in test_driver_default test_driver_static test_driver_minimal test_bootloader test_source test_update test_image test_resume test_coro; do
+        echo "== $test"
+        "$BUILD/$test" "$BUILD" || failed=1
+    done
+    return $failed
+}
+
+bench() {
+    images
+    build bench default "-O2" "$HERE/bench.c"
+    "$BUILD/bench" "$BUILD"
+}
+
+# footprint <config directory>: prints the flash (text and data) and RAM (data and bss) of the component built with it
+footprint() {
+    objects=""
+    for file in $COMPONENT; do
+        # Without the bootloader option CMakeLists.txt only builds rp2040.c
+        if [ "$file" != rp2040.c ] && ! grep -q "CONFIG_RP2040_BOOTLOADER " "$1/sdkconfig.h"; then continue; fi
+        object="$BUILD/size.$(basename "$1").$file.o"
+        $CC -std=gnu17 -Os -ffunction-sections -fdata-sections $WARNINGS -I"$ROOT/include" -I"$HERE/include" -I"$1" -c "$ROOT/$file" -o "$object"
+        objects="$objects $object"
+    done
+    $SIZE -t $objects | tail -n 1 | awk '{print $1 + $2, $2 + $3}'
+}
+
+size_report() {
+    set -- $(footprint "$HERE/config/default")
+    flash=$1
+    ram=$2
+    echo "All options: $flash bytes of flash, $ram bytes of RAM, built with $CC -Os"
+    printf "%-27s %6s %6s\n" Option flash RAM
+    for option in GPIO ADC IR WS2812 MSC BOOTLOADER; do
+        mkdir -p "$BUILD/config/no_$option"
+        grep -v "CONFIG_RP2040_$option " "$HERE/config/default/sdkconfig.h" > "$BUILD/config/no_$option/sdkconfig.h"
+        set -- $(footprint "$BUILD/config/no_$option")
+        printf "CONFIG_RP2040_%-13s %6d %6d\n" "$option" $((flash - $1)) $((ram - $2))
+    done
+}
+
+case "$MODE" in
+    all) tests && bench ;;
+    tests) tests ;;
+    bench) bench ;;
+    size) size_report ;;
+    *) echo "Usage: $0 [all|tests|bench|size]" >&2; exit 2 ;;
+esac
@@ -0,0 +1,350 @@
+// The ESP32 UART driver connected to the RP2040 serial bootloader. Bytes travel at the configured baud rate, the
+// bootloader handles a command once it has received all of it, and its reply bytes are timestamped with the time they
+// arrive. The RX buffer of the driver only fills when the application calls into it, so bytes are moved into it then,
+// and the ones that do not fit are lost like on the real driver.
+
+#include <driver/uart.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sim.h"
+
+#define LINE_CAPACITY  (64 * 1024)  // Reply bytes on the wire or in the FIFO, not yet in the driver buffer
+#define FIFO_SIZE      128          // Hardware FIFO in front of the TX ring buffer
+#define MAX_COMMAND    (12 + 4096)
+#define TURNAROUND_US  20           // Bootloader time to start handling a command
+
+typedef struct {
+    uint8_t data;
+    int64_t at;  // Time the last bit arrives
+} line_byte_t;
+
+// ESP32 side
+static bool     installed;
+static uint32_t host_baudrate;
+static uint32_t rx_buffer_size;
+static uint32_t tx_buffer_size;
+static uint8_t* rx_buffer;  // Ring of rx_buffer_size bytes
+static uint32_t rx_head;
+static uint32_t rx_count;
+static int64_t  tx_done;  // Time the last byte written has been transmitted
+
+// Wire towards the ESP32
+static line_byte_t line[LINE_CAPACITY];
+static uint32_t    line_head;
+static uint32_t    line_count;
+
+// Bootloader
+static uint8_t command[MAX_COMMAND];
+static size_t  command_length;
+static bool    awaiting_sync;  // After an unknown opcode everything up to the next SYNC is ignored
+static int64_t device_busy;  // Time the bootloader is done with the commands received so far
+
+uint32_t sim_crc32(const uint8_t* data, uint32_t length) {
+    // Mode 1 of the DMA sniffer feeds every byte bit reversed into CRC-32 0x04C11DB7, the result is read bit reversed
+    // and inverted. That is the reflected CRC-32 with polynomial 0xEDB88320.
+    uint32_t crc = 0xFFFFFFFF;
+    while (length--) {
+        crc ^= *data++;
+        for (int bit = 0; bit < 8; bit++) crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+    }
+    return crc ^ 0xFFFFFFFF;
+}
+
+void sim_bootloader_reset(bool host, bool device) {
+    if (host) {
+        free(rx_buffer);
+        rx_buffer  = NULL;
+        installed  = false;
+        rx_head    = 0;
+        rx_count   = 0;
+        tx_done    = 0;
+        line_head  = 0;
+        line_count = 0;
+    }
+    if (device) {
+        command_length = 0;
+        awaiting_sync  = false;
+        device_busy    = 0;
+        line_head      = 0;
+        line_count     = 0;
+    }
+}
+
+static int64_t byte_time(uint32_t count) { return (int64_t) count * 10 * 1000000 / host_baudrate; }
+
+static bool link_matches(void) { return host_baudrate == sim.bl_baudrate; }
+
+// Bootloader side
+
+// Byte times are counted from the start of the reply, a byte takes a fraction of a microsecond more than byte_time(1)
+static void reply(const void* data, size_t length) {
+    int64_t start = device_busy;
+    for (size_t index = 0; index < length; index++) {
+        if (line_count == LINE_CAPACITY) abort();
+        // At a different baud rate the ESP32 samples garbage
+        uint8_t byte = link_matches() ? ((const uint8_t*) data)[index] : (uint8_t) (0x55 ^ index);
+        line[(line_head + line_count++) % LINE_CAPACITY] = (line_byte_t) {.data = byte, .at = start + byte_time(index + 1)};
+    }
+    device_busy = start + byte_time(length);
+}
+
+static void reply_word(const char* magic, uint32_t value) {
+    uint8_t data[8];
+    memcpy(data, magic, 4);
+    memcpy(data + 4, &value, 4);
+    reply(data, sizeof(data));
+}
+
+static uint32_t argument(int index) {
+    uint32_t value;
+    memcpy(&value, &command[4 + 4 * index], 4);
+    return value;
+}
+
+static bool flash_range(uint32_t address, uint32_t length) {
+    return address >= SIM_FLASH_START && length <= SIM_FLASH_SIZE && address - SIM_FLASH_START <= SIM_FLASH_SIZE - length;
+}
+
+static uint8_t* flash(uint32_t address) { return &sim.flash[address - SIM_FLASH_START]; }
+
+// Length of the command being received, once its opcode and arguments are known
+static size_t command_size(void) {
+    if (command_length < 4) return 4;
+    if (memcmp(command, "SYNC", 4) == 0 || memcmp(command, "INFO", 4) == 0) return 4;
+    if (memcmp(command, "GOGO", 4) == 0) return 8;
+    if (memcmp(command, "SEAL", 4) == 0) return 16;
+    if (memcmp(command, "WRIT", 4) == 0) return command_length < 12 ? 12 : 12 + argument(1);
+    if (memcmp(command, "ERAS", 4) == 0 || memcmp(command, "READ", 4) == 0 || memcmp(command, "CRCC", 4) == 0) return 12;
+    return 4;  // Unknown opcodes are answered right away
+}
+
+static void erase(uint32_t address, uint32_t length) {
+    if ((address - SIM_FLASH_START) % SIM_ERASE_SIZE != 0 || length % SIM_ERASE_SIZE != 0 || !flash_range(address, length)) {
+        reply("ERR!", 4);
+        return;
+    }
+    memset(flash(address), 0xFF, length);
+    sim.erase_commands++;
+    sim.sealed = false;
+    for (uint32_t position = address, end = address + length; position < end;) {
+        // Aligned 64 KB blocks are erased with the block erase instruction, like flash_range_erase does
+        if (position % SIM_BLOCK_SIZE == 0 && end - position >= SIM_BLOCK_SIZE) {
+            device_busy += sim.block_erase_us;
+            position += SIM_BLOCK_SIZE;
+            sim.blocks_erased++;
+            sim.sectors_erased += SIM_BLOCK_SIZE / SIM_ERASE_SIZE;
+        } else {
+            device_busy += sim.sector_erase_us;
+            position += SIM_ERASE_SIZE;
+            sim.sectors_erased++;
+        }
+    }
+    reply("OKOK", 4);
+}
+
+static void write(uint32_t address, uint32_t length, const uint8_t* data) {
+    if (sim.fail_writes_after == 0 || (address - SIM_FLASH_START) % SIM_WRITE_SIZE != 0 || length % SIM_WRITE_SIZE != 0 || length > SIM_MAX_DATA_LEN ||
+        !flash_range(address, length)) {
+        reply("ERR!", 4);
+        return;
+    }
+    if (sim.fail_writes_after > 0) sim.fail_writes_after--;
+    for (uint32_t index = 0; index < length; index++) {
+        if (flash(address)[index] != 0xFF) {
+            fprintf(stderr, "SIM: write to flash that was not erased at 0x%08x\n", (unsigned) (address + index));
+            abort();
+        }
+    }
+    memcpy(flash(address), data, length);
+    sim.write_commands++;
+    sim.bytes_written += length;
+    sim.sealed = false;
+    device_busy += length / SIM_WRITE_SIZE * sim.page_write_us;
+    reply_word("OKOK", sim_crc32(data, length));
+}
+
+static void handle_command(void) {
+    sim.commands++;
+    if (memcmp(command, "SYNC", 4) == 0) {
+        if (device_busy < sim.sync_from) return;
+        if (sim.sync_noise) reply("PIPPI", 5);
+        reply("PICO", 4);
+    } else if (memcmp(command, "INFO", 4) == 0) {
+        uint32_t info[] = {SIM_FLASH_START, SIM_FLASH_SIZE, SIM_ERASE_SIZE, SIM_WRITE_SIZE, SIM_MAX_DATA_LEN};
+        reply("OKOK", 4);
+        reply(info, sizeof(info));
+    } else if (memcmp(command, "ERAS", 4) == 0) {
+        erase(argument(0), argument(1));
+    } else if (memcmp(command, "WRIT", 4) == 0) {
+        write(argument(0), argument(1), &command[12]);
+    } else if (memcmp(command, "READ", 4) == 0) {
+        uint32_t address = argument(0), length = argument(1);
+        if (!flash_range(address, length) || length > SIM_MAX_DATA_LEN) {
+            reply("ERR!", 4);
+            return;
+        }
+        uint8_t data[SIM_MAX_DATA_LEN];
+        memcpy(data, flash(address), length);
+        if (sim.corrupt_reads > 0 && length > 0) {
+            sim.corrupt_reads--;
+            data[length / 2] ^= 0x01;
+        }
+        sim.bytes_read += length;
+        reply("OKOK", 4);
+        reply(data, length);
+    } else if (memcmp(command, "CRCC", 4) == 0) {
+        // The DMA sniffer reads whole words
+        uint32_t address = argument(0), length = argument(1);
+        if (!flash_range(address, length) || address % 4 != 0 || length % 4 != 0) {
+            reply("ERR!", 4);
+            return;
+        }
+        sim.crc_commands++;
+        device_busy += (int64_t) length * SIM_CRC_NS_PER_BYTE / 1000;
+        reply_word("OKOK", sim_crc32(flash(address), length));
+    } else if (memcmp(command, "SEAL", 4) == 0) {
+        uint32_t address = argument(0), length = argument(1), crc = argument(2);
+        sim.seal_commands++;
+        device_busy += (int64_t) length * SIM_CRC_NS_PER_BYTE / 1000 + sim.sector_erase_us + sim.page_write_us;
+        if (!flash_range(address, length) || sim_crc32(flash(address), length) != crc) {
+            reply("ERR!", 4);
+            return;
+        }
+        sim.sealed        = true;
+        sim.sealed_length = length;
+        sim.sealed_crc    = crc;
+        reply("OKOK", 4);
+    } else if (memcmp(command, "GOGO", 4) == 0) {
+        if (!sim.go_fails) sim.in_bootloader = false;
+    } else {
+        reply("ERR!", 4);
+        awaiting_sync = true;
+    }
+}
+
+static void receive(uint8_t byte, int64_t at) {
+    // The firmware does not listen on the UART
+    if (!sim.in_bootloader) return;
+    // At a different baud rate the bootloader samples garbage, which never contains a valid opcode
+    if (!link_matches()) byte ^= 0xAA;
+    if (awaiting_sync) {
+        // Matched byte by byte, so SYNC is found whatever came before it
+        command_length = byte == "SYNC"[command_length] ? command_length + 1 : byte == 'S';
+        if (command_length < 4) return;
+        memcpy(command, "SYNC", 4);
+        awaiting_sync = false;
+    } else {
+        command[command_length++] = byte;
+        if (command_length < command_size()) return;
+    }
+    if (command_size() > MAX_COMMAND) {
+        command_length = 0;
+        return;
+    }
+    if (device_busy < at) device_busy = at;
+    device_busy += TURNAROUND_US;
+    handle_command();
+    command_length = 0;
+}
+
+// ESP32 side
+
+// Move the reply bytes that have arrived by now into the driver buffer
+static void deliver(void) {
+    int64_t now = sim_now();
+    while (line_count > 0 && line[line_head].at <= now) {
+        if (rx_count < rx_buffer_size) rx_buffer[(rx_head + rx_count++) % rx_buffer_size] = line[line_head].data;
+        line_head = (line_head + 1) % LINE_CAPACITY;
+        line_count--;
+    }
+}
+
+static uint32_t take(uint8_t* buffer, uint32_t length) {
+    uint32_t count = rx_count < length ? rx_count : length;
+    for (uint32_t index = 0; index < count; index++) buffer[index] = rx_buffer[(rx_head + index) % rx_buffer_size];
+    rx_head = (rx_head + count) % rx_buffer_size;
+    rx_count -= count;
+    return count;
+}
+
+esp_err_t uart_driver_install(uart_port_t uart_num, int rx_buffer_size_, int tx_buffer_size_, int queue_size, QueueHandle_t* uart_queue, int intr_alloc_flags) {
+    if (installed || rx_buffer_size_ <= FIFO_SIZE || (tx_buffer_size_ != 0 && tx_buffer_size_ <= FIFO_SIZE)) return ESP_FAIL;
+    rx_buffer = malloc(rx_buffer_size_);
+    if (rx_buffer == NULL) return ESP_ERR_NO_MEM;
+    installed      = true;
+    rx_buffer_size = rx_buffer_size_;
+    tx_buffer_size = tx_buffer_size_;
+    rx_head        = 0;
+    rx_count       = 0;
+    if (host_baudrate == 0) host_baudrate = 115200;
+    if (uart_queue != NULL) *uart_queue = NULL;
+    return ESP_OK;
+}
+
+esp_err_t uart_driver_delete(uart_port_t uart_num) {
+    if (!installed) return ESP_FAIL;
+    free(rx_buffer);
+    rx_buffer = NULL;
+    installed = false;
+    return ESP_OK;
+}
+
+bool uart_is_driver_installed(uart_port_t uart_num) { return installed; }
+
+esp_err_t uart_param_config(uart_port_t uart_num, const uart_config_t* uart_config) {
+    if (uart_config->baud_rate <= 0) return ESP_ERR_INVALID_ARG;
+    host_baudrate = uart_config->baud_rate;
+    return ESP_OK;
+}
+
+esp_err_t uart_set_pin(uart_port_t uart_num, int tx_io_num, int rx_io_num, int rts_io_num, int cts_io_num) { return ESP_OK; }
+
+esp_err_t uart_set_baudrate(uart_port_t uart_num, uint32_t baudrate) {
+    host_baudrate = baudrate;
+    return ESP_OK;
+}
+
+uint32_t sim_uart_baudrate(void) { return host_baudrate; }
+
+int uart_read_bytes(uart_port_t uart_num, void* buf, uint32_t length, TickType_t ticks_to_wait) {
+    if (!installed) return -1;
+    int64_t  deadline = sim_now() + (int64_t) ticks_to_wait * portTICK_PERIOD_MS * 1000;
+    uint32_t count    = 0;
+    for (;;) {
+        deliver();
+        count += take((uint8_t*) buf + count, length - count);
+        if (count == length || sim_now() >= deadline) return count;
+        // Sleep until the next byte arrives, or the deadline
+        int64_t next = line_count > 0 && line[line_head].at < deadline ? line[line_head].at : deadline;
+        sim_advance(next - sim_now());
+    }
+}
+
+int uart_write_bytes(uart_port_t uart_num, const void* src, size_t size) {
+    if (!installed) return -1;
+    int64_t now = sim_now();
+    if (tx_done < now) tx_done = now;
+    int64_t start = tx_done;
+    for (size_t index = 0; index < size; index++) receive(((const uint8_t*) src)[index], start + byte_time(index + 1));
+    tx_done = start + byte_time(size);
+    // The call returns once everything but the ring buffer and the FIFO has been transmitted
+    int64_t queued = byte_time(tx_buffer_size + FIFO_SIZE);
+    if (tx_done - now > queued) sim_advance(tx_done - queued - now);
+    return size;
+}
+
+esp_err_t uart_flush_input(uart_port_t uart_num) {
+    if (!installed) return ESP_FAIL;
+    deliver();
+    rx_head  = 0;
+    rx_count = 0;
+    return ESP_OK;
+}
+
+esp_err_t uart_wait_tx_done(uart_port_t uart_num, TickType_t ticks_to_wait) {
+    if (!installed) return ESP_FAIL;
+    if (tx_done > sim_now()) sim_advance(tx_done - sim_now());
+    return ESP_OK;
+}
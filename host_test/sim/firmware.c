@@ -0,0 +1,221 @@
+// The RP2040 firmware and bootloader as seen over I2C, the interrupt pin, and power and reset of both chips
+
+#include <driver/gpio.h>
+#include <driver/i2c_master.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rp2040.h"
+#include "sim.h"
+
+#define MAX_EVENTS 64
+#define MAX_PINS   64
+
+sim_t sim;
+
+struct i2c_master_dev_t {
+    uint16_t address;
+};
+
+typedef struct {
+    int64_t  at;
+    uint16_t values;
+    uint16_t changed;
+} event_t;
+
+static pthread_mutex_t event_lock = PTHREAD_MUTEX_INITIALIZER;
+static event_t         events[MAX_EVENTS];
+static size_t          event_count;
+static uint8_t         registers[RP2040_REG_COUNT];
+static pthread_mutex_t gpio_lock = PTHREAD_MUTEX_INITIALIZER;
+static gpio_isr_t      isr_handlers[MAX_PINS];
+static void*           isr_args[MAX_PINS];
+static bool            isr_enabled[MAX_PINS];
+
+void sim_bootloader_reset(bool host, bool device);  // bootloader.c
+void sim_storage_reset(void);                       // storage.c
+
+void sim_power_on(uint8_t fw_version) {
+    sim_kernel_reset();
+    sim_bootloader_reset(true, true);
+    sim_storage_reset();
+    pthread_mutex_lock(&event_lock);
+    event_count = 0;
+    pthread_mutex_unlock(&event_lock);
+    memset(sim.flash, 0xFF, sizeof(sim.flash));
+    memset(registers, 0, sizeof(registers));
+    sim.fw_version        = fw_version;
+    sim.in_bootloader     = false;
+    sim.bl_baudrate       = 921600;
+    sim.boot_polls        = 3;
+    sim.sync_from         = 0;
+    sim.sync_noise        = false;
+    sim.fail_writes_after = -1;
+    sim.corrupt_reads     = 0;
+    sim.go_fails          = false;
+    sim.sealed            = false;
+    sim.sector_erase_us   = SIM_SECTOR_ERASE_US;
+    sim.block_erase_us    = SIM_BLOCK_ERASE_US;
+    sim.page_write_us     = SIM_PAGE_WRITE_US;
+    sim.input_values      = 0;
+    sim.input_changed     = 0;
+    sim_clear_counters();
+}
+
+void sim_clear_counters(void) {
+    sim.commands       = 0;
+    sim.erase_commands = 0;
+    sim.sectors_erased = 0;
+    sim.blocks_erased  = 0;
+    sim.write_commands = 0;
+    sim.bytes_written  = 0;
+    sim.bytes_read     = 0;
+    sim.crc_commands   = 0;
+    sim.seal_commands  = 0;
+}
+
+void sim_reset_host(void) { sim_bootloader_reset(true, false); }
+
+void sim_reset_rp2040(void) {
+    sim_bootloader_reset(false, true);
+    sim.in_bootloader = false;
+}
+
+void sim_input_change(int64_t at, uint16_t values, uint16_t changed) {
+    pthread_mutex_lock(&event_lock);
+    if (event_count == MAX_EVENTS) abort();
+    size_t index = event_count++;
+    for (; index > 0 && events[index - 1].at > at; index--) events[index] = events[index - 1];
+    events[index] = (event_t) {.at = at, .values = values, .changed = changed};
+    pthread_mutex_unlock(&event_lock);
+}
+
+int64_t sim_run_events(int64_t until) {
+    for (;;) {
+        pthread_mutex_lock(&event_lock);
+        if (event_count == 0 || events[0].at > until) {
+            int64_t next = event_count > 0 ? events[0].at : INT64_MAX;
+            pthread_mutex_unlock(&event_lock);
+            return next;
+        }
+        event_t event = events[0];
+        memmove(&events[0], &events[1], --event_count * sizeof(event_t));
+        __atomic_store_n(&sim.input_values, event.values, __ATOMIC_RELAXED);
+        __atomic_or_fetch(&sim.input_changed, event.changed, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&event_lock);
+        // The firmware pulls the interrupt line low, which calls the handler of the pin it is wired to
+        pthread_mutex_lock(&gpio_lock);
+        for (int pin = 0; pin < MAX_PINS; pin++) {
+            if (isr_enabled[pin] && isr_handlers[pin] != NULL) isr_handlers[pin](isr_args[pin]);
+        }
+        pthread_mutex_unlock(&gpio_lock);
+    }
+}
+
+// I2C
+
+esp_err_t i2c_master_bus_add_device(i2c_master_bus_handle_t bus_handle, const i2c_device_config_t* dev_config, i2c_master_dev_handle_t* ret_handle) {
+    struct i2c_master_dev_t* device = malloc(sizeof(struct i2c_master_dev_t));
+    if (device == NULL) return ESP_ERR_NO_MEM;
+    device->address = dev_config->device_address;
+    __atomic_add_fetch(&sim.i2c_devices, 1, __ATOMIC_RELAXED);
+    *ret_handle = device;
+    return ESP_OK;
+}
+
+esp_err_t i2c_master_bus_rm_device(i2c_master_dev_handle_t handle) {
+    __atomic_sub_fetch(&sim.i2c_devices, 1, __ATOMIC_RELAXED);
+    free(handle);
+    return ESP_OK;
+}
+
+// A reboot takes a few transactions, during which the RP2040 does not acknowledge anything
+static bool rebooting(void) {
+    if (!sim.in_bootloader || sim.boot_polls <= 0) return false;
+    sim.boot_polls--;
+    return true;
+}
+
+static uint8_t read_register(uint8_t reg) {
+    if (sim.in_bootloader) {
+        switch (reg) {
+            case RP2040_BL_REG_FW_VER: return SIM_BOOTLOADER_FW;
+            case RP2040_BL_REG_BL_VER: return 1;
+            default: return 0;
+        }
+    }
+    uint16_t values  = __atomic_load_n(&sim.input_values, __ATOMIC_RELAXED);
+    uint16_t changed = __atomic_load_n(&sim.input_changed, __ATOMIC_RELAXED);
+    switch (reg) {
+        case RP2040_REG_FW_VER: return sim.fw_version;
+        case RP2040_REG_INPUT1: return values & 0xFF;
+        case RP2040_REG_INPUT2: return values >> 8;
+        case RP2040_REG_INTERRUPT1: return changed & 0xFF;
+        case RP2040_REG_INTERRUPT2: return changed >> 8;
+        default: return reg < RP2040_REG_COUNT ? registers[reg] : 0;
+    }
+}
+
+esp_err_t i2c_master_transmit_receive(i2c_master_dev_handle_t i2c_dev, const uint8_t* write_buffer, size_t write_size, uint8_t* read_buffer, size_t read_size,
+                                      int xfer_timeout_ms) {
+    sim_advance(SIM_I2C_US);
+    if (rebooting()) return ESP_FAIL;
+    bool flags_read = false;
+    for (size_t index = 0; index < read_size; index++) {
+        uint8_t reg        = write_buffer[0] + index;
+        read_buffer[index] = read_register(reg);
+        flags_read |= !sim.in_bootloader && (reg == RP2040_REG_INTERRUPT1 || reg == RP2040_REG_INTERRUPT2);
+    }
+    // Reading the interrupt flags clears them
+    if (flags_read) __atomic_store_n(&sim.input_changed, 0, __ATOMIC_RELAXED);
+    return ESP_OK;
+}
+
+esp_err_t i2c_master_transmit(i2c_master_dev_handle_t i2c_dev, const uint8_t* write_buffer, size_t write_size, int xfer_timeout_ms) {
+    sim_advance(SIM_I2C_US);
+    if (rebooting()) return ESP_FAIL;
+    if (sim.in_bootloader) return ESP_OK;
+    for (size_t index = 1; index < write_size; index++) {
+        uint8_t reg = write_buffer[0] + index - 1;
+        if (reg < RP2040_REG_COUNT) registers[reg] = write_buffer[index];
+        if (reg == RP2040_REG_BL_TRIGGER && write_buffer[index] == 0xBE) {
+            sim.in_bootloader = true;
+            sim.boot_polls    = 3;
+        }
+    }
+    return ESP_OK;
+}
+
+// GPIO
+
+esp_err_t gpio_config(const gpio_config_t* config) {
+    pthread_mutex_lock(&gpio_lock);
+    for (int pin = 0; pin < MAX_PINS; pin++) {
+        if (config->pin_bit_mask & (1ULL << pin)) isr_enabled[pin] = config->intr_type != GPIO_INTR_DISABLE;
+    }
+    pthread_mutex_unlock(&gpio_lock);
+    return ESP_OK;
+}
+
+esp_err_t gpio_reset_pin(gpio_num_t gpio_num) { return gpio_intr_disable(gpio_num); }
+
+esp_err_t gpio_intr_disable(gpio_num_t gpio_num) {
+    if (gpio_num < 0 || gpio_num >= MAX_PINS) return ESP_ERR_INVALID_ARG;
+    pthread_mutex_lock(&gpio_lock);
+    isr_enabled[gpio_num] = false;
+    pthread_mutex_unlock(&gpio_lock);
+    return ESP_OK;
+}
+
+esp_err_t gpio_isr_handler_add(gpio_num_t gpio_num, gpio_isr_t isr_handler, void* args) {
+    if (gpio_num < 0 || gpio_num >= MAX_PINS) return ESP_ERR_INVALID_ARG;
+    pthread_mutex_lock(&gpio_lock);
+    isr_handlers[gpio_num] = isr_handler;
+    isr_args[gpio_num]     = args;
+    pthread_mutex_unlock(&gpio_lock);
+    return ESP_OK;
+}
+
+esp_err_t gpio_isr_handler_remove(gpio_num_t gpio_num) { return gpio_isr_handler_add(gpio_num, NULL, NULL); }
@@ -0,0 +1,331 @@
+// Virtual clock, FreeRTOS tasks and semaphores on POSIX threads, and the small ESP-IDF system APIs
+
+#include <esp_err.h>
+#include <esp_log.h>
+#include <esp_random.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sim.h"
+
+int host_log_level = 0;
+
+__attribute__((constructor)) static void read_log_level(void) {
+    const char* level = getenv("HOST_TEST_LOG_LEVEL");
+    if (level != NULL) host_log_level = atoi(level);
+}
+
+static atomic_llong clock_us;
+static atomic_bool  realtime;
+static int64_t      realtime_base;
+static uint32_t     random_state = 1;
+
+static int64_t host_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int64_t sim_now(void) { return atomic_load(&realtime) ? host_us() - realtime_base : atomic_load(&clock_us); }
+
+void sim_set_realtime(bool enable) {
+    if (enable) realtime_base = host_us() - atomic_load(&clock_us);
+    else atomic_store(&clock_us, sim_now());
+    atomic_store(&realtime, enable);
+}
+
+// Move the clock forward to time, firing the events on the way
+static void advance_to(int64_t time) {
+    for (;;) {
+        int64_t next = sim_run_events(sim_now());
+        int64_t step = next < time ? next : time;
+        if (atomic_load(&realtime)) {
+            int64_t wait = step - sim_now();
+            if (wait > 0) usleep(wait);
+        } else {
+            // Other tasks may have moved the clock further already
+            long long now = atomic_load(&clock_us);
+            while (now < step && !atomic_compare_exchange_weak(&clock_us, &now, step)) {}
+        }
+        if (step >= time) break;
+    }
+    sim_run_events(sim_now());
+}
+
+void sim_advance(int64_t us) { advance_to(sim_now() + us); }
+
+void sim_kernel_reset(void) {
+    atomic_store(&realtime, false);
+    atomic_store(&clock_us, 0);
+    random_state = 1;
+}
+
+int64_t esp_timer_get_time(void) { return sim_now(); }
+
+uint32_t esp_random(void) {
+    // xorshift32, the same sequence in every run
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    return random_state;
+}
+
+const char* esp_err_to_name(esp_err_t code) {
+    switch (code) {
+        case ESP_OK: return "ESP_OK";
+        case ESP_FAIL: return "ESP_FAIL";
+        case ESP_ERR_NO_MEM: return "ESP_ERR_NO_MEM";
+        case ESP_ERR_INVALID_ARG: return "ESP_ERR_INVALID_ARG";
+        case ESP_ERR_INVALID_STATE: return "ESP_ERR_INVALID_STATE";
+        case ESP_ERR_INVALID_SIZE: return "ESP_ERR_INVALID_SIZE";
+        case ESP_ERR_NOT_FOUND: return "ESP_ERR_NOT_FOUND";
+        case ESP_ERR_NOT_SUPPORTED: return "ESP_ERR_NOT_SUPPORTED";
+        case ESP_ERR_TIMEOUT: return "ESP_ERR_TIMEOUT";
+        case ESP_ERR_INVALID_RESPONSE: return "ESP_ERR_INVALID_RESPONSE";
+        case ESP_ERR_INVALID_CRC: return "ESP_ERR_INVALID_CRC";
+        case ESP_ERR_INVALID_VERSION: return "ESP_ERR_INVALID_VERSION";
+        case ESP_ERR_NOT_FINISHED: return "ESP_ERR_NOT_FINISHED";
+    }
+    return "UNKNOWN ERROR";
+}
+
+// Semaphores
+
+struct sim_semaphore {
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    int             count;
+    int             max;
+    bool            heap;
+};
+
+_Static_assert(sizeof(struct sim_semaphore) <= sizeof(StaticSemaphore_t), "StaticSemaphore_t is too small");
+
+static SemaphoreHandle_t semaphore_init(struct sim_semaphore* semaphore, int count, bool heap) {
+    pthread_mutex_init(&semaphore->lock, NULL);
+    pthread_cond_init(&semaphore->cond, NULL);
+    semaphore->count = count;
+    semaphore->max   = 1;
+    semaphore->heap  = heap;
+    return semaphore;
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void) {
+    struct sim_semaphore* semaphore = malloc(sizeof(struct sim_semaphore));
+    if (semaphore == NULL) return NULL;
+    __atomic_add_fetch(&sim.heap_semaphores, 1, __ATOMIC_RELAXED);
+    return semaphore_init(semaphore, 0, true);
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinaryStatic(StaticSemaphore_t* buffer) { return semaphore_init((struct sim_semaphore*) buffer, 0, false); }
+
+static bool try_take(SemaphoreHandle_t semaphore) {
+    pthread_mutex_lock(&semaphore->lock);
+    bool taken = semaphore->count > 0;
+    if (taken) semaphore->count--;
+    pthread_mutex_unlock(&semaphore->lock);
+    return taken;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks_to_wait) {
+    if (ticks_to_wait == portMAX_DELAY) {
+        // Given by another task or an interrupt, both run on threads of their own
+        pthread_mutex_lock(&semaphore->lock);
+        while (semaphore->count == 0) pthread_cond_wait(&semaphore->cond, &semaphore->lock);
+        semaphore->count--;
+        pthread_mutex_unlock(&semaphore->lock);
+        return pdTRUE;
+    }
+    // A bounded wait is served by the events that are due before the deadline, one at a time
+    int64_t deadline = sim_now() + (int64_t) ticks_to_wait * portTICK_PERIOD_MS * 1000;
+    while (!try_take(semaphore)) {
+        int64_t now = sim_now();
+        if (now >= deadline) return pdFALSE;
+        int64_t next = sim_run_events(now);
+        advance_to(next < deadline ? next : deadline);
+        sched_yield();
+    }
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore) {
+    pthread_mutex_lock(&semaphore->lock);
+    bool given = semaphore->count < semaphore->max;
+    if (given) semaphore->count++;
+    pthread_cond_signal(&semaphore->cond);
+    pthread_mutex_unlock(&semaphore->lock);
+    return given ? pdTRUE : pdFALSE;
+}
+
+BaseType_t xSemaphoreGiveFromISR(SemaphoreHandle_t semaphore, BaseType_t* higher_priority_task_woken) {
+    if (higher_priority_task_woken != NULL) *higher_priority_task_woken = pdFALSE;
+    return xSemaphoreGive(semaphore);
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t semaphore) {
+    pthread_mutex_destroy(&semaphore->lock);
+    pthread_cond_destroy(&semaphore->cond);
+    if (!semaphore->heap) return;
+    __atomic_sub_fetch(&sim.heap_semaphores, 1, __ATOMIC_RELAXED);
+    free(semaphore);
+}
+
+// Tasks. All task state is guarded by one lock, so a task that exits never touches memory its deleter frees.
+
+struct sim_task {
+    TaskFunction_t function;
+    void*          arg;
+    eTaskState     state;
+    bool           heap;
+    bool           delete_requested;
+    bool           exited;
+    uint32_t       notifications;
+    pthread_t      thread;
+};
+
+static pthread_mutex_t task_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  task_cond = PTHREAD_COND_INITIALIZER;
+static struct sim_task main_task = {.state = eRunning};
+
+_Static_assert(sizeof(struct sim_task) <= sizeof(StaticTask_t), "StaticTask_t is too small");
+
+static _Thread_local struct sim_task* current_task;
+
+static void task_exit(struct sim_task* task) {
+    __atomic_sub_fetch(task->heap ? &sim.heap_tasks : &sim.static_tasks, 1, __ATOMIC_RELAXED);
+    task->state  = eDeleted;
+    task->exited = true;
+    pthread_cond_broadcast(&task_cond);
+}
+
+static void* task_thread(void* arg) {
+    current_task = arg;
+    pthread_mutex_lock(&task_lock);
+    if (current_task->state == eReady) current_task->state = eRunning;
+    pthread_mutex_unlock(&task_lock);
+    current_task->function(current_task->arg);
+    fprintf(stderr, "SIM: a task returned from its function\n");
+    abort();
+}
+
+// Static tasks keep their state in the buffer of the caller, like FreeRTOS keeps the TCB there
+static TaskHandle_t task_start(TaskFunction_t function, void* arg, StaticTask_t* buffer) {
+    bool             heap = buffer == NULL;
+    struct sim_task* task = heap ? malloc(sizeof(struct sim_task)) : (struct sim_task*) buffer;
+    if (task == NULL) return NULL;
+    memset(task, 0, sizeof(struct sim_task));
+    task->function = function;
+    task->arg      = arg;
+    task->state    = eReady;
+    task->heap     = heap;
+    __atomic_add_fetch(heap ? &sim.heap_tasks : &sim.static_tasks, 1, __ATOMIC_RELAXED);
+    // Joinable, so a task deleted by another one has released everything of its thread when vTaskDelete returns
+    if (pthread_create(&task->thread, NULL, task_thread, task) != 0) {
+        __atomic_sub_fetch(heap ? &sim.heap_tasks : &sim.static_tasks, 1, __ATOMIC_RELAXED);
+        if (heap) free(task);
+        return NULL;
+    }
+    return task;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t function, const char* name, configSTACK_DEPTH_TYPE stack_depth, void* arg, UBaseType_t priority,
+                       TaskHandle_t* created_task) {
+    TaskHandle_t task = task_start(function, arg, NULL);
+    if (created_task != NULL) *created_task = task;
+    return task != NULL ? pdPASS : pdFAIL;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t function, const char* name, configSTACK_DEPTH_TYPE stack_depth, void* arg, UBaseType_t priority,
+                                   TaskHandle_t* created_task, BaseType_t core_id) {
+    sim.last_task_core = core_id;
+    return xTaskCreate(function, name, stack_depth, arg, priority, created_task);
+}
+
+TaskHandle_t xTaskCreateStatic(TaskFunction_t function, const char* name, uint32_t stack_depth, void* arg, UBaseType_t priority, StackType_t* stack_buffer,
+                               StaticTask_t* task_buffer) {
+    if (stack_buffer == NULL || task_buffer == NULL) return NULL;
+    return task_start(function, arg, task_buffer);
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void) { return current_task != NULL ? current_task : &main_task; }
+
+void vTaskDelete(TaskHandle_t task) {
+    if (task == NULL || task == current_task) {
+        struct sim_task* self = current_task;
+        bool             heap = self->heap;
+        pthread_mutex_lock(&task_lock);
+        task_exit(self);
+        pthread_mutex_unlock(&task_lock);
+        if (heap) free(self);  // Nothing else refers to a task that deletes itself
+        pthread_detach(pthread_self());
+        pthread_exit(NULL);
+    }
+    // Only suspended or blocked tasks are deleted by others in this component; they exit when they wake up
+    pthread_mutex_lock(&task_lock);
+    task->delete_requested = true;
+    pthread_cond_broadcast(&task_cond);
+    while (!task->exited) pthread_cond_wait(&task_cond, &task_lock);
+    pthread_mutex_unlock(&task_lock);
+    pthread_join(task->thread, NULL);
+    if (task->heap) free(task);
+}
+
+void vTaskSuspend(TaskHandle_t task) {
+    if (task != NULL && task != current_task) {
+        fprintf(stderr, "SIM: only a task can suspend itself\n");
+        abort();
+    }
+    struct sim_task* self = current_task;
+    pthread_mutex_lock(&task_lock);
+    self->state = eSuspended;
+    pthread_cond_broadcast(&task_cond);
+    while (!self->delete_requested) pthread_cond_wait(&task_cond, &task_lock);
+    task_exit(self);
+    pthread_mutex_unlock(&task_lock);
+    pthread_exit(NULL);
+}
+
+eTaskState eTaskGetState(TaskHandle_t task) {
+    pthread_mutex_lock(&task_lock);
+    eTaskState state = task->state;
+    pthread_mutex_unlock(&task_lock);
+    return state;
+}
+
+void vTaskDelay(TickType_t ticks) {
+    sched_yield();
+    sim_advance((int64_t) ticks * portTICK_PERIOD_MS * 1000);
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task) {
+    pthread_mutex_lock(&task_lock);
+    task->notifications++;
+    pthread_cond_broadcast(&task_cond);
+    pthread_mutex_unlock(&task_lock);
+    return pdPASS;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear_on_exit, TickType_t ticks_to_wait) {
+    struct sim_task* self = xTaskGetCurrentTaskHandle();
+    pthread_mutex_lock(&task_lock);
+    if (ticks_to_wait != portMAX_DELAY && self->notifications == 0) {
+        pthread_mutex_unlock(&task_lock);
+        sim_advance((int64_t) ticks_to_wait * portTICK_PERIOD_MS * 1000);
+        pthread_mutex_lock(&task_lock);
+    }
+    while (ticks_to_wait == portMAX_DELAY && self->notifications == 0) pthread_cond_wait(&task_cond, &task_lock);
+    uint32_t value = self->notifications;
+    if (value > 0) self->notifications = clear_on_exit ? 0 : value - 1;
+    pthread_mutex_unlock(&task_lock);
+    return value;
+}
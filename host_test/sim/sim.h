@@ -0,0 +1,106 @@
+// Host simulation of the MCH2022 badge around the component: a virtual clock, FreeRTOS on threads, the RP2040 firmware
+// on I2C and its serial bootloader on the UART, a flash partition and NVS.
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Geometry the simulated bootloader reports in its INFO reply
+#define SIM_FLASH_START   0x10008000u
+#define SIM_FLASH_SIZE    (1024u * 1024u)
+#define SIM_ERASE_SIZE    4096u
+#define SIM_WRITE_SIZE    256u
+#define SIM_MAX_DATA_LEN  1024u
+#define SIM_BLOCK_SIZE    65536u
+#define SIM_BOOTLOADER_FW 0xFF  // Firmware version register while the bootloader runs
+
+// Typical time the RP2040 takes for flash operations with its W25Q16 flash, the defaults of the timing fields of sim_t
+#define SIM_SECTOR_ERASE_US 45000
+#define SIM_BLOCK_ERASE_US  150000
+#define SIM_PAGE_WRITE_US   400    // Per SIM_WRITE_SIZE bytes
+#define SIM_CRC_NS_PER_BYTE 10     // DMA sniffer CRC over XIP flash
+#define SIM_I2C_US          100    // One register transaction at 400 kHz
+#define SIM_PARTITION_SIZE  (1024u * 1024u)
+
+typedef struct {
+    // RP2040 flash and bootloader
+    uint8_t  flash[SIM_FLASH_SIZE];
+    uint8_t  fw_version;         // Reported by the firmware, SIM_BOOTLOADER_FW while in_bootloader
+    bool     in_bootloader;
+    uint32_t bl_baudrate;        // Baud rate the bootloader listens at, bytes sent at other rates arrive as garbage
+    int      boot_polls;         // Firmware version reads that still see the firmware after a reboot to the bootloader
+    int64_t  sync_from;          // SYNC is ignored before this time, a bootloader that is still starting
+    bool     sync_noise;         // Send stray bytes before every SYNC reply
+    int      fail_writes_after;  // WRIT commands accepted before every following one fails, -1 for never
+    int      corrupt_reads;      // READ replies that get a flipped bit
+    bool     go_fails;           // GO leaves the bootloader running, as if the firmware crashed at start
+    bool     sealed;
+    uint32_t sealed_length;
+    uint32_t sealed_crc;
+    uint32_t sector_erase_us;
+    uint32_t block_erase_us;
+    uint32_t page_write_us;
+
+    // Command counters, cleared by sim_clear_counters
+    uint32_t commands;
+    uint32_t erase_commands;
+    uint32_t sectors_erased;
+    uint32_t blocks_erased;
+    uint32_t write_commands;
+    uint32_t bytes_written;
+    uint32_t bytes_read;
+    uint32_t crc_commands;
+    uint32_t seal_commands;
+
+    // RP2040 input registers, see sim_input_change
+    uint16_t input_values;
+    uint16_t input_changed;
+
+    // ESP32 side
+    uint8_t partition[SIM_PARTITION_SIZE];
+    int     heap_semaphores;  // Created by xSemaphoreCreateBinary and not yet deleted
+    int     heap_tasks;       // Created by xTaskCreate or xTaskCreatePinnedToCore and still running
+    int     static_tasks;     // Created by xTaskCreateStatic and still running
+    int     last_task_core;   // Core passed to the last xTaskCreatePinnedToCore
+    int     i2c_devices;      // Added to the bus and not removed
+} sim_t;
+
+extern sim_t sim;
+
+// Power on: erased RP2040 flash running firmware version fw_version, nothing sealed, all faults off, erased partition and
+// NVS, clock at 0
+void sim_power_on(uint8_t fw_version);
+void sim_clear_counters(void);
+
+// The ESP32 resets: the UART driver is gone together with every byte in flight. The RP2040 keeps running.
+void sim_reset_host(void);
+// The RP2040 resets: the command it was receiving is lost and it starts its firmware again. Flash and seal survive.
+void sim_reset_rp2040(void);
+
+// The firmware reports the input values with the changed inputs flagged, and pulls the interrupt pin low, at the given time
+void sim_input_change(int64_t at, uint16_t values, uint16_t changed);
+
+// Baud rate the ESP32 UART is configured for
+uint32_t sim_uart_baudrate(void);
+
+// CRC-32 the way the RP2040 DMA sniffer calculates it, bit by bit, independent of rp2040_bl_crc32
+uint32_t sim_crc32(const uint8_t* data, uint32_t length);
+
+// The clock is virtual by default: waits return at once and advance it. In real time mode it follows the host clock, for
+// benchmarks where work on several threads overlaps.
+void    sim_set_realtime(bool realtime);
+void    sim_advance(int64_t us);
+int64_t sim_now(void);
+
+// Internal: fire the scheduled events due at or before the given time, in order, and return the time of the next one
+int64_t sim_run_events(int64_t until);
+void    sim_kernel_reset(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,102 @@
+// The flash partition holding an image, and NVS. Both keep their contents across sim_reset_host, like flash does.
+
+#include <esp_partition.h>
+#include <nvs.h>
+#include <string.h>
+
+#include "sim.h"
+
+#define NVS_ENTRIES   8
+#define NVS_KEY_LEN   16
+#define NVS_BLOB_SIZE 64
+
+typedef struct {
+    char    key[NVS_KEY_LEN];
+    uint8_t value[NVS_BLOB_SIZE];
+    size_t  length;
+    bool    used;
+} nvs_entry_t;
+
+static nvs_entry_t nvs_entries[NVS_ENTRIES];
+
+void sim_storage_reset(void) {
+    memset(sim.partition, 0xFF, sizeof(sim.partition));
+    memset(nvs_entries, 0, sizeof(nvs_entries));
+}
+
+static bool partition_range(const esp_partition_t* partition, size_t offset, size_t size) {
+    return offset <= partition->size && size <= partition->size - offset && offset + size <= sizeof(sim.partition);
+}
+
+esp_err_t esp_partition_mmap(const esp_partition_t* partition, size_t offset, size_t size, esp_partition_mmap_memory_t memory, const void** out_ptr,
+                             esp_partition_mmap_handle_t* out_handle) {
+    if (!partition_range(partition, offset, size)) return ESP_ERR_INVALID_ARG;
+    *out_ptr    = &sim.partition[offset];
+    *out_handle = 1;
+    return ESP_OK;
+}
+
+void esp_partition_munmap(esp_partition_mmap_handle_t handle) {}
+
+esp_err_t esp_partition_write(const esp_partition_t* partition, size_t dst_offset, const void* src, size_t size) {
+    if (!partition_range(partition, dst_offset, size)) return ESP_ERR_INVALID_SIZE;
+    // Flash bits only go from 1 to 0, writing without erasing first corrupts the data like it would on the chip
+    for (size_t index = 0; index < size; index++) sim.partition[dst_offset + index] &= ((const uint8_t*) src)[index];
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t* partition, size_t offset, size_t size) {
+    if (!partition_range(partition, offset, size) || offset % partition->erase_size != 0 || size % partition->erase_size != 0) return ESP_ERR_INVALID_ARG;
+    memset(&sim.partition[offset], 0xFF, size);
+    return ESP_OK;
+}
+
+esp_err_t nvs_open(const char* name_space, nvs_open_mode_t open_mode, nvs_handle_t* out_handle) {
+    *out_handle = 1;
+    return ESP_OK;
+}
+
+void nvs_close(nvs_handle_t handle) {}
+
+static nvs_entry_t* nvs_find(const char* key) {
+    for (size_t index = 0; index < NVS_ENTRIES; index++) {
+        if (nvs_entries[index].used && strncmp(nvs_entries[index].key, key, NVS_KEY_LEN) == 0) return &nvs_entries[index];
+    }
+    return NULL;
+}
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char* key, void* out_value, size_t* length) {
+    nvs_entry_t* entry = nvs_find(key);
+    if (entry == NULL) return ESP_ERR_NOT_FOUND;
+    if (out_value == NULL) {
+        *length = entry->length;
+        return ESP_OK;
+    }
+    if (*length < entry->length) return ESP_ERR_INVALID_SIZE;
+    memcpy(out_value, entry->value, entry->length);
+    *length = entry->length;
+    return ESP_OK;
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char* key, const void* value, size_t length) {
+    if (strlen(key) >= NVS_KEY_LEN || length > NVS_BLOB_SIZE) return ESP_ERR_INVALID_ARG;
+    nvs_entry_t* entry = nvs_find(key);
+    for (size_t index = 0; entry == NULL && index < NVS_ENTRIES; index++) {
+        if (!nvs_entries[index].used) entry = &nvs_entries[index];
+    }
+    if (entry == NULL) return ESP_ERR_NO_MEM;
+    strcpy(entry->key, key);
+    memcpy(entry->value, value, length);
+    entry->length = length;
+    entry->used   = true;
+    return ESP_OK;
+}
+
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char* key) {
+    nvs_entry_t* entry = nvs_find(key);
+    if (entry == NULL) return ESP_ERR_NOT_FOUND;
+    entry->used = false;
+    return ESP_OK;
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle) { return ESP_OK; }
@@ -0,0 +1,34 @@
+// Checks and a runner for the host tests. A failed check reports itself and the test carries on.
+#pragma once
+
+#include <stdio.h>
+
+static int test_failures;
+
+#define CHECK(condition)                                                                  \
+    do {                                                                                  \
+        if (!(condition)) {                                                               \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            test_failures++;                                                              \
+        }                                                                                 \
+    } while (0)
+
+#define CHECK_EQ(actual, expected)                                                                                                \
+    do {                                                                                                                          \
+        long long actual_   = (long long) (actual);                                                                               \
+        long long expected_ = (long long) (expected);                                                                             \
+        if (actual_ != expected_) {                                                                                               \
+            fprintf(stderr, "%s:%d: check failed: %s is %lld, expected %lld\n", __FILE__, __LINE__, #actual, actual_, expected_); \
+            test_failures++;                                                                                                      \
+        }                                                                                                                         \
+    } while (0)
+
+#define RUN_TEST(test)                                                                \
+    do {                                                                              \
+        int failures_before = test_failures;                                          \
+        test();                                                                       \
+        printf("%s %s\n", test_failures == failures_before ? "PASS" : "FAIL", #test); \
+        fflush(stdout);                                                               \
+    } while (0)
+
+#define TEST_RESULT() (printf("%d checks failed\n", test_failures), test_failures == 0 ? 0 : 1)
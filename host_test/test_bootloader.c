@@ -0,0 +1,223 @@
+// Bootloader protocol: CRC, sync, baud rate detection, UART installation, non-blocking commands, timeouts and flash dumps
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "rp2040bl.h"
+#include "rp2040source.h"
+#include "sim/sim.h"
+#include "test.h"
+
+static uint8_t data[300 * 1024];
+
+static void fill_random(uint8_t* buffer, size_t length) {
+    for (size_t index = 0; index < length; index++) buffer[index] = rand();
+}
+
+// Powers on with the RP2040 in its bootloader and a synced session
+static void start_session(rp2040_bl_t* bl) {
+    sim_power_on(0x15);
+    sim.in_bootloader = true;
+    *bl               = (rp2040_bl_t) RP2040_BL_DEFAULT_CONFIG();
+    CHECK_EQ(rp2040_bl_install_uart(bl), ESP_OK);
+    CHECK(rp2040_bl_sync(bl));
+}
+
+static void test_crc(void) {
+    const uint8_t check[] = "123456789";
+    CHECK_EQ(rp2040_bl_crc32(0, check, 9), 0xCBF43926);
+    CHECK_EQ(sim_crc32(check, 9), 0xCBF43926);
+    CHECK_EQ(rp2040_bl_crc32(0, check, 0), 0);
+
+    fill_random(data, 5000);
+    uint32_t whole = rp2040_bl_crc32(0, data, 5000);
+    CHECK_EQ(sim_crc32(data, 5000), whole);
+    for (uint32_t split = 0; split <= 5000; split += 313) {
+        uint32_t first = rp2040_bl_crc32(0, data, split), second = rp2040_bl_crc32(0, data + split, 5000 - split);
+        CHECK_EQ(rp2040_bl_crc32(first, data + split, 5000 - split), whole);
+        CHECK_EQ(rp2040_bl_crc32_combine(first, second, 5000 - split), whole);
+    }
+}
+
+static void test_sync_backoff(void) {
+    rp2040_bl_t bl;
+    start_session(&bl);
+    int64_t sync_time;
+
+    // A bootloader that is still starting is found soon after it starts answering
+    sim.sync_from = sim_now() + 37000;
+    CHECK(rp2040_bl_sync_wait(&bl, 1000000, &sync_time));
+    CHECK(sync_time >= 37000 && sync_time < 60000);
+
+    // Stray bytes before the reply do not prevent the match
+    sim.sync_from  = 0;
+    sim.sync_noise = true;
+    CHECK(rp2040_bl_sync_wait(&bl, 1000000, &sync_time));
+    sim.sync_noise = false;
+
+    // Without an answer the deadline is kept
+    sim.in_bootloader = false;
+    int64_t start     = sim_now();
+    CHECK(!rp2040_bl_sync_wait(&bl, 300000, NULL));
+    CHECK(sim_now() - start >= 300000 && sim_now() - start < 320000);
+    rp2040_bl_uninstall_uart(&bl);
+}
+
+static void test_detect_baudrate(void) {
+    const uint32_t rates[] = {115200, 460800, 921600, 2000000};
+    rp2040_bl_t    bl;
+    start_session(&bl);
+    CHECK_EQ(rp2040_bl_detect_baudrate(&bl, rates, 4, 200000), 921600);
+    CHECK_EQ(sim_uart_baudrate(), 921600);
+    rp2040_bl_uninstall_uart(&bl);
+
+    // The fastest rate that works is kept. The garbage the bootloader received at the other rates is answered with errors,
+    // the session is usable right away all the same.
+    start_session(&bl);
+    sim.bl_baudrate = 460800;
+    CHECK_EQ(rp2040_bl_detect_baudrate(&bl, rates, 4, 0), 460800);
+    uint32_t crc;
+    CHECK(rp2040_bl_crc(&bl, SIM_FLASH_START, 4096, &crc));
+    CHECK_EQ(crc, sim_crc32(sim.flash, 4096));
+    rp2040_bl_uninstall_uart(&bl);
+}
+
+static void test_installed_driver(void) {
+    sim_power_on(0x15);
+    sim.in_bootloader = true;
+    // Another user, for example the console, installed the driver at a different baud rate
+    CHECK_EQ(uart_driver_install(UART_NUM_0, 4096, 0, 0, NULL, 0), ESP_OK);
+    uart_set_baudrate(UART_NUM_0, 115200);
+    rp2040_bl_t bl = {.uart = UART_NUM_0, .pin_tx = -1, .pin_rx = -1, .baudrate = 921600, .rx_buffer_size = 2048, .timing = RP2040_BL_DEFAULT_TIMING()};
+    CHECK_EQ(rp2040_bl_install_uart(&bl), ESP_OK);
+    CHECK_EQ(sim_uart_baudrate(), 921600);
+    CHECK_EQ(bl._erase_size, RP2040_BL_DEFAULT_ERASE_SIZE);
+    CHECK_EQ(bl._write_size, RP2040_BL_DEFAULT_WRITE_SIZE);
+    CHECK(rp2040_bl_sync(&bl));
+    CHECK(rp2040_bl_erase(&bl, SIM_FLASH_START, 4096));
+
+    // Reconfiguring under commands in flight would lose their replies
+    memset(data, 0x5A, 256);
+    CHECK(rp2040_bl_write_start(&bl, SIM_FLASH_START, 256, data));
+    CHECK_EQ(rp2040_bl_install_uart(&bl), ESP_ERR_INVALID_STATE);
+    uint32_t crc;
+    CHECK(rp2040_bl_write_finish(&bl, &crc));
+    CHECK_EQ(crc, rp2040_bl_crc32(0, data, 256));
+    CHECK_EQ(rp2040_bl_install_uart(&bl), ESP_OK);
+    uart_driver_delete(UART_NUM_0);
+}
+
+static void test_pending_commands(void) {
+    rp2040_bl_t bl;
+    start_session(&bl);
+    fill_random(sim.flash, 4096);
+
+    // Replies are collected in order, polling never blocks
+    static uint8_t buffer[1024];
+    CHECK(rp2040_bl_read_start(&bl, SIM_FLASH_START, 512, buffer));
+    CHECK(rp2040_bl_read_start(&bl, SIM_FLASH_START + 1024, 512, buffer + 512));
+    CHECK_EQ(rp2040_bl_pending(&bl), 2);
+    esp_err_t res;
+    int       polls = 0;
+    int64_t   start = sim_now();
+    while ((res = rp2040_bl_poll(&bl, 0)) == ESP_ERR_NOT_FINISHED) {
+        CHECK_EQ(sim_now(), start);
+        sim_advance(100);
+        start = sim_now();
+        polls++;
+    }
+    CHECK_EQ(res, ESP_OK);
+    CHECK(polls > 0);
+    CHECK(rp2040_bl_read_finish(&bl));
+    CHECK(!rp2040_bl_write_finish(&bl, &(uint32_t) {0}));  // Not the opcode of the oldest command
+    CHECK(rp2040_bl_read_finish(&bl));
+    CHECK_EQ(rp2040_bl_pending(&bl), 0);
+    CHECK(memcmp(buffer, sim.flash, 512) == 0);
+    CHECK(memcmp(buffer + 512, sim.flash + 1024, 512) == 0);
+
+    // An error reply fails the command and the session carries on
+    CHECK(!rp2040_bl_erase(&bl, SIM_FLASH_START + 1, 4096));
+    CHECK_EQ(rp2040_bl_pending(&bl), 0);
+    CHECK(rp2040_bl_sync(&bl));
+
+    // A failed write discards the commands behind it
+    CHECK(rp2040_bl_erase(&bl, SIM_FLASH_START + 0x10000, 4096));
+    sim.fail_writes_after = 1;
+    CHECK(rp2040_bl_write_start(&bl, SIM_FLASH_START + 0x10000, 256, data));
+    CHECK(rp2040_bl_write_start(&bl, SIM_FLASH_START + 0x10100, 256, data));
+    CHECK(rp2040_bl_write_start(&bl, SIM_FLASH_START + 0x10200, 256, data));
+    uint32_t crc;
+    CHECK(rp2040_bl_write_finish(&bl, &crc));
+    CHECK(!rp2040_bl_write_finish(&bl, &crc));
+    CHECK_EQ(rp2040_bl_pending(&bl), 0);
+    // Their error replies are still on the way, waiting for the sync reply skips them
+    sim.fail_writes_after = -1;
+    CHECK(rp2040_bl_sync_wait(&bl, 100000, NULL));
+    CHECK(rp2040_bl_sync(&bl));
+    rp2040_bl_uninstall_uart(&bl);
+}
+
+static void test_learned_timeouts(void) {
+    rp2040_bl_t bl;
+    start_session(&bl);
+    uint32_t flash_start, flash_size, erase_size, write_size, max_data_len;
+    CHECK(rp2040_bl_get_info(&bl, &flash_start, &flash_size, &erase_size, &write_size, &max_data_len));
+    for (int sector = 0; sector < 8; sector++) CHECK(rp2040_bl_erase(&bl, SIM_FLASH_START + sector * 4096, 4096));
+    CHECK(bl.timing.learned_erase_us > 0 && bl.timing.learned_erase_us < 60000);
+    CHECK(rp2040_bl_estimate_erase_time(&bl, SIM_FLASH_START, 4096) < 100000);
+
+    // The flash slows down, but stays within its worst case: the fast erases learned above must not shorten the timeout
+    sim.sector_erase_us = 350000;
+    CHECK(rp2040_bl_erase(&bl, SIM_FLASH_START, 4096));
+    sim.page_write_us = 2500;
+    CHECK(rp2040_bl_write(&bl, SIM_FLASH_START, 1024, data, &(uint32_t) {0}));
+    rp2040_bl_uninstall_uart(&bl);
+}
+
+static void test_dump(void) {
+    rp2040_bl_t bl;
+    start_session(&bl);
+    fill_random(sim.flash, sizeof(data));
+
+    static uint8_t         out[sizeof(data)];
+    rp2040_sink_t          sink;
+    rp2040_bl_dump_stats_t stats;
+    rp2040_sink_to_buffer(&sink, out);
+    CHECK(rp2040_bl_dump(&bl, SIM_FLASH_START, sizeof(out), &sink, &stats));
+    CHECK(memcmp(out, sim.flash, sizeof(out)) == 0);
+    CHECK_EQ(stats.bytes, sizeof(out));
+    CHECK_EQ(stats.crc_retries, 0);
+    // Pipelined reads keep the line busy, the raw rate of 921600 baud is 92160 bytes per second
+    CHECK(stats.bytes_per_second > 85000);
+
+    // Corrupted batches are read again, also into a partition
+    esp_partition_t partition = {.address = 0, .size = SIM_PARTITION_SIZE, .erase_size = 4096};
+    sim.corrupt_reads         = 2;
+    rp2040_sink_to_partition(&sink, &partition);
+    CHECK(rp2040_bl_dump(&bl, SIM_FLASH_START, 200004, &sink, &stats));
+    rp2040_sink_close(&sink);
+    CHECK(memcmp(sim.partition, sim.flash, 200004) == 0);
+    CHECK(stats.crc_retries > 0);
+
+    // The bootloader could not calculate the CRC of a partial word at the end
+    rp2040_sink_to_buffer(&sink, out);
+    CHECK(!rp2040_bl_dump(&bl, SIM_FLASH_START, 1001, &sink, &stats));
+    CHECK(!rp2040_bl_dump(&bl, SIM_FLASH_START + 2, 1000, &sink, &stats));
+
+    // A link that corrupts everything fails
+    sim.corrupt_reads = 1000;
+    rp2040_sink_to_buffer(&sink, out);
+    CHECK(!rp2040_bl_dump(&bl, SIM_FLASH_START, 1000, &sink, &stats));
+    rp2040_bl_uninstall_uart(&bl);
+}
+
+int main(void) {
+    RUN_TEST(test_crc);
+    RUN_TEST(test_sync_backoff);
+    RUN_TEST(test_detect_baudrate);
+    RUN_TEST(test_installed_driver);
+    RUN_TEST(test_pending_commands);
+    RUN_TEST(test_learned_timeouts);
+    RUN_TEST(test_dump);
+    return TEST_RESULT();
+}
@@ -0,0 +1,218 @@
+// Coroutines: the executor, bootloader commands with one or more in flight, input changes, register access and freeing of frames
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+
+#include "rp2040coro.hpp"
+#include "sim/sim.h"
+#include "test.h"
+
+#define PIN_INTERRUPT 34
+#define BASE          0x10010000u
+
+static uint8_t     image[64 * 1024];
+static rp2040_bl_t bl;
+
+static void start_session() {
+    sim_power_on(0x15);
+    sim.in_bootloader = true;
+    bl                = RP2040_BL_DEFAULT_CONFIG();
+    CHECK_EQ(rp2040_bl_install_uart(&bl), ESP_OK);
+    CHECK(rp2040_bl_sync(&bl));
+}
+
+static rp2040::task write_range(rp2040::bl_channel& channel, uint32_t offset, uint32_t length) {
+    for (uint32_t position = offset; position < offset + length; position += SIM_MAX_DATA_LEN) {
+        uint32_t crc;
+        if (!co_await channel.write(BASE + position, SIM_MAX_DATA_LEN, image + position, &crc)) co_return ESP_FAIL;
+        if (crc != rp2040_bl_crc32(0, image + position, SIM_MAX_DATA_LEN)) co_return ESP_ERR_INVALID_CRC;
+    }
+    co_return ESP_OK;
+}
+
+// Erases, then writes the two halves from two coroutines that share the channel, and reads a piece back
+static rp2040::task flash(rp2040::executor& loop, rp2040::bl_channel& channel) {
+    if (!co_await channel.erase(BASE, sizeof(image))) co_return ESP_FAIL;
+    esp_err_t first = ESP_ERR_NOT_FINISHED;
+    CHECK_EQ(loop.spawn(write_range(channel, 0, sizeof(image) / 2), &first), ESP_OK);
+    esp_err_t second = co_await write_range(channel, sizeof(image) / 2, sizeof(image) / 2);
+    while (first == ESP_ERR_NOT_FINISHED) co_await loop.sleep_for(1000);
+    if (first != ESP_OK) co_return first;
+    static uint8_t back[SIM_MAX_DATA_LEN];
+    if (!co_await channel.read(BASE + 5 * SIM_MAX_DATA_LEN, sizeof(back), back)) co_return ESP_FAIL;
+    if (memcmp(back, image + 5 * SIM_MAX_DATA_LEN, sizeof(back)) != 0) co_return ESP_ERR_INVALID_RESPONSE;
+    co_return second;
+}
+
+static int64_t flash_with_window(uint8_t window) {
+    start_session();
+    rp2040::executor   loop;
+    rp2040::bl_channel channel(loop, &bl, window);
+    esp_err_t          result = ESP_ERR_NOT_FINISHED;
+    int64_t            start  = sim_now();
+    CHECK_EQ(loop.spawn(flash(loop, channel), &result), ESP_OK);
+    CHECK(rp2040::get_frame_stats().frames > 0);
+    CHECK_EQ(loop.run(), ESP_OK);
+    CHECK_EQ(result, ESP_OK);
+    CHECK(memcmp(sim.flash + BASE - SIM_FLASH_START, image, sizeof(image)) == 0);
+    CHECK_EQ(rp2040_bl_pending(&bl), 0);
+    CHECK_EQ(rp2040::get_frame_stats().frames, 0);
+    return sim_now() - start;
+}
+
+static void test_channel() {
+    int64_t one  = flash_with_window(1);
+    int64_t four = flash_with_window(4);
+    printf("64 KB from two coroutines: %lld ms with one command in flight, %lld ms with four\n", (long long) one / 1000, (long long) four / 1000);
+    CHECK(four < one);
+}
+
+// Twelve writes each from two coroutines, one of them to an address that is not aligned
+static void write_with_failure(uint8_t window, int* succeeded, int* failed) {
+    start_session();
+    CHECK(rp2040_bl_erase(&bl, BASE, 2 * SIM_BLOCK_SIZE));
+    rp2040::executor   loop;
+    rp2040::bl_channel channel(loop, &bl, window);
+    auto               writes = [&](uint32_t base, bool misaligned) -> rp2040::task {
+        for (uint32_t index = 0; index < 12; index++) {
+            uint32_t address = base + index * SIM_WRITE_SIZE + (misaligned && index == 3 ? 1 : 0);
+            if (co_await channel.write(address, SIM_WRITE_SIZE, image)) {
+                (*succeeded)++;
+            } else {
+                (*failed)++;
+            }
+        }
+        co_return ESP_OK;
+    };
+    *succeeded = *failed = 0;
+    CHECK_EQ(loop.spawn(writes(BASE, false)), ESP_OK);
+    CHECK_EQ(loop.spawn(writes(BASE + SIM_BLOCK_SIZE, true)), ESP_OK);
+    CHECK_EQ(loop.run(), ESP_OK);
+    CHECK_EQ(*succeeded + *failed, 24);
+    CHECK_EQ(rp2040_bl_pending(&bl), 0);
+    CHECK_EQ(rp2040::get_frame_stats().frames, 0);
+}
+
+static void test_channel_failure() {
+    // With one command in flight only the failing command fails
+    int succeeded, failed;
+    write_with_failure(1, &succeeded, &failed);
+    CHECK_EQ(failed, 1);
+    CHECK(rp2040_bl_sync(&bl));
+
+    // The session discards the commands that were in flight with it, and their replies must be skipped before the next sync
+    write_with_failure(4, &succeeded, &failed);
+    CHECK(failed > 1);
+    CHECK(rp2040_bl_sync_wait(&bl, 100000, nullptr));
+}
+
+static rp2040::task collect(rp2040::input_events& inputs, rp2040::input_event* events, int count) {
+    for (int index = 0; index < count; index++) {
+        esp_err_t res = co_await inputs.next(events[index]);
+        if (res != ESP_OK) co_return res;
+        // The next changes only come once the first one was seen
+        if (index == 0) {
+            uint16_t changed = 1 << RP2040_INPUT_BUTTON_HOME | 1 << RP2040_INPUT_BUTTON_BACK;
+            sim_input_change(esp_timer_get_time() + 30000, 1 << RP2040_INPUT_BUTTON_HOME, changed);
+        }
+    }
+    co_return ESP_OK;
+}
+
+static rp2040::task blink(rp2040::executor& loop, rp2040::async_device<0x09>& device, int* blinks) {
+    for (int index = 0; index < 5; index++) {
+        esp_err_t res = co_await device.write<rp2040::lcd_backlight>(index & 1 ? 255 : 0);
+        if (res != ESP_OK) co_return res;
+        co_await loop.sleep_for(50 * 1000);
+        (*blinks)++;
+    }
+    co_return ESP_OK;
+}
+
+static void test_inputs_and_registers() {
+    sim_power_on(0x15);
+    RP2040 device = {.i2c_address = 0x17, .pin_interrupt = PIN_INTERRUPT};
+    CHECK_EQ(rp2040_init(&device), ESP_OK);
+    {
+        rp2040::executor           loop;
+        rp2040::input_events       inputs(loop, &device);
+        rp2040::async_device<0x09> registers(&device);
+        rp2040::input_event        events[3] = {};
+        int                        blinks    = 0;
+        esp_err_t                  collected = ESP_FAIL, blinked = ESP_FAIL;
+        sim_input_change(sim_now() + 120000, 1 << RP2040_INPUT_JOYSTICK_PRESS, 1 << RP2040_INPUT_JOYSTICK_PRESS);
+        int64_t start = sim_now();
+        CHECK_EQ(loop.spawn(collect(inputs, events, 3), &collected), ESP_OK);
+        CHECK_EQ(loop.spawn(blink(loop, registers, &blinks), &blinked), ESP_OK);
+        CHECK_EQ(loop.run(), ESP_OK);
+        CHECK_EQ(collected, ESP_OK);
+        CHECK_EQ(blinked, ESP_OK);
+        CHECK_EQ(blinks, 5);
+        CHECK(sim_now() - start >= 250000);
+        CHECK_EQ(events[0].input, RP2040_INPUT_JOYSTICK_PRESS);
+        CHECK(events[0].state);
+        CHECK_EQ(events[1].input, RP2040_INPUT_BUTTON_HOME);
+        CHECK(events[1].state);
+        CHECK_EQ(events[2].input, RP2040_INPUT_BUTTON_BACK);
+        CHECK(!events[2].state);
+        CHECK_EQ(inputs.dropped(), 0);
+        uint8_t backlight;
+        CHECK_EQ(rp2040_get_lcd_backlight(&device, &backlight), ESP_OK);
+        CHECK_EQ(backlight, 0);
+    }
+    CHECK_EQ(rp2040::get_frame_stats().frames, 0);
+    CHECK_EQ(rp2040_deinit(&device), ESP_OK);
+}
+
+static rp2040::task stuck() {
+    co_await std::suspend_always{};
+    co_return ESP_OK;
+}
+
+static rp2040::task never_run() { co_return ESP_OK; }
+
+static void test_frames() {
+    {
+        // A task that waits for nothing the executor knows about ends the run instead of blocking forever
+        rp2040::executor loop;
+        CHECK_EQ(loop.spawn(stuck()), ESP_OK);
+        CHECK_EQ(loop.run(), ESP_ERR_INVALID_STATE);
+        CHECK_EQ(loop.tasks(), 1);
+
+        // A task that does not fit is freed right away, the others are freed with the executor
+        for (size_t index = 1; index < rp2040::executor::max_tasks; index++) CHECK_EQ(loop.spawn(never_run()), ESP_OK);
+        CHECK_EQ(loop.spawn(never_run()), ESP_ERR_NO_MEM);
+        CHECK_EQ(rp2040::get_frame_stats().frames, rp2040::executor::max_tasks);
+    }
+    CHECK_EQ(rp2040::get_frame_stats().frames, 0);
+    CHECK_EQ(rp2040::get_frame_stats().bytes, 0);
+}
+
+static void test_ready_queue() {
+    // Every task fits, one more coroutine stops the program instead of overwriting one that is waiting to be resumed
+    rp2040::executor loop;
+    for (size_t index = 0; index < rp2040::executor::max_tasks; index++) loop.schedule(std::noop_coroutine());
+    pid_t child = fork();
+    if (child == 0) {
+        loop.schedule(std::noop_coroutine());
+        _exit(0);
+    }
+    int status;
+    CHECK_EQ(waitpid(child, &status, 0), child);
+    CHECK(WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT);
+}
+
+int main() {
+    srand(72);
+    for (size_t index = 0; index < sizeof(image); index++) image[index] = rand();
+    RUN_TEST(test_channel);
+    RUN_TEST(test_channel_failure);
+    RUN_TEST(test_inputs_and_registers);
+    RUN_TEST(test_frames);
+    RUN_TEST(test_ready_queue);
+    return TEST_RESULT();
+}
@@ -0,0 +1,164 @@
+// Driver lifecycle: repeated init and deinit, input changes, failed inits, and the static and minimal configurations
+
+#include <stdatomic.h>
+#include <string.h>
+
+#include "rp2040.h"
+#include "rp2040update.h"
+#include "sim/sim.h"
+#include "test.h"
+
+#ifdef __SANITIZE_ADDRESS__
+size_t __sanitizer_get_current_allocated_bytes(void);  // sanitizer/allocator_interface.h, not installed everywhere
+#define heap_in_use() __sanitizer_get_current_allocated_bytes()
+#else
+#include <malloc.h>
+#define heap_in_use() mallinfo2().uordblks
+#endif
+
+#define PIN_INTERRUPT 34
+
+static atomic_int changes;
+static atomic_int last_change;
+
+static void on_input(rp2040_input_t input, bool state) {
+    atomic_store(&last_change, input << 1 | state);
+    atomic_fetch_add(&changes, 1);
+}
+
+static void check_released(void) {
+    CHECK_EQ(sim.heap_tasks, 0);
+    CHECK_EQ(sim.static_tasks, 0);
+    CHECK_EQ(sim.heap_semaphores, 0);
+    CHECK_EQ(sim.i2c_devices, 0);
+}
+
+static void test_cycles(void) {
+    sim_power_on(0x15);
+    RP2040 device = {.i2c_address = 0x17, .pin_interrupt = PIN_INTERRUPT, .callback = on_input};
+    size_t heap   = 0;
+    for (int cycle = 0; cycle < 2000; cycle++) {
+        CHECK_EQ(rp2040_init(&device), ESP_OK);
+        CHECK_EQ(rp2040_deinit(&device), ESP_OK);
+        // Allocations of the first cycles may stay, such as those of the thread library, after that nothing may grow
+        if (cycle == 10) heap = heap_in_use();
+    }
+    CHECK_EQ(heap_in_use(), heap);
+    check_released();
+    CHECK_EQ(atomic_load(&changes), 0);
+}
+
+static void test_input(void) {
+    sim_power_on(0x15);
+    atomic_store(&changes, 0);
+    RP2040 device = {.i2c_address = 0x17, .pin_interrupt = PIN_INTERRUPT, .callback = on_input};
+    CHECK_EQ(rp2040_init(&device), ESP_OK);
+#if CONFIG_RP2040_STATIC_ALLOCATION
+    CHECK_EQ(sim.static_tasks, 1);
+    CHECK_EQ(sim.heap_tasks, 0);
+    CHECK_EQ(sim.heap_semaphores, 0);
+#else
+    CHECK_EQ(sim.heap_tasks, 1);
+    CHECK_EQ(sim.heap_semaphores, 1);
+#endif
+
+    // The joystick is pressed, the interrupt task reads the change and reports it
+    sim_input_change(sim_now() + 1000, 1 << RP2040_INPUT_JOYSTICK_PRESS, 1 << RP2040_INPUT_JOYSTICK_PRESS);
+    for (int wait = 0; wait < 100 && atomic_load(&changes) == 0; wait++) vTaskDelay(1);
+    CHECK_EQ(atomic_load(&changes), 1);
+    CHECK_EQ(atomic_load(&last_change), RP2040_INPUT_JOYSTICK_PRESS << 1 | 1);
+
+    // Released together with a button press
+    sim_input_change(sim_now() + 1000, 1 << RP2040_INPUT_BUTTON_HOME, 1 << RP2040_INPUT_JOYSTICK_PRESS | 1 << RP2040_INPUT_BUTTON_HOME);
+    for (int wait = 0; wait < 100 && atomic_load(&changes) < 3; wait++) vTaskDelay(1);
+    CHECK_EQ(atomic_load(&changes), 3);
+
+    // Deinit waits for a change that is being handled
+    sim_input_change(sim_now(), 0, 1 << RP2040_INPUT_BUTTON_HOME);
+    CHECK_EQ(rp2040_deinit(&device), ESP_OK);
+    check_released();
+    int handled = atomic_load(&changes);
+    sim_input_change(sim_now() + 1000, 1, 1);
+    vTaskDelay(10);
+    CHECK_EQ(atomic_load(&changes), handled);
+}
+
+static void test_without_callback(void) {
+    // The trigger is left to the caller
+    sim_power_on(0x15);
+    RP2040  device = {.i2c_address = 0x17, .pin_interrupt = PIN_INTERRUPT};
+    int64_t start  = sim_now();
+    CHECK_EQ(rp2040_init(&device), ESP_OK);
+    // A single register transaction, with a callback the interrupt task reads the inputs right after
+    CHECK_EQ(sim_now() - start, SIM_I2C_US);
+    CHECK_EQ(sim.heap_tasks + sim.static_tasks, 0);
+    CHECK(xSemaphoreTake(device._intr_trigger, 0));
+    sim_input_change(sim_now() + 1000, 0, 1);
+    CHECK(xSemaphoreTake(device._intr_trigger, pdMS_TO_TICKS(5)));
+    CHECK_EQ(rp2040_deinit(&device), ESP_OK);
+    check_released();
+}
+
+static void test_failed_init(void) {
+    // Firmware that is too old, deinit cleans up after the failed init and can be repeated
+    sim_power_on(0);
+    RP2040 device = {.i2c_address = 0x17, .pin_interrupt = PIN_INTERRUPT, .callback = on_input};
+    CHECK_EQ(rp2040_init(&device), ESP_ERR_INVALID_VERSION);
+    CHECK_EQ(rp2040_deinit(&device), ESP_OK);
+    CHECK_EQ(rp2040_deinit(&device), ESP_OK);
+    check_released();
+
+    // The RP2040 does not answer while it reboots
+    sim_power_on(0x15);
+    sim.in_bootloader = true;
+    CHECK_EQ(rp2040_init(&device), ESP_FAIL);
+    CHECK_EQ(rp2040_deinit(&device), ESP_OK);
+    check_released();
+
+    // Writes never cover more than the register map
+    sim_power_on(0x15);
+    CHECK_EQ(rp2040_init(&device), ESP_OK);
+    uint8_t values[RP2040_REG_COUNT + 1] = {0};
+    CHECK_EQ(rp2040_write_reg(&device, RP2040_REG_SCRATCH0, values, RP2040_REG_COUNT + 1), ESP_ERR_INVALID_SIZE);
+    CHECK_EQ(rp2040_write_reg(&device, 0, values, RP2040_REG_COUNT), ESP_OK);
+    CHECK_EQ(rp2040_deinit(&device), ESP_OK);
+    check_released();
+}
+
+static void test_configuration(void) {
+    sim_power_on(0x15);
+    RP2040 device = {.i2c_address = 0x17, .pin_interrupt = PIN_INTERRUPT, .callback = on_input};
+    CHECK_EQ(rp2040_init(&device), ESP_OK);
+#if CONFIG_RP2040_STATIC_ALLOCATION
+    _Static_assert(RP2040_STATIC_FOOTPRINT <= CONFIG_RP2040_STATIC_MEMORY_BUDGET, "over budget");
+    printf("RP2040_STATIC_FOOTPRINT is %zu bytes with a %d byte stack\n", RP2040_STATIC_FOOTPRINT, CONFIG_RP2040_INTR_TASK_STACK_SIZE);
+#endif
+#if CONFIG_RP2040_GPIO
+    CHECK_EQ(rp2040_set_gpio_dir(&device, 2, true), ESP_OK);
+#else
+    CHECK_EQ(rp2040_set_gpio_dir(&device, 2, true), ESP_ERR_NOT_SUPPORTED);
+#endif
+    // Last, the firmware API is unavailable from here on
+#if CONFIG_RP2040_BOOTLOADER
+    CHECK_EQ(rp2040_reboot_to_bootloader(&device), ESP_OK);
+#else
+    // The stubs keep an update path building and report at runtime that it is not available
+    CHECK_EQ(rp2040_reboot_to_bootloader(&device), ESP_ERR_NOT_SUPPORTED);
+    rp2040_update_t update = {0};
+    CHECK_EQ(rp2040_update_init(&update), ESP_ERR_NOT_SUPPORTED);
+    CHECK_EQ(rp2040_update_step(&update), ESP_ERR_NOT_SUPPORTED);
+    bool needed;
+    CHECK_EQ(rp2040_update_check(&device, NULL, NULL, &needed), ESP_ERR_NOT_SUPPORTED);
+#endif
+    CHECK_EQ(rp2040_deinit(&device), ESP_OK);
+    check_released();
+}
+
+int main(void) {
+    RUN_TEST(test_cycles);
+    RUN_TEST(test_input);
+    RUN_TEST(test_without_callback);
+    RUN_TEST(test_failed_init);
+    RUN_TEST(test_configuration);
+    return TEST_RESULT();
+}
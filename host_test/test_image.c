@@ -0,0 +1,172 @@
+// Sparse UF2 and ELF images: parsing, and updates that leave sectors without data untouched
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "image_files.h"
+#include "rp2040.h"
+#include "rp2040update.h"
+#include "sim/sim.h"
+#include "test.h"
+
+#define OLD_FIRMWARE 0xA5  // Contents of the flash before the update
+
+static uint8_t data[64 * 1024];
+
+// 64 KB of data in three ranges over a 329 KB span, the last one not sector aligned
+static const image_range_t ranges[] = {
+    {.address = 0x10008000, .length = 24 * 1024, .data = data},
+    {.address = 0x10030000, .length = 20 * 1024, .data = data + 24 * 1024},
+    {.address = 0x10055400, .length = 20 * 1024, .data = data + 44 * 1024},
+};
+#define RANGE_COUNT (sizeof(ranges) / sizeof(ranges[0]))
+#define SPAN        (0x1005A400 - SIM_FLASH_START)
+
+static bool in_range(uint32_t address) {
+    for (size_t index = 0; index < RANGE_COUNT; index++) {
+        if (address >= ranges[index].address && address < ranges[index].address + ranges[index].length) return true;
+    }
+    return false;
+}
+
+static bool sector_has_data(uint32_t offset) {
+    uint32_t start = offset - offset % SIM_ERASE_SIZE;
+    for (uint32_t address = start; address < start + SIM_ERASE_SIZE; address += SIM_WRITE_SIZE) {
+        if (in_range(SIM_FLASH_START + address)) return true;
+    }
+    return false;
+}
+
+static void check_image(const rp2040_image_t* image) {
+    CHECK_EQ(image->start, 0x10008000);
+    CHECK_EQ(image->end, 0x1005A400);
+    CHECK_EQ(image->populated_bytes, sizeof(data));
+    CHECK(rp2040_image_is_populated(image, 0x10008000, 1));
+    CHECK(!rp2040_image_is_populated(image, 0x1000E000, 0x22000));
+    CHECK(rp2040_image_is_populated(image, 0x1000E000, 0x22001));
+}
+
+// Flashes the image, then checks every byte of the span: data where the image has it, padding in the sectors that were
+// written and the old firmware in the sectors that were left alone
+static void update_and_check(uint8_t* file, uint32_t length, bool in_order) {
+    sim_power_on(0x15);
+    memset(sim.flash, OLD_FIRMWARE, sizeof(sim.flash));
+    RP2040 device = {.i2c_address = 0x17, .pin_interrupt = -1};
+    CHECK_EQ(rp2040_init(&device), ESP_OK);
+
+    rp2040_source_t file_source, source;
+    rp2040_image_t  image;
+    rp2040_source_from_buffer(&file_source, file, length);
+    CHECK_EQ(rp2040_image_load(&image, &file_source), ESP_OK);
+    check_image(&image);
+    // Data stored in address order is merged into one segment per range
+    if (in_order) CHECK_EQ(image.segment_count, RANGE_COUNT);
+    else CHECK(image.segment_count > RANGE_COUNT);
+    CHECK_EQ(rp2040_source_from_image(&source, &file_source, &image), ESP_OK);
+    CHECK_EQ(source.length, SPAN);
+
+    rp2040_bl_t     bl     = RP2040_BL_DEFAULT_CONFIG();
+    rp2040_update_t update = {.device = &device, .bl = &bl, .source = &source, .verify = RP2040_UPDATE_VERIFY_FULL};
+    CHECK_EQ(rp2040_update_init(&update), ESP_OK);
+    CHECK_EQ(rp2040_update_run(&update), ESP_OK);
+    rp2040_update_deinit(&update);
+
+    int wrong = 0;
+    for (uint32_t offset = 0; offset < SPAN; offset++) {
+        uint32_t address  = SIM_FLASH_START + offset;
+        uint8_t  expected = OLD_FIRMWARE;
+        if (in_range(address)) {
+            expected = data[offset < 24 * 1024 ? offset : address < 0x10055400 ? address - 0x10030000 + 24 * 1024 : address - 0x10055400 + 44 * 1024];
+        } else if (sector_has_data(offset)) {
+            expected = 0xFF;
+        }
+        if (sim.flash[offset] != expected) wrong++;
+    }
+    CHECK_EQ(wrong, 0);
+    CHECK(sim.sealed);
+    CHECK_EQ(sim.sealed_length, SPAN);
+    CHECK_EQ(sim.sealed_crc, sim_crc32(sim.flash, SPAN));
+    CHECK(update.stats.sectors_unpopulated > 60);
+    CHECK_EQ(update.stats.bytes_written, sizeof(data));
+
+    // Nothing is written when the image is already there
+    uint8_t version;
+    CHECK_EQ(rp2040_get_firmware_version(&device, &version), ESP_OK);
+    sim_clear_counters();
+    CHECK_EQ(rp2040_update_init(&update), ESP_OK);
+    CHECK_EQ(rp2040_update_run(&update), ESP_OK);
+    rp2040_update_deinit(&update);
+    CHECK_EQ(sim.erase_commands, 0);
+    CHECK_EQ(sim.write_commands, 0);
+
+    rp2040_image_free(&image);
+    rp2040_deinit(&device);
+}
+
+static void test_uf2(void) {
+    uint8_t* file;
+    uint32_t length = build_uf2(ranges, RANGE_COUNT, false, &file);
+    update_and_check(file, length, true);
+    free(file);
+
+    // Out of order blocks are sorted, most are segments of their own as their neighbours are elsewhere in the file
+    length = build_uf2(ranges, RANGE_COUNT, true, &file);
+    update_and_check(file, length, false);
+
+    // A file that is not made of whole blocks is rejected
+    rp2040_source_t source;
+    rp2040_image_t  image;
+    rp2040_source_from_buffer(&source, file, length - 1);
+    CHECK_EQ(rp2040_image_load(&image, &source), ESP_ERR_INVALID_SIZE);
+    file[512 + 508]++;
+    rp2040_source_from_buffer(&source, file, length);
+    CHECK_EQ(rp2040_image_load(&image, &source), ESP_ERR_INVALID_ARG);
+    free(file);
+}
+
+static void test_elf(void) {
+    uint8_t* file;
+    uint32_t length = build_elf(ranges, RANGE_COUNT, &file);
+    update_and_check(file, length, true);
+
+    rp2040_source_t source;
+    rp2040_image_t  image;
+    rp2040_source_from_buffer(&source, file, length - 200);
+    CHECK_EQ(rp2040_image_load(&image, &source), ESP_ERR_INVALID_SIZE);
+    file[18] = 3;  // x86
+    rp2040_source_from_buffer(&source, file, length);
+    CHECK_EQ(rp2040_image_load(&image, &source), ESP_ERR_INVALID_ARG);
+    free(file);
+}
+
+static void test_overlap(void) {
+    // Overlapping ranges are an error, adjacent ones are merged
+    image_range_t overlapping[] = {
+        {.address = 0x10008000, .length = 1024, .data = data},
+        {.address = 0x10008200, .length = 1024, .data = data},
+    };
+    uint8_t*        file;
+    uint32_t        length = build_elf(overlapping, 2, &file);
+    rp2040_source_t source;
+    rp2040_image_t  image;
+    rp2040_source_from_buffer(&source, file, length);
+    CHECK_EQ(rp2040_image_load(&image, &source), ESP_ERR_INVALID_ARG);
+    free(file);
+
+    overlapping[1].address = 0x10008400;
+    length                 = build_elf(overlapping, 2, &file);
+    rp2040_source_from_buffer(&source, file, length);
+    CHECK_EQ(rp2040_image_load(&image, &source), ESP_OK);
+    CHECK_EQ(image.segment_count, 1);
+    rp2040_image_free(&image);
+    free(file);
+}
+
+int main(void) {
+    srand(1);
+    for (size_t index = 0; index < sizeof(data); index++) data[index] = rand();
+    RUN_TEST(test_uf2);
+    RUN_TEST(test_elf);
+    RUN_TEST(test_overlap);
+    return TEST_RESULT();
+}
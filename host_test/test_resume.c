@@ -0,0 +1,200 @@
+// Resuming interrupted updates: the ESP32, or both chips, reset after every step of an update, writes fail repeatedly, and
+// an update without a journal is cut off before its seal
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "rp2040.h"
+#include "rp2040update.h"
+#include "sim/sim.h"
+#include "test.h"
+
+#define IMAGE_SIZE (40 * 1024)
+
+static uint8_t                 image[IMAGE_SIZE];
+static uint8_t                 old_image[IMAGE_SIZE];
+static RP2040                  device;
+static rp2040_bl_t             bl;
+static rp2040_update_journal_t journal;
+
+static void fill(uint8_t* buffer, size_t length, uint32_t seed) {
+    srand(seed);
+    for (size_t index = 0; index < length; index++) buffer[index] = rand();
+}
+
+// The application starts: the driver is initialised, which fails while the RP2040 is still rebooting
+static void start_application(void) {
+    bl = (rp2040_bl_t) RP2040_BL_DEFAULT_CONFIG();
+    for (int attempt = 0; attempt < 10; attempt++) {
+        device = (RP2040) {.i2c_address = 0x17, .pin_interrupt = -1};
+        if (rp2040_init(&device) == ESP_OK) break;
+        rp2040_deinit(&device);
+        vTaskDelay(pdMS_TO_TICKS(10));
+    }
+    CHECK_EQ(rp2040_update_journal_open_nvs(&journal, "rp2040"), ESP_OK);
+}
+
+// Whatever the application held is gone, the buffers are only released to keep the sanitizer quiet
+static void stop_application(rp2040_update_t* update) {
+    rp2040_update_deinit(update);
+    rp2040_update_journal_close_nvs(&journal);
+    rp2040_deinit(&device);
+}
+
+// Flashes an older image, so the update compares sectors as well
+static void power_on(void) {
+    sim_power_on(0x15);
+    memcpy(sim.flash, old_image, sizeof(old_image));
+}
+
+static void check_flashed(void) {
+    CHECK(memcmp(sim.flash, image, sizeof(image)) == 0);
+    CHECK(sim.sealed);
+    CHECK_EQ(sim.sealed_length, sizeof(image));
+    CHECK_EQ(sim.sealed_crc, sim_crc32(image, sizeof(image)));
+    CHECK(!sim.in_bootloader);
+}
+
+static esp_err_t complete(rp2040_update_t* update) {
+    CHECK_EQ(rp2040_update_init(update), ESP_OK);
+    return rp2040_update_run(update);
+}
+
+static int count_steps(void) {
+    power_on();
+    start_application();
+    rp2040_source_t source;
+    rp2040_source_from_buffer(&source, image, sizeof(image));
+    rp2040_update_t update = {.device = &device, .bl = &bl, .source = &source, .journal = &journal};
+    CHECK_EQ(rp2040_update_init(&update), ESP_OK);
+    int steps = 1;
+    while (rp2040_update_step(&update) == ESP_ERR_NOT_FINISHED) steps++;
+    CHECK_EQ(update._state, RP2040_UPDATE_STATE_DONE);
+    stop_application(&update);
+    return steps;
+}
+
+static void reset_after_every_step(bool reset_rp2040) {
+    int  total     = count_steps();
+    bool hit[RP2040_UPDATE_STATE_FAILED + 1] = {false};
+    int  resumed   = 0;
+    for (int steps = 1; steps < total; steps++) {
+        power_on();
+        start_application();
+        rp2040_source_t source;
+        rp2040_source_from_buffer(&source, image, sizeof(image));
+        rp2040_update_t update = {.device = &device, .bl = &bl, .source = &source, .journal = &journal};
+        CHECK_EQ(rp2040_update_init(&update), ESP_OK);
+        for (int step = 0; step < steps; step++) CHECK_EQ(rp2040_update_step(&update), ESP_ERR_NOT_FINISHED);
+        hit[update._state] = true;
+
+        stop_application(&update);
+        sim_reset_host();
+        if (reset_rp2040) sim_reset_rp2040();
+
+        start_application();
+        update = (rp2040_update_t) {.device = &device, .bl = &bl, .source = &source, .journal = &journal};
+        esp_err_t res = complete(&update);
+        CHECK_EQ(res, ESP_OK);
+        if (res != ESP_OK) fprintf(stderr, "Update failed after a reset following step %d\n", steps);
+        check_flashed();
+        if (update.stats.resumed_bytes > 0) resumed++;
+        stop_application(&update);
+    }
+    for (rp2040_update_state_t state = RP2040_UPDATE_STATE_REBOOT; state <= RP2040_UPDATE_STATE_SEAL; state++) {
+        if (!hit[state]) fprintf(stderr, "No reset in state %s\n", rp2040_update_state_to_name(state));
+        CHECK(hit[state]);
+    }
+    printf("%d resets, %d updates resumed\n", total - 1, resumed);
+    CHECK(resumed > 0);
+}
+
+static void test_reset_host(void) { reset_after_every_step(false); }
+
+static void test_reset_both(void) { reset_after_every_step(true); }
+
+static void test_failing_writes(void) {
+    power_on();
+    start_application();
+    rp2040_source_t source;
+    rp2040_source_from_buffer(&source, image, sizeof(image));
+    rp2040_update_t update   = {.device = &device, .bl = &bl, .source = &source, .journal = &journal};
+    int             attempts = 0;
+    esp_err_t       res;
+    do {
+        // Every seventh write fails
+        sim.fail_writes_after = 6;
+        attempts++;
+        res = complete(&update);
+        if (attempts > 1) CHECK(update.stats.resumed_bytes > 0 || update.stats.sectors_skipped > 0);
+        if (res != ESP_OK) {
+            // The update can be started again without rebooting, from the bootloader that is still running
+            rp2040_update_deinit(&update);
+            CHECK_EQ(rp2040_get_firmware_version(&device, &(uint8_t) {0}), ESP_OK);
+            CHECK_EQ(device._fw_version, 0xFF);
+        }
+    } while (res != ESP_OK && attempts < 100);
+    CHECK_EQ(res, ESP_OK);
+    CHECK(attempts > 5);
+    check_flashed();
+    stop_application(&update);
+}
+
+static void test_changed_image(void) {
+    power_on();
+    start_application();
+    rp2040_source_t source;
+    rp2040_source_from_buffer(&source, image, sizeof(image));
+    rp2040_update_t update = {.device = &device, .bl = &bl, .source = &source, .journal = &journal};
+    CHECK_EQ(rp2040_update_init(&update), ESP_OK);
+    while (update._position < sizeof(image) / 2) CHECK_EQ(rp2040_update_step(&update), ESP_ERR_NOT_FINISHED);
+    stop_application(&update);
+    sim_reset_host();
+
+    // The journal belongs to the image that was being written
+    image[100]++;
+    start_application();
+    update = (rp2040_update_t) {.device = &device, .bl = &bl, .source = &source, .journal = &journal};
+    CHECK_EQ(complete(&update), ESP_OK);
+    CHECK_EQ(update.stats.resumed_bytes, 0);
+    check_flashed();
+    stop_application(&update);
+    image[100]--;
+}
+
+static void test_unsealed_without_journal(void) {
+    // Every byte is written, the ESP32 resets right before the seal
+    power_on();
+    start_application();
+    rp2040_source_t source;
+    rp2040_source_from_buffer(&source, image, sizeof(image));
+    rp2040_update_t update = {.device = &device, .bl = &bl, .source = &source};
+    CHECK_EQ(rp2040_update_init(&update), ESP_OK);
+    while (update._state != RP2040_UPDATE_STATE_SEAL) CHECK_EQ(rp2040_update_step(&update), ESP_ERR_NOT_FINISHED);
+    stop_application(&update);
+    sim_reset_host();
+    CHECK(sim.in_bootloader);
+    CHECK(!sim.sealed);
+
+    // The next update finds the image in flash and seals it before starting it
+    start_application();
+    sim_clear_counters();
+    update = (rp2040_update_t) {.device = &device, .bl = &bl, .source = &source};
+    CHECK_EQ(complete(&update), ESP_OK);
+    CHECK_EQ(sim.write_commands, 0);
+    CHECK_EQ(sim.seal_commands, 1);
+    check_flashed();
+    stop_application(&update);
+}
+
+int main(void) {
+    fill(image, sizeof(image), 1);
+    fill(old_image, sizeof(old_image), 2);
+    memcpy(old_image + 10 * 1024, image + 10 * 1024, 10 * 1024);  // Some sectors are already up to date
+    RUN_TEST(test_reset_host);
+    RUN_TEST(test_reset_both);
+    RUN_TEST(test_failing_writes);
+    RUN_TEST(test_changed_image);
+    RUN_TEST(test_unsealed_without_journal);
+    return TEST_RESULT();
+}
@@ -0,0 +1,210 @@
+// Image sources: files, streams, decompression of compressed containers and prefetching on a task of its own
+
+#include <freertos/FreeRTOS.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "rp2040source.h"
+#include "sim/sim.h"
+#include "test.h"
+
+static uint8_t     data[100000];
+static const char* build_dir = ".";
+
+static uint8_t* read_file(const char* name, uint32_t* length) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s", build_dir, name);
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "Missing %s, run the tests through run.sh\n", path);
+        exit(1);
+    }
+    fseek(file, 0, SEEK_END);
+    *length         = ftell(file);
+    uint8_t* buffer = malloc(*length);
+    fseek(file, 0, SEEK_SET);
+    if (fread(buffer, 1, *length, file) != *length) exit(1);
+    fclose(file);
+    return buffer;
+}
+
+// Reads the whole source front to back in pieces of the given size and compares it with expected
+static bool read_all(rp2040_source_t* source, const uint8_t* expected, uint32_t piece) {
+    static uint8_t buffer[8192];
+    for (uint32_t offset = 0; offset < source->length; offset += piece) {
+        uint32_t       length = source->length - offset < piece ? source->length - offset : piece;
+        const uint8_t* read   = source->fetch(source, offset, buffer, length);
+        if (read == NULL || memcmp(read, expected + offset, length) != 0) return false;
+    }
+    return true;
+}
+
+typedef struct {
+    uint32_t position;
+    uint32_t fail_at;  // The stream fails when it reaches this position
+} stream_t;
+
+static bool read_stream(void* arg, uint8_t* buffer, uint32_t length) {
+    stream_t* stream = arg;
+    if (stream->position + length > stream->fail_at) return false;
+    memcpy(buffer, data + stream->position, length);
+    stream->position += length;
+    return true;
+}
+
+static void test_file_and_stream(void) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s/source_test.bin", build_dir);
+    FILE* file = fopen(path, "wb");
+    fwrite(data, 1, sizeof(data), file);
+    fclose(file);
+
+    rp2040_source_t source;
+    CHECK_EQ(rp2040_source_open_file(&source, path), ESP_OK);
+    CHECK_EQ(source.length, sizeof(data));
+    CHECK(!source.sequential);
+    CHECK(read_all(&source, data, 1000));
+    uint8_t buffer[16];
+    CHECK(memcmp(source.fetch(&source, 5000, buffer, 16), data + 5000, 16) == 0);
+    CHECK(source.fetch(&source, sizeof(data) - 8, buffer, 16) == NULL);
+    rp2040_source_close(&source);
+    remove(path);
+    CHECK_EQ(rp2040_source_open_file(&source, path), ESP_ERR_NOT_FOUND);
+
+    // A stream can only be read in order
+    stream_t stream = {.fail_at = UINT32_MAX};
+    rp2040_source_from_stream(&source, sizeof(data), read_stream, &stream);
+    CHECK(source.sequential);
+    CHECK(read_all(&source, data, 1024));
+    CHECK(source.fetch(&source, 0, buffer, 16) == NULL);
+}
+
+static void test_decompress(void) {
+    uint32_t image_length, compressed_length, bad_length;
+    uint8_t* image      = read_file("image.bin", &image_length);
+    uint8_t* compressed = read_file("image.rphs", &compressed_length);
+    uint8_t* bad        = read_file("image_bad.rphs", &bad_length);
+    CHECK(compressed_length < image_length);
+
+    rp2040_source_t container, source;
+    rp2040_source_from_buffer(&container, compressed, compressed_length);
+    CHECK_EQ(rp2040_source_decompress(&source, &container), ESP_OK);
+    CHECK_EQ(source.length, image_length);
+    CHECK(source.sequential);
+    // The window of the default 11 bit window and the decoder state, independent of the image size
+    CHECK(source.heap_bytes > 2048 && source.heap_bytes < 2048 + 512);
+    CHECK(read_all(&source, image, 1024));
+    rp2040_source_close(&source);
+
+    // Unaligned pieces as the update fetches them after padding
+    CHECK_EQ(rp2040_source_decompress(&source, &container), ESP_OK);
+    CHECK(read_all(&source, image, 777));
+    rp2040_source_close(&source);
+
+    // The fetch that completes an image that does not match the CRC in the header fails
+    rp2040_source_from_buffer(&container, bad, bad_length);
+    CHECK_EQ(rp2040_source_decompress(&source, &container), ESP_OK);
+    static uint8_t buffer[1024];
+    for (uint32_t offset = 0; offset < source.length; offset += 1024) {
+        const uint8_t* read = source.fetch(&source, offset, buffer, 1024);
+        CHECK((read == NULL) == (offset + 1024 >= source.length));
+    }
+    rp2040_source_close(&source);
+
+    // Not a container, or parameters that would need more memory than allowed
+    rp2040_source_from_buffer(&container, image, image_length);
+    CHECK_EQ(rp2040_source_decompress(&source, &container), ESP_ERR_INVALID_ARG);
+    compressed[4] = 13;
+    rp2040_source_from_buffer(&container, compressed, compressed_length);
+    CHECK_EQ(rp2040_source_decompress(&source, &container), ESP_ERR_NOT_SUPPORTED);
+    free(image);
+    free(compressed);
+    free(bad);
+}
+
+// The prefetch task lets go of its state and deletes itself after closing has returned
+static void wait_for_prefetch_task(void) {
+    for (int attempt = 0; attempt < 1000; attempt++) {
+        if (__atomic_load_n(&sim.heap_tasks, __ATOMIC_RELAXED) == 0 && __atomic_load_n(&sim.heap_semaphores, __ATOMIC_RELAXED) == 0) return;
+        usleep(1000);
+    }
+}
+
+static void test_prefetch(void) {
+    rp2040_source_t          inner, source;
+    rp2040_prefetch_config_t config = RP2040_PREFETCH_DEFAULT_CONFIG();
+    rp2040_source_from_buffer(&inner, data, sizeof(data));
+    CHECK_EQ(rp2040_source_prefetch(&source, &inner, &config), ESP_OK);
+    CHECK_EQ(sim.last_task_core, tskNO_AFFINITY);  // No second core on the host
+    CHECK(source.heap_bytes >= config.chunk_size * config.chunk_count + config.stack_size);
+    CHECK(read_all(&source, data, 1000));
+    CHECK(read_all(&source, data, 4096));
+
+    // Random access: seeks backwards and far ahead restart the task, short skips are served from the pool
+    uint8_t buffer[3000];
+    srand(68);
+    for (int fetch = 0; fetch < 2000; fetch++) {
+        uint32_t       length = 1 + rand() % sizeof(buffer);
+        uint32_t       offset = rand() % (sizeof(data) - length);
+        const uint8_t* read   = source.fetch(&source, offset, buffer, length);
+        CHECK(read != NULL && memcmp(read, data + offset, length) == 0);
+    }
+    CHECK(source.fetch(&source, sizeof(data) - 10, buffer, 20) == NULL);
+    rp2040_source_close(&source);
+    wait_for_prefetch_task();
+    CHECK_EQ(sim.heap_tasks, 0);
+    CHECK_EQ(sim.heap_semaphores, 0);
+
+    // Pinned to the core asked for
+    config.core = 0;
+    CHECK_EQ(rp2040_source_prefetch(&source, &inner, &config), ESP_OK);
+    CHECK_EQ(sim.last_task_core, 0);
+    rp2040_source_close(&source);
+
+    config.chunk_count = RP2040_SOURCE_PREFETCH_MAX_CHUNKS + 1;
+    CHECK_EQ(rp2040_source_prefetch(&source, &inner, &config), ESP_ERR_INVALID_ARG);
+}
+
+static void test_prefetch_stream(void) {
+    // A failing inner source fails the fetch of the data it could not deliver, and only that
+    stream_t                 stream = {.fail_at = 50000};
+    rp2040_source_t          inner, source;
+    rp2040_prefetch_config_t config = RP2040_PREFETCH_DEFAULT_CONFIG();
+    rp2040_source_from_stream(&inner, sizeof(data), read_stream, &stream);
+    CHECK_EQ(rp2040_source_prefetch(&source, &inner, &config), ESP_OK);
+    CHECK(source.sequential);
+    uint8_t buffer[1000];
+    for (uint32_t offset = 0; offset < sizeof(data); offset += sizeof(buffer)) {
+        const uint8_t* read = source.fetch(&source, offset, buffer, sizeof(buffer));
+        if (offset + sizeof(buffer) <= 49152) CHECK(read != NULL && memcmp(read, data + offset, sizeof(buffer)) == 0);
+        if (offset >= 50000) CHECK(read == NULL);
+    }
+    rp2040_source_close(&source);
+
+    // Stacked on a decompressing source, which then runs on the prefetch task
+    uint32_t image_length, compressed_length;
+    uint8_t* image      = read_file("image.bin", &image_length);
+    uint8_t* compressed = read_file("image.rphs", &compressed_length);
+    rp2040_source_t container, decompressed;
+    rp2040_source_from_buffer(&container, compressed, compressed_length);
+    CHECK_EQ(rp2040_source_decompress(&decompressed, &container), ESP_OK);
+    CHECK_EQ(rp2040_source_prefetch(&source, &decompressed, &config), ESP_OK);
+    CHECK(source.heap_bytes > decompressed.heap_bytes + config.chunk_size * config.chunk_count);
+    CHECK(read_all(&source, image, 1024));
+    rp2040_source_close(&source);
+    rp2040_source_close(&decompressed);
+    free(image);
+    free(compressed);
+}
+
+int main(int argc, char** argv) {
+    if (argc > 1) build_dir = argv[1];
+    srand(1);
+    for (size_t index = 0; index < sizeof(data); index++) data[index] = rand();
+    RUN_TEST(test_file_and_stream);
+    RUN_TEST(test_decompress);
+    RUN_TEST(test_prefetch);
+    RUN_TEST(test_prefetch_stream);
+    return TEST_RESULT();
+}
@@ -0,0 +1,388 @@
+// Update engine: sources, unchanged sectors, erase batching, verification, stepping, the manifest check, restarting and memory use
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "rp2040.h"
+#include "rp2040update.h"
+#include "sim/sim.h"
+#include "test.h"
+
+#define IMAGE_SIZE (200 * 1024)
+
+static uint8_t     image[IMAGE_SIZE];
+static RP2040      device;
+static rp2040_bl_t bl;
+static const char* build_dir = ".";
+
+static void fill_image(uint32_t seed) {
+    srand(seed);
+    for (size_t index = 0; index < sizeof(image); index++) image[index] = rand();
+}
+
+// Powers on with the RP2040 running its firmware and the driver initialised
+static void boot(void) {
+    sim_power_on(0x15);
+    rp2040_deinit(&device);
+    device = (RP2040) {.i2c_address = 0x17, .pin_interrupt = -1};
+    CHECK_EQ(rp2040_init(&device), ESP_OK);
+    bl = (rp2040_bl_t) RP2040_BL_DEFAULT_CONFIG();
+}
+
+// The firmware runs again after an update, the driver reads its version like it does after a reset
+static void rediscover(void) {
+    uint8_t version;
+    CHECK_EQ(rp2040_get_firmware_version(&device, &version), ESP_OK);
+    CHECK_EQ(version, 0x15);
+}
+
+static esp_err_t run(rp2040_update_t* update) {
+    CHECK_EQ(rp2040_update_init(update), ESP_OK);
+    esp_err_t res = rp2040_update_run(update);
+    rp2040_update_deinit(update);
+    if (res == ESP_OK) rediscover();
+    return res;
+}
+
+static void check_flashed(uint32_t length) {
+    CHECK(memcmp(sim.flash, image, length) == 0);
+    CHECK(sim.sealed);
+    CHECK_EQ(sim.sealed_length, length);
+    CHECK_EQ(sim.sealed_crc, sim_crc32(image, length));
+    CHECK(!sim.in_bootloader);
+}
+
+static void test_buffer(void) {
+    boot();
+    fill_image(1);
+    rp2040_source_t source;
+    rp2040_source_from_buffer(&source, image, sizeof(image));
+    rp2040_update_t update = {.device = &device, .bl = &bl, .source = &source};
+    CHECK_EQ(run(&update), ESP_OK);
+    check_flashed(sizeof(image));
+    CHECK_EQ(update.stats.bytes_written, sizeof(image));
+    CHECK_EQ(update.stats.sectors_written, sizeof(image) / SIM_ERASE_SIZE);
+    CHECK_EQ(update.stats.heap_bytes, SIM_MAX_DATA_LEN);
+    CHECK(update.stats.bytes_per_second > 0);
+    CHECK(update.stats.duration_us > update.stats.write_duration_us);
+    // With one write in flight the link idles while each chunk is programmed, 1.6 ms per KB against 11 ms of transfer
+    CHECK(update.stats.transfer_bytes_per_second > update.stats.link_bytes_per_second * 84 / 100);
+    rp2040_source_close(&source);
+}
+
+static void test_unchanged(void) {
+    boot();
+    fill_image(2);
+    rp2040_source_t source;
+    rp2040_source_from_buffer(&source, image, sizeof(image));
+    rp2040_update_t update = {.device = &device, .bl = &bl, .source = &source};
+    CHECK_EQ(run(&update), ESP_OK);
+
+    // The whole image is compared with a single CRC and only sealed again
+    sim_clear_counters();
+    CHECK_EQ(run(&update), ESP_OK);
+    CHECK_EQ(update.stats.sectors_skipped, sizeof(image) / SIM_ERASE_SIZE);
+    CHECK_EQ(sim.erase_commands, 0);
+    CHECK_EQ(sim.write_commands, 0);
+    CHECK_EQ(sim.crc_commands, 1);
+    CHECK_EQ(sim.seal_commands, 1);
+    check_flashed(sizeof(image));
+
+    // Only the changed sectors are written
+    image[10 * SIM_ERASE_SIZE + 7]++;
+    image[30 * SIM_ERASE_SIZE]++;
+    sim_clear_counters();
+    CHECK_EQ(run(&update), ESP_OK);
+    check_flashed(sizeof(image));
+    CHECK_EQ(update.stats.sectors_written, 2);
+    CHECK_EQ(sim.sectors_erased, 2);
+    CHECK_EQ(sim.bytes_written, 2 * SIM_ERASE_SIZE);
+    rp2040_source_close(&source);
+}
+
+static void test_corrupted_flash(void) {
+    boot();
+    fill_image(14);
+    rp2040_source_t source;
+    rp2040_source_from_buffer(&source, image, sizeof(image));
+    rp2040_update_t update = {.device = &device, .bl = &bl, .source = &source};
+
+    // A sector changes after it was written and acknowledged, the image is not sealed
+    CHECK_EQ(rp2040_update_init(&update), ESP_OK);
+    while (update._state != RP2040_UPDATE_STATE_SEAL) CHECK_EQ(rp2040_update_step(&update), ESP_ERR_NOT_FINISHED);
+    sim.flash[20 * SIM_ERASE_SIZE + 100] ^= 0x01;
+    CHECK_EQ(rp2040_update_run(&update), ESP_ERR_INVALID_CRC);
+    rp2040_update_deinit(&update);
+    CHECK(!sim.sealed);
+
+    // The next update rewrites that sector only
+    sim_clear_counters();
+    CHECK_EQ(run(&update), ESP_OK);
+    CHECK_EQ(update.stats.sectors_written, 1);
+    check_flashed(sizeof(image));
+    rp2040_source_close(&source);
+}
+
+static bool read_stream(void* arg, uint8_t* buffer, uint32_t length) {
+    uint32_t* position = arg;
+    memcpy(buffer, image + *position, length);
+    *position += length;
+    return true;
+}
+
+static void test_sources(void) {
+    fill_image(3);
+    rp2040_source_t source;
+
+    // A stream can only be read once, so it is written in full and checked against the CRC accumulated on the way
+    boot();
+    uint32_t position = 0;
+    rp2040_source_from_stream(&source, 100000, read_stream, &position);
+    rp2040_update_t update = {.device = &device, .bl = &bl, .source = &source};
+    CHECK_EQ(run(&update), ESP_OK);
+    CHECK(memcmp(sim.flash, image, 100000) == 0);
+    CHECK_EQ(sim.sealed_length, 100096);  // Padded to the write size
+    rp2040_source_close(&source);
+
+    boot();
+    char path[256];
+    snprintf(path, sizeof(path), "%s/update_image.bin", build_dir);
+    FILE* file = fopen(path, "wb");
+    CHECK(file != NULL);
+    fwrite(image, 1, sizeof(image), file);
+    fclose(file);
+    CHECK_EQ(rp2040_source_open_file(&source, path), ESP_OK);
+    update = (rp2040_update_t) {.device = &device, .bl = &bl, .source = &source};
+    CHECK_EQ(run(&update), ESP_OK);
+    check_flashed(sizeof(image));
+    rp2040_source_close(&source);
+    remove(path);
+
+    boot();
+    esp_partition_t partition = {.address = 0, .size = SIM_PARTITION_SIZE, .erase_size = 4096};
+    memcpy(sim.partition, image, sizeof(image));
+    CHECK_EQ(rp2040_source_from_partition(&source, &partition, sizeof(image)), ESP_OK);
+    update = (rp2040_update_t) {.device = &device, .bl = &bl, .source = &source};
+    CHECK_EQ(run(&update), ESP_OK);
+    check_flashed(sizeof(image));
+    rp2040_source_close(&source);
+}
+
+static void test_erase_batching(void) {
+    boot();
+    fill_image(4);
+    rp2040_source_t source;
+    rp2040_source_from_buffer(&source, image, sizeof(image));
+    rp2040_update_t update = {.device = &device, .bl = &bl, .source = &source};
+
+    // 0x10010000 and 0x10020000 are the aligned blocks the image covers completely
+    CHECK_EQ(run(&update), ESP_OK);
+    check_flashed(sizeof(image));
+    CHECK_EQ(sim.blocks_erased, 2);
+    CHECK(update.stats.erase_commands <= 6);
+    CHECK_EQ(update.stats.erase_commands, sim.erase_commands);
+
+    // 14 of the 16 sectors of the first block changed, erasing the block and writing 2 sectors again is faster
+    uint32_t block = 0x10010000 - SIM_FLASH_START;
+    for (int sector = 0; sector < 16; sector++) {
+        if (sector != 3 && sector != 9) image[block + sector * SIM_ERASE_SIZE]++;
+    }
+    sim_clear_counters();
+    CHECK_EQ(run(&update), ESP_OK);
+    check_flashed(sizeof(image));
+    CHECK_EQ(sim.blocks_erased, 1);
+    CHECK_EQ(update.stats.sectors_rewritten, 2);
+
+    // A few scattered sectors are erased one by one
+    for (int sector = 0; sector < 3; sector++) image[block + sector * 5 * SIM_ERASE_SIZE]++;
+    sim_clear_counters();
+    CHECK_EQ(run(&update), ESP_OK);
+    check_flashed(sizeof(image));
+    CHECK_EQ(sim.blocks_erased, 0);
+    CHECK_EQ(sim.sectors_erased, 3);
+    CHECK_EQ(update.stats.sectors_rewritten, 0);
+    rp2040_source_close(&source);
+}
+
+static void test_verify(void) {
+    rp2040_source_t source;
+    rp2040_source_from_buffer(&source, image, sizeof(image));
+    for (rp2040_update_verify_t verify = RP2040_UPDATE_VERIFY_WRITE_CRC; verify <= RP2040_UPDATE_VERIFY_FULL; verify++) {
+        boot();
+        fill_image(5 + verify);
+        rp2040_update_t update = {.device = &device, .bl = &bl, .source = &source, .verify = verify};
+        CHECK_EQ(run(&update), ESP_OK);
+        check_flashed(sizeof(image));
+        uint32_t expected[] = {0, sizeof(image), RP2040_UPDATE_VERIFY_SAMPLES * SIM_MAX_DATA_LEN, sizeof(image)};
+        CHECK_EQ(update.stats.verified_bytes, expected[verify]);
+        uint32_t heap[] = {SIM_MAX_DATA_LEN, SIM_MAX_DATA_LEN, 2 * SIM_MAX_DATA_LEN, 2 * SIM_MAX_DATA_LEN};
+        CHECK_EQ(update.stats.heap_bytes, heap[verify]);
+    }
+
+    // A read back that got corrupted on the link is read again
+    boot();
+    fill_image(9);
+    sim.corrupt_reads      = 1;
+    rp2040_update_t update = {.device = &device, .bl = &bl, .source = &source, .verify = RP2040_UPDATE_VERIFY_FULL};
+    CHECK_EQ(run(&update), ESP_OK);
+    check_flashed(sizeof(image));
+
+    // Data that keeps differing fails the update before it is sealed
+    boot();
+    fill_image(10);
+    sim.corrupt_reads = 1000;
+    CHECK_EQ(run(&update), ESP_ERR_INVALID_CRC);
+    CHECK(!sim.sealed);
+    rp2040_source_close(&source);
+}
+
+static void test_step_latency(void) {
+    boot();
+    fill_image(11);
+    rp2040_source_t source;
+    rp2040_source_from_buffer(&source, image, 100 * 1024);
+    rp2040_update_t update = {.device = &device, .bl = &bl, .source = &source, .verify = RP2040_UPDATE_VERIFY_FULL};
+    CHECK_EQ(rp2040_update_init(&update), ESP_OK);
+    esp_err_t res;
+    int64_t   longest = 0;
+    do {
+        rp2040_update_state_t state = update._state;
+        int64_t               start = sim_now();
+        res                         = rp2040_update_step(&update);
+        // Erases, writes and read backs wait for at most RP2040_UPDATE_STEP_WAIT_MS per step
+        if (state >= RP2040_UPDATE_STATE_COMPARE && state <= RP2040_UPDATE_STATE_VERIFY && sim_now() - start > longest) longest = sim_now() - start;
+    } while (res == ESP_ERR_NOT_FINISHED);
+    CHECK_EQ(res, ESP_OK);
+    CHECK(longest <= 25000);
+    rp2040_update_deinit(&update);
+    rp2040_source_close(&source);
+}
+
+static void test_check(void) {
+    fill_image(12);
+    rp2040_update_manifest_t manifest = {.version = 0x15, .length = sizeof(image), .crc = sim_crc32(image, sizeof(image))};
+    bool                     needed;
+
+    // Decided from the version read by rp2040_init
+    boot();
+    int64_t start = sim_now();
+    CHECK_EQ(rp2040_update_check(&device, &bl, &manifest, &needed), ESP_OK);
+    CHECK(!needed);
+    manifest.version = 0x16;
+    CHECK_EQ(rp2040_update_check(&device, &bl, &manifest, &needed), ESP_OK);
+    CHECK(needed);
+    CHECK_EQ(sim_now() - start, 2 * SIM_I2C_US);
+    CHECK_EQ(sim.commands, 0);
+
+    // Development builds share a version, the CRC of the flash decides
+    manifest.version   = 0x15;
+    manifest.ambiguous = true;
+    memcpy(sim.flash, image, sizeof(image));
+    CHECK_EQ(rp2040_update_check(&device, &bl, &manifest, &needed), ESP_OK);
+    CHECK(!needed);
+    CHECK(!sim.in_bootloader);
+    CHECK_EQ(device._fw_version, 0x15);
+    CHECK(!uart_is_driver_installed(bl.uart));
+
+    // Matching flash found in the bootloader may never have been sealed, it is sealed before it is started
+    sim.in_bootloader = true;
+    sim_clear_counters();
+    CHECK_EQ(rp2040_update_check(&device, &bl, &manifest, &needed), ESP_OK);
+    CHECK(!needed);
+    CHECK(!sim.in_bootloader);
+    CHECK_EQ(sim.seal_commands, 1);
+    CHECK(sim.sealed);
+    CHECK_EQ(sim.sealed_crc, manifest.crc);
+    CHECK(!uart_is_driver_installed(bl.uart));
+
+    // Firmware that does not start again is reported as needing an update
+    sim.go_fails = true;
+    CHECK_EQ(rp2040_update_check(&device, &bl, &manifest, &needed), ESP_OK);
+    CHECK(needed);
+    CHECK(sim.in_bootloader);
+    CHECK(!uart_is_driver_installed(bl.uart));
+    sim.go_fails = false;
+
+    // A mismatch leaves the bootloader running for the update
+    sim.flash[1000]++;
+    CHECK_EQ(rp2040_update_check(&device, &bl, &manifest, &needed), ESP_OK);
+    CHECK(needed);
+    CHECK(sim.in_bootloader);
+    rp2040_source_t source;
+    rp2040_source_from_buffer(&source, image, sizeof(image));
+    rp2040_update_t update = {.device = &device, .bl = &bl, .source = &source};
+    sim_clear_counters();
+    CHECK_EQ(run(&update), ESP_OK);
+    CHECK_EQ(update.stats.sectors_written, 1);
+    check_flashed(sizeof(image));
+    rp2040_source_close(&source);
+
+    // A length that is not a multiple of 4 is compared together with the padding written after the image
+    boot();
+    rp2040_source_from_buffer(&source, image, 100001);
+    update = (rp2040_update_t) {.device = &device, .bl = &bl, .source = &source};
+    CHECK_EQ(run(&update), ESP_OK);
+    manifest = (rp2040_update_manifest_t) {.version = 0x15, .ambiguous = true, .length = 100001, .crc = sim_crc32(image, 100001)};
+    CHECK_EQ(rp2040_update_check(&device, &bl, &manifest, &needed), ESP_OK);
+    CHECK(!needed);
+    manifest.crc++;
+    CHECK_EQ(rp2040_update_check(&device, &bl, &manifest, &needed), ESP_OK);
+    CHECK(needed);
+    rp2040_source_close(&source);
+}
+
+static void test_init_again(void) {
+    boot();
+    fill_image(13);
+    rp2040_source_t source;
+    rp2040_source_from_buffer(&source, image, sizeof(image));
+    rp2040_update_t update = {.device = &device, .bl = &bl, .source = &source, .verify = RP2040_UPDATE_VERIFY_SAMPLED};
+
+    // Restarting halfway releases the buffers of the first run, the sanitizer reports a leak otherwise
+    CHECK_EQ(rp2040_update_init(&update), ESP_OK);
+    while (update._state != RP2040_UPDATE_STATE_WRITE) CHECK_EQ(rp2040_update_step(&update), ESP_ERR_NOT_FINISHED);
+    CHECK(update._buffer != NULL);
+    CHECK_EQ(rp2040_update_init(&update), ESP_OK);
+    CHECK(update._buffer == NULL);
+    CHECK_EQ(rp2040_update_run(&update), ESP_OK);
+    CHECK_EQ(rp2040_update_init(&update), ESP_OK);
+    rp2040_update_deinit(&update);
+    check_flashed(sizeof(image));
+    rp2040_source_close(&source);
+
+    // Sectors found dirty by an abandoned run are compared again, the flash may have changed since
+    boot();
+    rp2040_source_from_buffer(&source, image, sizeof(image));
+    update = (rp2040_update_t) {.device = &device, .bl = &bl, .source = &source};
+    CHECK_EQ(rp2040_update_init(&update), ESP_OK);
+    while (update._compared < 2) CHECK_EQ(rp2040_update_step(&update), ESP_ERR_NOT_FINISHED);
+    CHECK_EQ(update._compared_start, 0);
+    CHECK(update._dirty > 1);
+    memcpy(sim.flash, image, sizeof(image));
+    sim.flash[0]++;
+    CHECK_EQ(rp2040_update_init(&update), ESP_OK);
+    CHECK_EQ(rp2040_update_run(&update), ESP_OK);
+    CHECK_EQ(update.stats.sectors_written, 1);
+    check_flashed(sizeof(image));
+    rp2040_update_deinit(&update);
+    rp2040_source_close(&source);
+
+    // Invalid configurations are rejected before anything is allocated
+    rp2040_update_t invalid = {.device = &device, .bl = &bl};
+    CHECK_EQ(rp2040_update_init(&invalid), ESP_ERR_INVALID_ARG);
+}
+
+int main(int argc, char** argv) {
+    if (argc > 1) build_dir = argv[1];
+    RUN_TEST(test_buffer);
+    RUN_TEST(test_unchanged);
+    RUN_TEST(test_corrupted_flash);
+    RUN_TEST(test_sources);
+    RUN_TEST(test_erase_batching);
+    RUN_TEST(test_verify);
+    RUN_TEST(test_step_latency);
+    RUN_TEST(test_check);
+    RUN_TEST(test_init_again);
+    rp2040_deinit(&device);
+    return TEST_RESULT();
+}
@@ -5,10 +5,20 @@
 #include <freertos/FreeRTOS.h>
 #include <freertos/semphr.h>
 #include <freertos/task.h>
+#include <sdkconfig.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #include "driver/i2c_types.h"
 
+#ifndef CONFIG_RP2040_INTR_TASK_STACK_SIZE
+#define CONFIG_RP2040_INTR_TASK_STACK_SIZE 4096
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 enum {
     RP2040_REG_FW_VER = 0,
     RP2040_REG_GPIO_DIR,
@@ -174,6 +184,8 @@ enum {
     RP2040_REG_MSC1_BLOCK_SIZE_HI,
 };
 
+#define RP2040_REG_COUNT (RP2040_REG_MSC1_BLOCK_SIZE_HI + 1)
+
 enum { RP2040_BL_REG_FW_VER, RP2040_BL_REG_BL_VER, RP2040_BL_REG_BL_STATE, RP2040_BL_REG_BL_CTRL };
 
 typedef enum {
@@ -200,30 +212,69 @@ typedef struct {
     i2c_master_bus_handle_t i2c_bus_handle;
     int                     i2c_address;
     int                     pin_interrupt;
+    // Called by the interrupt task. NULL means the caller drives _intr_trigger: no interrupt task is created and the caller
+    // takes the trigger after each interrupt, reads the inputs itself and stops taking it before rp2040_deinit. The task
+    // stack of CONFIG_RP2040_STATIC_ALLOCATION stays reserved in the struct either way.
     rp2040_callback_t       callback;
     SemaphoreHandle_t       i2c_semaphore;
+    i2c_master_dev_handle_t _i2c_device;
     rp2040_intr_t           _intr_handler;
     TaskHandle_t            _intr_task_handle;
+    TaskHandle_t            _intr_stop_waiter;  // Set by rp2040_deinit to make the interrupt task exit
     SemaphoreHandle_t       _intr_trigger;
     uint8_t                 _gpio_direction;
     uint8_t                 _gpio_value;
     uint8_t                 _fw_version;
+#if CONFIG_RP2040_STATIC_ALLOCATION
+    StaticSemaphore_t       _intr_trigger_buffer;
+    StaticTask_t            _intr_task_buffer;
+    StackType_t             _intr_task_stack[CONFIG_RP2040_INTR_TASK_STACK_SIZE / sizeof(StackType_t)];
+#endif
 } RP2040;
 
+#if CONFIG_RP2040_STATIC_ALLOCATION
+// Memory the driver allocates itself, which is all inside the RP2040 struct. The I2C device handle is allocated by the
+// I2C master driver and not included.
+#define RP2040_STATIC_FOOTPRINT sizeof(RP2040)
+#endif
+
 esp_err_t rp2040_init(RP2040* device);
+// Release everything rp2040_init acquired, in reverse order, also after rp2040_init failed. The device can be initialised again.
+// Stops the interrupt task if there is one, without a callback the caller must have stopped using _intr_trigger.
+esp_err_t rp2040_deinit(RP2040* device);
+
+// Raw access to value_len consecutive registers starting at reg, in a single I2C transaction
+esp_err_t rp2040_read_reg(RP2040* device, uint8_t reg, uint8_t* value, size_t value_len);
+esp_err_t rp2040_write_reg(RP2040* device, uint8_t reg, const uint8_t* value, size_t value_len);
 
 esp_err_t rp2040_get_firmware_version(RP2040* device, uint8_t* version);
 
+// Subsystems disabled in menuconfig are replaced by stubs that return ESP_ERR_NOT_SUPPORTED, so callers still build
+#if CONFIG_RP2040_BOOTLOADER
 esp_err_t rp2040_get_bootloader_version(RP2040* device, uint8_t* version);
 esp_err_t rp2040_get_bootloader_state(RP2040* device, uint8_t* state);
 esp_err_t rp2040_set_bootloader_ctrl(RP2040* device, uint8_t action);
 esp_err_t rp2040_reboot_to_bootloader(RP2040* device);
+#else
+static inline esp_err_t rp2040_get_bootloader_version(RP2040* device, uint8_t* version) { return ESP_ERR_NOT_SUPPORTED; }
+static inline esp_err_t rp2040_get_bootloader_state(RP2040* device, uint8_t* state) { return ESP_ERR_NOT_SUPPORTED; }
+static inline esp_err_t rp2040_set_bootloader_ctrl(RP2040* device, uint8_t action) { return ESP_ERR_NOT_SUPPORTED; }
+static inline esp_err_t rp2040_reboot_to_bootloader(RP2040* device) { return ESP_ERR_NOT_SUPPORTED; }
+#endif
 
+#if CONFIG_RP2040_GPIO
 esp_err_t rp2040_get_gpio_dir(RP2040* device, uint8_t gpio, bool* direction);
 esp_err_t rp2040_set_gpio_dir(RP2040* device, uint8_t gpio, bool direction);
 
 esp_err_t rp2040_get_gpio_value(RP2040* device, uint8_t gpio, bool* value);
 esp_err_t rp2040_set_gpio_value(RP2040* device, uint8_t gpio, bool value);
+#else
+static inline esp_err_t rp2040_get_gpio_dir(RP2040* device, uint8_t gpio, bool* direction) { return ESP_ERR_NOT_SUPPORTED; }
+static inline esp_err_t rp2040_set_gpio_dir(RP2040* device, uint8_t gpio, bool direction) { return ESP_ERR_NOT_SUPPORTED; }
+
+static inline esp_err_t rp2040_get_gpio_value(RP2040* device, uint8_t gpio, bool* value) { return ESP_ERR_NOT_SUPPORTED; }
+static inline esp_err_t rp2040_set_gpio_value(RP2040* device, uint8_t gpio, bool value) { return ESP_ERR_NOT_SUPPORTED; }
+#endif
 
 esp_err_t rp2040_get_lcd_backlight(RP2040* device, uint8_t* brightness);
 esp_err_t rp2040_set_lcd_backlight(RP2040* device, uint8_t brightness);
@@ -235,6 +286,7 @@ esp_err_t rp2040_read_buttons(RP2040* device, uint16_t* value);
 
 esp_err_t rp2040_get_uid(RP2040* device, uint8_t* uid);
 
+#if CONFIG_RP2040_ADC
 esp_err_t rp2040_read_vusb_raw(RP2040* device, uint16_t* value);
 esp_err_t rp2040_read_vusb(RP2040* device, float* value);
 
@@ -243,6 +295,16 @@ esp_err_t rp2040_read_vbat(RP2040* device, float* value);
 
 esp_err_t rp2040_read_temp(RP2040* device, uint16_t* value);
 esp_err_t rp2040_get_charging(RP2040* device, uint8_t* charging);
+#else
+static inline esp_err_t rp2040_read_vusb_raw(RP2040* device, uint16_t* value) { return ESP_ERR_NOT_SUPPORTED; }
+static inline esp_err_t rp2040_read_vusb(RP2040* device, float* value) { return ESP_ERR_NOT_SUPPORTED; }
+
+static inline esp_err_t rp2040_read_vbat_raw(RP2040* device, uint16_t* value) { return ESP_ERR_NOT_SUPPORTED; }
+static inline esp_err_t rp2040_read_vbat(RP2040* device, float* value) { return ESP_ERR_NOT_SUPPORTED; }
+
+static inline esp_err_t rp2040_read_temp(RP2040* device, uint16_t* value) { return ESP_ERR_NOT_SUPPORTED; }
+static inline esp_err_t rp2040_get_charging(RP2040* device, uint8_t* charging) { return ESP_ERR_NOT_SUPPORTED; }
+#endif
 
 esp_err_t rp2040_get_usb(RP2040* device, uint8_t* usb);
 
@@ -251,18 +313,40 @@ esp_err_t rp2040_exit_webusb_mode(RP2040* device);
 
 esp_err_t rp2040_get_crash_state(RP2040* device, uint8_t* crash_debug);
 
+#if CONFIG_RP2040_IR
 esp_err_t rp2040_ir_send(RP2040* device, uint16_t address, uint8_t command);
+#else
+static inline esp_err_t rp2040_ir_send(RP2040* device, uint16_t address, uint8_t command) { return ESP_ERR_NOT_SUPPORTED; }
+#endif
 
 esp_err_t rp2040_get_reset_attempted(RP2040* device, uint8_t* reset_attempted);
 esp_err_t rp2040_set_reset_attempted(RP2040* device, uint8_t reset_attempted);
 esp_err_t rp2040_set_reset_lock(RP2040* device, uint8_t lock);
 
+#if CONFIG_RP2040_WS2812
 esp_err_t rp2040_set_ws2812_mode(RP2040* device, uint8_t mode);
 esp_err_t rp2040_set_ws2812_length(RP2040* device, uint8_t length);
 esp_err_t rp2040_set_ws2812_data(RP2040* device, uint8_t position, uint32_t value);
 esp_err_t rp2040_ws2812_trigger(RP2040* device);
+#else
+static inline esp_err_t rp2040_set_ws2812_mode(RP2040* device, uint8_t mode) { return ESP_ERR_NOT_SUPPORTED; }
+static inline esp_err_t rp2040_set_ws2812_length(RP2040* device, uint8_t length) { return ESP_ERR_NOT_SUPPORTED; }
+static inline esp_err_t rp2040_set_ws2812_data(RP2040* device, uint8_t position, uint32_t value) { return ESP_ERR_NOT_SUPPORTED; }
+static inline esp_err_t rp2040_ws2812_trigger(RP2040* device) { return ESP_ERR_NOT_SUPPORTED; }
+#endif
 
+#if CONFIG_RP2040_MSC
 esp_err_t rp2040_set_msc_control(RP2040* device, uint8_t value);
 esp_err_t rp2040_get_msc_state(RP2040* device, uint8_t* value);
 esp_err_t rp2040_set_msc_block_count(RP2040* device, uint8_t lun, uint32_t value);
 esp_err_t rp2040_set_msc_block_size(RP2040* device, uint8_t lun, uint16_t value);
+#else
+static inline esp_err_t rp2040_set_msc_control(RP2040* device, uint8_t value) { return ESP_ERR_NOT_SUPPORTED; }
+static inline esp_err_t rp2040_get_msc_state(RP2040* device, uint8_t* value) { return ESP_ERR_NOT_SUPPORTED; }
+static inline esp_err_t rp2040_set_msc_block_count(RP2040* device, uint8_t lun, uint32_t value) { return ESP_ERR_NOT_SUPPORTED; }
+static inline esp_err_t rp2040_set_msc_block_size(RP2040* device, uint8_t lun, uint16_t value) { return ESP_ERR_NOT_SUPPORTED; }
+#endif
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,245 @@
+#pragma once
+
+#include <esp_timer.h>
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+#include "rp2040.h"
+
+// Typed register access for C++17. Every register is a compile-time descriptor, so a read or write compiles to a single
+// rp2040_read_reg or rp2040_write_reg call with constant arguments.
+//
+//     rp2040::device<0x09> leds(&rp2040);  // Registers that need firmware newer than 0x09 do not compile
+//     if (!leds.supported()) return;       // The only firmware check, done once
+//     leds.write<rp2040::ws2812_led<0>>(0x00FF00);
+//     uint16_t vbat;
+//     leds.read<rp2040::vbat>(vbat);
+
+namespace rp2040 {
+
+enum class access : uint8_t { read_only, write_only, read_write };
+
+enum class byte_order : uint8_t { little_endian, big_endian };
+
+constexpr uint8_t any_firmware = 0x00;  // Exists in the firmware and in the bootloader
+constexpr uint8_t bootloader   = 0xFF;  // Firmware version reported by the bootloader, its registers exist nowhere else
+
+constexpr size_t register_count            = RP2040_REG_COUNT;
+constexpr size_t bootloader_register_count = RP2040_BL_REG_BL_CTRL + 1;
+
+// One register, or consecutive registers that hold a single value. MinFirmware is the first firmware version that has the
+// register, MinWriteFirmware the first one that accepts writes to it if that is newer.
+template <uint8_t Address, typename T, access Access, uint8_t MinFirmware, uint8_t MinWriteFirmware = MinFirmware,
+          byte_order Order = byte_order::little_endian>
+struct reg {
+    using value_type = T;
+
+    static constexpr uint8_t    address            = Address;
+    static constexpr size_t     width              = sizeof(T);
+    static constexpr access     mode               = Access;
+    static constexpr uint8_t    min_firmware       = MinFirmware;
+    static constexpr uint8_t    min_write_firmware = MinWriteFirmware;
+    static constexpr byte_order order              = Order;
+
+    static_assert(std::is_unsigned_v<T> || std::is_same_v<T, std::array<uint8_t, sizeof(T)>>, "Registers hold unsigned integers or bytes");
+    static_assert(Address + sizeof(T) <= (MinFirmware == bootloader ? bootloader_register_count : register_count),
+                  "Register range extends past the end of the register map");
+};
+
+// Firmware
+using fw_version      = reg<RP2040_REG_FW_VER, uint8_t, access::read_only, any_firmware>;
+using gpio_direction  = reg<RP2040_REG_GPIO_DIR, uint8_t, access::read_write, 0x01>;
+using gpio_in         = reg<RP2040_REG_GPIO_IN, uint8_t, access::read_only, 0x01>;
+using gpio_out        = reg<RP2040_REG_GPIO_OUT, uint8_t, access::read_write, 0x01>;
+using lcd_backlight   = reg<RP2040_REG_LCD_BACKLIGHT, uint8_t, access::read_write, 0x01>;
+using fpga            = reg<RP2040_REG_FPGA, uint8_t, access::write_only, 0x01>;
+using inputs          = reg<RP2040_REG_INPUT1, uint16_t, access::read_only, 0x01>;  // Bit n is the state of rp2040_input_t n
+using interrupts      = reg<RP2040_REG_INTERRUPT1, uint16_t, access::read_only, 0x01>;
+using input_state     = reg<RP2040_REG_INPUT1, uint32_t, access::read_only, 0x01>;  // Inputs and interrupts in one transaction
+using adc_trigger     = reg<RP2040_REG_ADC_TRIGGER, uint8_t, access::write_only, 0x02>;
+using vusb            = reg<RP2040_REG_ADC_VALUE_VUSB_LO, uint16_t, access::read_only, 0x02>;
+using vbat            = reg<RP2040_REG_ADC_VALUE_VBAT_LO, uint16_t, access::read_only, 0x02>;
+using usb             = reg<RP2040_REG_USB, uint8_t, access::read_only, 0x01>;
+using bl_trigger      = reg<RP2040_REG_BL_TRIGGER, uint8_t, access::write_only, 0x01>;
+using webusb_mode     = reg<RP2040_REG_WEBUSB_MODE, uint8_t, access::read_write, 0x02, 0x0E>;
+using crash_debug     = reg<RP2040_REG_CRASH_DEBUG, uint8_t, access::read_only, 0x06>;
+using reset_lock      = reg<RP2040_REG_RESET_LOCK, uint8_t, access::write_only, 0x08>;
+using reset_attempted = reg<RP2040_REG_RESET_ATTEMPTED, uint8_t, access::read_write, 0x08>;
+using charging_state  = reg<RP2040_REG_CHARGING_STATE, uint8_t, access::read_only, 0x02>;
+using temperature     = reg<RP2040_REG_ADC_VALUE_TEMP_LO, uint16_t, access::read_only, 0x02>;
+using uid             = reg<RP2040_REG_UID0, std::array<uint8_t, 8>, access::read_only, 0x01>;
+using ir_address      = reg<RP2040_REG_IR_ADDRESS_LO, uint16_t, access::write_only, 0x06>;
+using ir_command      = reg<RP2040_REG_IR_COMMAND, uint8_t, access::write_only, 0x06>;
+using ir_trigger      = reg<RP2040_REG_IR_TRIGGER, uint8_t, access::write_only, 0x06>;
+using ws2812_mode     = reg<RP2040_REG_WS2812_MODE, uint8_t, access::write_only, 0x09>;
+using ws2812_trigger  = reg<RP2040_REG_WS2812_TRIGGER, uint8_t, access::write_only, 0x09>;
+using ws2812_length   = reg<RP2040_REG_WS2812_LENGTH, uint8_t, access::write_only, 0x09>;
+using ws2812_speed    = reg<RP2040_REG_WS2812_SPEED, uint8_t, access::write_only, 0x09>;
+using msc_control     = reg<RP2040_REG_MSC_CONTROL, uint8_t, access::write_only, 0x0D>;
+using msc_state       = reg<RP2040_REG_MSC_STATE, uint8_t, access::read_only, 0x0D>;
+
+template <size_t Index>
+struct scratch : reg<RP2040_REG_SCRATCH0 + Index, uint8_t, access::read_write, 0x01> {
+    static_assert(Index < 64, "There are 64 scratch registers");
+};
+
+template <size_t Led>
+struct ws2812_led : reg<RP2040_REG_WS2812_LED0_DATA0 + Led * 4, uint32_t, access::write_only, 0x09> {
+    static_assert(Led < 10, "There are 10 WS2812 LEDs");
+};
+
+template <size_t Lun>
+struct msc_block_count : reg<Lun == 0 ? RP2040_REG_MSC0_BLOCK_COUNT_LO_A : RP2040_REG_MSC1_BLOCK_COUNT_LO_A, uint32_t, access::write_only, 0x0D> {
+    static_assert(Lun < 2, "There are 2 mass storage LUNs");
+};
+
+template <size_t Lun>
+struct msc_block_size : reg<Lun == 0 ? RP2040_REG_MSC0_BLOCK_SIZE_LO : RP2040_REG_MSC1_BLOCK_SIZE_LO, uint16_t, access::write_only, 0x0D> {
+    static_assert(Lun < 2, "There are 2 mass storage LUNs");
+};
+
+// Bootloader
+using bl_version = reg<RP2040_BL_REG_BL_VER, uint8_t, access::read_only, bootloader>;
+using bl_state   = reg<RP2040_BL_REG_BL_STATE, uint8_t, access::read_only, bootloader>;
+using bl_ctrl    = reg<RP2040_BL_REG_BL_CTRL, uint8_t, access::write_only, bootloader>;
+
+// An RP2040 that runs at least firmware version Firmware, or the bootloader if Firmware is rp2040::bootloader. Registers
+// that the guaranteed firmware does not have are rejected at compile time, so access needs no version checks.
+template <uint8_t Firmware>
+class device {
+   public:
+    explicit device(RP2040* handle) : handle_(handle) {}
+
+    // Whether the device runs the firmware this handle was declared for, uses the version read by rp2040_init
+    bool supported() const {
+        uint8_t version = handle_->_fw_version;
+        if constexpr (Firmware == bootloader) {
+            return version == bootloader;
+        } else {
+            return version != bootloader && version >= Firmware;
+        }
+    }
+
+    RP2040* handle() const { return handle_; }
+
+    template <typename Reg>
+    esp_err_t read(typename Reg::value_type& value) const {
+        static_assert(Reg::mode != access::write_only, "Register can not be read");
+        static_assert(available(Reg::min_firmware), "Register does not exist in this firmware version");
+        uint8_t   buffer[Reg::width];
+        esp_err_t res = rp2040_read_reg(handle_, Reg::address, buffer, sizeof(buffer));
+        if (res == ESP_OK) value = decode<Reg>(buffer);
+        return res;
+    }
+
+    template <typename Reg>
+    esp_err_t write(const typename Reg::value_type& value) const {
+        static_assert(Reg::mode != access::read_only, "Register can not be written");
+        static_assert(available(Reg::min_write_firmware), "Register can not be written in this firmware version");
+        uint8_t buffer[Reg::width];
+        encode<Reg>(value, buffer);
+        return rp2040_write_reg(handle_, Reg::address, buffer, sizeof(buffer));
+    }
+
+    // Count consecutive registers from Address in a single transaction, for example the IR address, command and trigger
+    template <uint8_t Address, size_t Count>
+    esp_err_t read_range(std::array<uint8_t, Count>& values) const {
+        static_assert(Count > 0 && Address + Count <= map_size(), "Register range extends past the end of the register map");
+        return rp2040_read_reg(handle_, Address, values.data(), Count);
+    }
+
+    template <uint8_t Address, size_t Count>
+    esp_err_t write_range(const std::array<uint8_t, Count>& values) const {
+        static_assert(Count > 0 && Address + Count <= map_size(), "Register range extends past the end of the register map");
+        return rp2040_write_reg(handle_, Address, values.data(), Count);
+    }
+
+   private:
+    RP2040* handle_;
+
+    static constexpr bool available(uint8_t min_firmware) {
+        if (min_firmware == any_firmware) return true;
+        if (Firmware == bootloader || min_firmware == bootloader) return Firmware == min_firmware;
+        return min_firmware <= Firmware;
+    }
+
+    static constexpr size_t map_size() { return Firmware == bootloader ? bootloader_register_count : register_count; }
+
+    template <typename Reg>
+    static typename Reg::value_type decode(const uint8_t* buffer) {
+        typename Reg::value_type value{};
+        if constexpr (std::is_unsigned_v<typename Reg::value_type>) {
+            for (size_t index = 0; index < Reg::width; index++) {
+                size_t shift  = 8 * (Reg::order == byte_order::little_endian ? index : Reg::width - 1 - index);
+                value        |= static_cast<typename Reg::value_type>(buffer[index]) << shift;
+            }
+        } else {
+            for (size_t index = 0; index < Reg::width; index++) value[index] = buffer[index];
+        }
+        return value;
+    }
+
+    template <typename Reg>
+    static void encode(const typename Reg::value_type& value, uint8_t* buffer) {
+        if constexpr (std::is_unsigned_v<typename Reg::value_type>) {
+            for (size_t index = 0; index < Reg::width; index++) {
+                size_t shift  = 8 * (Reg::order == byte_order::little_endian ? index : Reg::width - 1 - index);
+                buffer[index] = static_cast<uint8_t>(value >> shift);
+            }
+        } else {
+            for (size_t index = 0; index < Reg::width; index++) buffer[index] = value[index];
+        }
+    }
+};
+
+// Owns an RP2040 from rp2040_init to rp2040_deinit, which runs when the driver goes out of scope unless close was called
+// before. Objects that use the device, declared after the driver, are destroyed before it. The driver can not be moved
+// as the interrupt handler and task keep a pointer to it.
+class driver {
+   public:
+    explicit driver(const RP2040& config) : device_(config) {
+        int64_t start = esp_timer_get_time();
+        status_       = rp2040_init(&device_);
+        init_us_      = esp_timer_get_time() - start;
+    }
+
+    ~driver() { close(); }
+
+    driver(const driver&)            = delete;
+    driver& operator=(const driver&) = delete;
+
+    // Result of rp2040_init, the device must only be used when it is ESP_OK
+    esp_err_t status() const { return status_; }
+
+    RP2040* handle() { return &device_; }
+
+    template <uint8_t Firmware>
+    device<Firmware> as() {
+        return device<Firmware>(&device_);
+    }
+
+    // Release the device now, returns the result of rp2040_deinit
+    esp_err_t close() {
+        if (closed_) return ESP_OK;
+        closed_         = true;
+        int64_t   start = esp_timer_get_time();
+        esp_err_t res   = rp2040_deinit(&device_);
+        deinit_us_      = esp_timer_get_time() - start;
+        return res;
+    }
+
+    int64_t init_us() const { return init_us_; }
+    int64_t deinit_us() const { return deinit_us_; }  // 0 until close
+
+   private:
+    RP2040    device_;
+    esp_err_t status_;
+    bool      closed_    = false;
+    int64_t   init_us_   = 0;
+    int64_t   deinit_us_ = 0;
+};
+
+}  // namespace rp2040
@@ -1,17 +1,215 @@
 #pragma once
 
 #include <esp_err.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <sdkconfig.h>
 
-void rp2040_bl_install_uart();
-void rp2040_bl_uninstall_uart();
-
-bool rp2040_bl_sync();
-bool rp2040_bl_get_info(uint32_t* flash_start, uint32_t* flash_size, uint32_t* erase_size, uint32_t* write_size, uint32_t* max_data_len);
-bool rp2040_bl_erase(uint32_t address, uint32_t length);
-bool rp2040_bl_crc(uint32_t address, uint32_t length, uint32_t* crc);
-bool rp2040_bl_read(uint32_t address, uint32_t length, uint8_t* data);
-bool rp2040_bl_write(uint32_t address, uint32_t length, uint8_t* data, uint32_t* crc);
-bool rp2040_bl_seal(uint32_t vtor, uint32_t length, uint32_t crc);
-bool rp2040_bl_go(uint32_t vtor);
+#include "driver/uart.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define RP2040_BL_BAUDRATE             921600  // Default and fallback baud rate
+#define RP2040_BL_RX_BUFFER_SIZE       2048
+#define RP2040_BL_TX_BUFFER_SIZE       4096    // Lets uart_write_bytes return before a write command has been transmitted
+#define RP2040_BL_DUMP_BATCH_SIZE      (64 * 1024)
+#define RP2040_BL_MAX_PENDING          8       // Commands that can await their reply at the same time
+#define RP2040_BL_SYNC_MAX_INTERVAL_US 50000   // Longest wait for a reply between SYNC attempts
+#define RP2040_BL_RESYNC_TIMEOUT_US    100000  // Wait for the bootloader to answer again after the baud rate changed
+#define RP2040_BL_DEFAULT_ERASE_SIZE   4096    // Flash geometry of the RP2040 assumed until INFO has been read
+#define RP2040_BL_DEFAULT_WRITE_SIZE   256
+
+typedef struct {
+    uint32_t erase_us;          // Worst case time to erase one erase_size sector
+    uint32_t block_erase_us;    // Worst case time to erase one block_size block
+    uint32_t block_size;        // Aligned blocks of this size are erased at once, like the boot ROM does. 0 if the flash has none
+    uint32_t write_us;          // Worst case time to program one write_size page
+    uint32_t crc_us;            // Time for the bootloader to read and CRC 1 KB of flash
+    uint32_t turnaround_us;     // Fixed time for the bootloader to handle any command
+    uint8_t  margin;            // Safety margin added to every timeout, in percent
+    bool     learn;             // Estimate erase and write times from measured durations, timeouts always use the worst case
+    uint32_t learned_erase_us;  // Measured erase and write times, 0 until the first command completed
+    uint32_t learned_block_erase_us;
+    uint32_t learned_write_us;
+} rp2040_bl_timing_t;
+
+// Defaults are worst case datasheet values for the badge flash chip
+#define RP2040_BL_DEFAULT_TIMING()    \
+    {                                 \
+        .erase_us       = 400000,     \
+        .block_erase_us = 2000000,    \
+        .block_size     = 64 * 1024,  \
+        .write_us       = 3000,       \
+        .crc_us         = 100,        \
+        .turnaround_us  = 2000,       \
+        .margin         = 25,         \
+        .learn          = true,       \
+    }
+
+// Commands are accounted to the update phase they belong to
+typedef enum {
+    RP2040_BL_PHASE_SYNC = 0,  // SYNC and INFO
+    RP2040_BL_PHASE_ERASE,
+    RP2040_BL_PHASE_WRITE,
+    RP2040_BL_PHASE_VERIFY,  // CRCC and READ
+    RP2040_BL_PHASE_SEAL,    // SEAL and GOGO
+    RP2040_BL_PHASE_COUNT,
+} rp2040_bl_phase_t;
+
+typedef struct {
+    uint32_t commands;
+    uint32_t bytes;    // Flash bytes erased, written, read or checksummed
+    int64_t  send_us;  // Time spent handing commands and data to the UART driver
+    int64_t  wait_us;  // Time spent waiting for replies
+} rp2040_bl_phase_stats_t;
+
+typedef struct {
+    rp2040_bl_phase_stats_t phases[RP2040_BL_PHASE_COUNT];
+} rp2040_bl_stats_t;
+
+// Command awaiting its reply. The payload of the reply is received straight into the buffer of the caller.
+typedef struct {
+    char              opcode[4];
+    char              magic[4];
+    uint8_t*          payload;
+    uint32_t          payload_len;
+    uint32_t          word;        // Receives short payloads such as the CRC of a write
+    uint32_t          crc;         // CRC a write reply must report
+    uint32_t          length;      // Flash bytes covered by the command
+    uint32_t          address;
+    int64_t           timeout_us;  // Counted from the moment the command becomes the oldest one pending
+    int64_t           sent;        // Time the command was sent if nothing else was in flight, 0 otherwise
+    int64_t           completed;   // Time the reply was complete
+    rp2040_bl_phase_t phase;
+} rp2040_bl_pending_t;
+
+typedef struct {
+    uart_port_t         uart;
+    int                 pin_tx;                           // UART_PIN_NO_CHANGE keeps the pins already routed to the UART
+    int                 pin_rx;
+    uint32_t            baudrate;                         // Initial baud rate, updated by rp2040_bl_set_baudrate
+    uint32_t            rx_buffer_size;                   // Also limits the chunk size of pipelined reads to half of it
+    uint32_t            tx_buffer_size;                   // 0 makes every write block until it has been transmitted
+    uint32_t            event_queue_size;                 // 0 to install the driver without an event queue
+    QueueHandle_t       event_queue;                      // Set by rp2040_bl_install_uart when event_queue_size is not 0
+    rp2040_bl_timing_t  timing;
+    rp2040_bl_stats_t   stats;                            // Accumulated over all commands, clear it to start a new measurement
+    rp2040_bl_pending_t _pending[RP2040_BL_MAX_PENDING];  // Ring buffer in the order the commands were sent
+    uint8_t             _pending_head;
+    uint8_t             _pending_count;
+    int64_t             _deadline;                        // For the reply of the oldest pending command
+    uint8_t             _header[4];                       // Reply parser state of the oldest pending command
+    uint8_t             _header_len;
+    uint32_t            _received;
+    uint32_t            _erase_size;                      // Flash geometry reported by INFO
+    uint32_t            _write_size;
+} rp2040_bl_t;
+
+// UART0 on the default pins, as wired on the badge
+#define RP2040_BL_DEFAULT_CONFIG()                      \
+    {                                                   \
+        .uart           = UART_NUM_0,                   \
+        .pin_tx         = UART_PIN_NO_CHANGE,           \
+        .pin_rx         = UART_PIN_NO_CHANGE,           \
+        .baudrate       = RP2040_BL_BAUDRATE,           \
+        .rx_buffer_size = RP2040_BL_RX_BUFFER_SIZE,     \
+        .tx_buffer_size = RP2040_BL_TX_BUFFER_SIZE,     \
+        .timing         = RP2040_BL_DEFAULT_TIMING(),   \
+        ._erase_size    = RP2040_BL_DEFAULT_ERASE_SIZE, \
+        ._write_size    = RP2040_BL_DEFAULT_WRITE_SIZE, \
+    }
+
+typedef struct {
+    uint32_t bytes;
+    uint32_t chunk_size;
+    uint32_t crc_retries;  // Batches that were read again after a CRC mismatch
+    int64_t  duration_us;
+    uint32_t bytes_per_second;
+} rp2040_bl_dump_stats_t;
+
+// Without CONFIG_RP2040_BOOTLOADER only the types remain, so an update path built against the stubs of rp2040update.h
+// still compiles
+#if CONFIG_RP2040_BOOTLOADER
+// Installs the UART driver and configures the UART for the session. A driver that is already installed, for example by
+// the console, is configured as well but keeps its own buffers and event queue, so rx_buffer_size must not exceed the
+// RX buffer it was installed with. Fails while commands are pending.
+esp_err_t rp2040_bl_install_uart(rp2040_bl_t* bl);
+void      rp2040_bl_uninstall_uart(rp2040_bl_t* bl);
+
+bool     rp2040_bl_set_baudrate(rp2040_bl_t* bl, uint32_t baudrate);
+uint32_t rp2040_bl_get_baudrate(rp2040_bl_t* bl);
+
+// Timeouts are calculated from bl->timing, the payload length, the baud rate and the flash geometry reported by INFO.
+// Find the baud rate the bootloader listens at among baudrates, with a SYNC and a CRC verified READ at each of them, and keep
+// the fastest that works or fall back to RP2040_BL_BAUDRATE. The protocol has no command to change the rate of the
+// bootloader, so this only detects the rate it was built for. The bootloader receives the probes at every other rate as
+// garbage and answers them with errors, so after each of those the session is synced again at the last rate that worked.
+// The estimated transfer time of an image_length byte image is logged for every working rate when image_length is not 0.
+uint32_t rp2040_bl_detect_baudrate(rp2040_bl_t* bl, const uint32_t* baudrates, size_t count, uint32_t image_length);
+int64_t  rp2040_bl_estimate_transfer_time(uint32_t length, uint32_t chunk_size, uint32_t baudrate);
+// Expected time to erase length bytes at address, including the round trip of the command. Aligned blocks are counted as
+// block erases. Uses the learned erase times, a time that has not been learned yet is scaled from the other one.
+int64_t  rp2040_bl_estimate_erase_time(rp2040_bl_t* bl, uint32_t address, uint32_t length);
+
+// CRC-32 as calculated by the bootloader, the IEEE 802.3 one also used by zlib. Start with crc set to 0, the CRC of a
+// block can be passed to continue with the next block.
+uint32_t rp2040_bl_crc32(uint32_t crc, const uint8_t* data, uint32_t length);
+// CRC of the concatenation of two blocks, from the CRC of each block and the length of the second
+uint32_t rp2040_bl_crc32_combine(uint32_t crc_a, uint32_t crc_b, uint32_t length_b);
+
+const char* rp2040_bl_phase_to_name(rp2040_bl_phase_t phase);
+// Effective throughput of a phase, its flash bytes over the time spent sending and waiting, 0 without any bytes
+uint32_t    rp2040_bl_phase_bytes_per_second(const rp2040_bl_phase_stats_t* phase);
+// Log the time spent in each phase of bl->stats
+void        rp2040_bl_log_stats(const rp2040_bl_t* bl);
+
+bool rp2040_bl_sync(rp2040_bl_t* bl);
+// Repeat SYNC until the bootloader answers or timeout_us expires. The first attempt waits for a single round trip and
+// every next attempt waits twice as long. A reply that arrives late or in pieces still counts, as the match is kept
+// across attempts. The time it took is stored in sync_time_us, which may be NULL.
+bool rp2040_bl_sync_wait(rp2040_bl_t* bl, int64_t timeout_us, int64_t* sync_time_us);
+bool rp2040_bl_get_info(rp2040_bl_t* bl, uint32_t* flash_start, uint32_t* flash_size, uint32_t* erase_size, uint32_t* write_size, uint32_t* max_data_len);
+bool rp2040_bl_erase(rp2040_bl_t* bl, uint32_t address, uint32_t length);
+bool rp2040_bl_crc(rp2040_bl_t* bl, uint32_t address, uint32_t length, uint32_t* crc);
+bool rp2040_bl_read(rp2040_bl_t* bl, uint32_t address, uint32_t length, uint8_t* data);
+bool rp2040_bl_write(rp2040_bl_t* bl, uint32_t address, uint32_t length, const uint8_t* data, uint32_t* crc);
+
+// Non-blocking commands: the *_start functions send a command without waiting for its reply, up to RP2040_BL_MAX_PENDING
+// at a time, and the matching *_finish functions collect the replies in the order the commands were sent. A finish
+// function blocks until its reply is complete or has timed out, unless rp2040_bl_poll has already returned ESP_OK.
+// Read data is received straight into the buffer passed to rp2040_bl_read_start, which must stay valid until then.
+// The CRC in every write reply is checked against the CRC of the data that was sent.
+bool rp2040_bl_erase_start(rp2040_bl_t* bl, uint32_t address, uint32_t length);
+bool rp2040_bl_erase_finish(rp2040_bl_t* bl);
+bool rp2040_bl_read_start(rp2040_bl_t* bl, uint32_t address, uint32_t length, uint8_t* data);
+bool rp2040_bl_read_finish(rp2040_bl_t* bl);
+bool rp2040_bl_write_start(rp2040_bl_t* bl, uint32_t address, uint32_t length, const uint8_t* data);
+bool rp2040_bl_write_finish(rp2040_bl_t* bl, uint32_t* crc);
+
+// Parse the reply bytes of the oldest pending command that have arrived, waiting at most wait_us for more. With wait_us 0
+// it never blocks, so it can be called from a loop that also serves other work, for example whenever bl->event_queue
+// reports received data. Returns ESP_OK once the reply is complete, ESP_ERR_NOT_FINISHED while it is not, ESP_FAIL or
+// ESP_ERR_TIMEOUT when the command failed, which discards all pending commands, and ESP_ERR_INVALID_STATE when none are.
+esp_err_t rp2040_bl_poll(rp2040_bl_t* bl, int64_t wait_us);
+uint8_t   rp2040_bl_pending(const rp2040_bl_t* bl);
+
+bool rp2040_bl_seal(rp2040_bl_t* bl, uint32_t vtor, uint32_t length, uint32_t crc);
+bool rp2040_bl_go(rp2040_bl_t* bl, uint32_t vtor);
+
+typedef struct rp2040_sink rp2040_sink_t;  // Declared in rp2040source.h
+
+// Stream a range of flash to a sink. Reads are pipelined and verified against a bootloader CRC per batch
+// of RP2040_BL_DUMP_BATCH_SIZE bytes, batches that fail are read and written to the sink again. The bootloader
+// calculates CRCs over whole words, so address and length must be multiples of 4.
+bool rp2040_bl_dump(rp2040_bl_t* bl, uint32_t address, uint32_t length, rp2040_sink_t* sink, rp2040_bl_dump_stats_t* stats);
+
+#endif  // CONFIG_RP2040_BOOTLOADER
+
+#ifdef __cplusplus
+}
+#endif
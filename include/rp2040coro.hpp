@@ -0,0 +1,584 @@
+#pragma once
+
+#if __cplusplus < 202002L
+#error "rp2040coro.hpp needs C++20"
+#endif
+
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+
+#include <array>
+#include <atomic>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+
+#include "rp2040.h"
+#include "rp2040.hpp"
+#if CONFIG_RP2040_BOOTLOADER
+#include "rp2040bl.h"
+#endif
+
+// Coroutines for the RP2040 that share a single FreeRTOS task. An executor runs the coroutines spawned on it one at a
+// time and, whenever all of them wait, blocks on whatever they wait for: the reply of a bootloader command, an input
+// interrupt or a timer.
+//
+//     rp2040::task blink(rp2040::executor& loop, rp2040::async_device<0x09>& device) {
+//         for (uint8_t on = 0;; on ^= 1) {
+//             esp_err_t res = co_await device.write<rp2040::lcd_backlight>(on ? 255 : 0);
+//             if (res != ESP_OK) co_return res;
+//             co_await loop.sleep_for(500 * 1000);
+//         }
+//     }
+//
+//     rp2040::executor loop;
+//     loop.spawn(blink(loop, device));
+//     loop.spawn(buttons(loop, inputs));
+//     loop.run();
+
+namespace rp2040 {
+
+class executor;
+
+// Every coroutine frame is allocated from the heap, so these counters show what the coroutines in flight cost. An
+// operation that is awaited lives in the frame of the coroutine awaiting it, so it is included in the frame size.
+struct frame_stats {
+    size_t frames;      // Coroutine frames allocated now
+    size_t bytes;       // Total size of those frames
+    size_t peak_bytes;  // Largest total size since the counters were cleared
+};
+
+namespace detail {
+
+inline std::atomic<size_t> frames{0};
+inline std::atomic<size_t> frame_bytes{0};
+inline std::atomic<size_t> peak_frame_bytes{0};
+
+// Rounded up to whole ticks, so a wait never ends before its deadline
+inline TickType_t ticks(int64_t wait_us) {
+    if (wait_us <= 0) return 0;
+    int64_t tick_us = (int64_t) portTICK_PERIOD_MS * 1000;
+    return (TickType_t) ((wait_us + tick_us - 1) / tick_us);
+}
+
+}  // namespace detail
+
+inline frame_stats get_frame_stats() { return {detail::frames.load(), detail::frame_bytes.load(), detail::peak_frame_bytes.load()}; }
+
+inline void clear_peak_frame_bytes() { detail::peak_frame_bytes = detail::frame_bytes.load(); }
+
+// Result of an operation that completed without suspending, such as a register access
+struct completed {
+    esp_err_t result;
+
+    bool      await_ready() const noexcept { return true; }
+    void      await_suspend(std::coroutine_handle<>) const noexcept {}
+    esp_err_t await_resume() const noexcept { return result; }
+};
+
+// A coroutine that returns an esp_err_t. It starts when it is spawned on an executor or awaited by another task.
+class [[nodiscard]] task {
+   public:
+    struct promise_type;
+    using handle_type = std::coroutine_handle<promise_type>;
+
+    struct final_awaiter {
+        bool                    await_ready() const noexcept { return false; }
+        std::coroutine_handle<> await_suspend(handle_type handle) noexcept;
+        void                    await_resume() const noexcept {}
+    };
+
+    struct promise_type {
+        esp_err_t               result = ESP_OK;
+        std::coroutine_handle<> continuation;     // Task awaiting this one, none for tasks spawned on an executor
+        executor*               owner  = nullptr;  // Executor this task was spawned on
+        esp_err_t*              report = nullptr;  // Receives the result of a spawned task
+
+        task                get_return_object() { return task(handle_type::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        final_awaiter       final_suspend() noexcept { return {}; }
+        void                return_value(esp_err_t value) { result = value; }
+        void                unhandled_exception() { abort(); }  // ESP-IDF builds without exceptions by default
+
+        static task get_return_object_on_allocation_failure() { return task(nullptr); }
+
+        static void* operator new(size_t size) noexcept {
+            void* frame = malloc(size);
+            if (frame == nullptr) return nullptr;
+            detail::frames++;
+            size_t bytes = detail::frame_bytes += size;
+            size_t peak  = detail::peak_frame_bytes.load();
+            while (bytes > peak && !detail::peak_frame_bytes.compare_exchange_weak(peak, bytes)) {
+            }
+            return frame;
+        }
+
+        static void operator delete(void* frame, size_t size) noexcept {
+            detail::frames--;
+            detail::frame_bytes -= size;
+            free(frame);
+        }
+    };
+
+    task(task&& other) noexcept : handle_(other.handle_) { other.handle_ = nullptr; }
+    task(const task&)            = delete;
+    task& operator=(const task&) = delete;
+    ~task() {
+        if (handle_) handle_.destroy();
+    }
+
+    // Awaiting a task runs it to completion and returns its result, ESP_ERR_NO_MEM if its frame could not be allocated
+    bool await_ready() const noexcept { return !handle_; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+        handle_.promise().continuation = awaiting;
+        return handle_;
+    }
+    esp_err_t await_resume() const noexcept { return handle_ ? handle_.promise().result : ESP_ERR_NO_MEM; }
+
+   private:
+    friend class executor;
+
+    explicit task(handle_type handle) : handle_(handle) {}
+
+    handle_type handle_;
+};
+
+// Something coroutines can wait for. Sources register with an executor when they are constructed and must outlive
+// every coroutine that awaits them.
+class event_source {
+   public:
+    event_source(const event_source&)            = delete;
+    event_source& operator=(const event_source&) = delete;
+
+   protected:
+    explicit event_source(executor& loop);
+    virtual ~event_source();
+
+    virtual bool waiting() const = 0;        // Whether a coroutine is waiting for this source
+    virtual void poll()          = 0;        // Resume the coroutines whose wait is over, without blocking
+    virtual void wait(int64_t wait_us) = 0;  // Block for at most wait_us, or less as soon as poll may have work
+
+    executor& loop_;
+
+   private:
+    friend class executor;
+
+    event_source* next_ = nullptr;
+};
+
+class executor {
+   public:
+    static constexpr size_t  max_tasks    = 16;      // Spawned tasks that can be in flight at the same time
+    static constexpr int64_t max_wait_us  = 100000;  // Longest a single wait blocks the executor
+    static constexpr int64_t poll_wait_us = 1;       // Shortest wait when several sources are awaited, one tick in practice
+
+    class sleep_awaiter {
+       public:
+        bool await_ready() const noexcept { return deadline_ <= esp_timer_get_time(); }
+        void await_suspend(std::coroutine_handle<> handle) noexcept {
+            handle_ = handle;
+            loop_.add_timer(this);
+        }
+        void await_resume() const noexcept {}
+
+       private:
+        friend class executor;
+
+        sleep_awaiter(executor& loop, int64_t deadline) : loop_(loop), deadline_(deadline) {}
+
+        executor&               loop_;
+        int64_t                 deadline_;
+        std::coroutine_handle<> handle_;
+        sleep_awaiter*          next_ = nullptr;
+    };
+
+    executor() = default;
+    executor(const executor&)            = delete;
+    executor& operator=(const executor&) = delete;
+    // Tasks that have not completed are destroyed, the sources they wait for must not be used with them afterwards
+    ~executor() {
+        for (task::handle_type& handle : spawned_) {
+            if (handle) handle.destroy();
+        }
+    }
+
+    // Start work the next time the executor runs. result, which may be NULL, receives the result once the task completes.
+    esp_err_t spawn(task&& work, esp_err_t* result = nullptr) {
+        if (!work.handle_) return ESP_ERR_NO_MEM;
+        for (task::handle_type& handle : spawned_) {
+            if (handle) continue;
+            handle                  = work.handle_;
+            work.handle_            = nullptr;
+            handle.promise().owner  = this;
+            handle.promise().report = result;
+            tasks_++;
+            schedule(handle);
+            return ESP_OK;
+        }
+        return ESP_ERR_NO_MEM;
+    }
+
+    // Run until every spawned task has completed. Returns ESP_ERR_INVALID_STATE if tasks wait for nothing that can end.
+    esp_err_t run() {
+        while (tasks_ > 0) {
+            while (ready_count_ > 0) pop_ready().resume();
+            if (tasks_ == 0) break;
+
+            int64_t now = esp_timer_get_time();
+            while (timers_ != nullptr && timers_->deadline_ <= now) {
+                sleep_awaiter* timer = timers_;
+                timers_              = timer->next_;
+                schedule(timer->handle_);
+            }
+            for (event_source* source = sources_; source != nullptr; source = source->next_) {
+                if (source->waiting()) source->poll();
+            }
+            if (ready_count_ > 0) continue;
+
+            event_source* blocking = nullptr;
+            size_t        awaited  = 0;
+            for (event_source* source = sources_; source != nullptr; source = source->next_) {
+                if (!source->waiting()) continue;
+                if (blocking == nullptr) blocking = source;
+                awaited++;
+            }
+            if (blocking == nullptr && timers_ == nullptr) return ESP_ERR_INVALID_STATE;
+
+            int64_t wait_us = timers_ != nullptr ? timers_->deadline_ - now : max_wait_us;
+            if (wait_us > max_wait_us) wait_us = max_wait_us;
+            if (awaited > 1 && wait_us > poll_wait_us) wait_us = poll_wait_us;  // The other sources are polled after it
+            if (blocking != nullptr) {
+                blocking->wait(wait_us);
+            } else {
+                vTaskDelay(detail::ticks(wait_us));
+            }
+        }
+        return ESP_OK;
+    }
+
+    // Resume the awaiting coroutine once wait_us has passed
+    sleep_awaiter sleep_for(int64_t wait_us) { return sleep_awaiter(*this, esp_timer_get_time() + wait_us); }
+
+    size_t tasks() const { return tasks_; }
+
+    // For event sources: resume handle the next time the executor gets to it. The queue fits every task, so a full queue
+    // means a source scheduled a coroutine twice, which would then be resumed while it runs.
+    void schedule(std::coroutine_handle<> handle) {
+        if (ready_count_ == ready_.size()) abort();
+        ready_[(ready_head_ + ready_count_) % ready_.size()] = handle;
+        ready_count_++;
+    }
+
+   private:
+    friend class task;
+    friend class event_source;
+
+    std::coroutine_handle<> pop_ready() {
+        std::coroutine_handle<> handle = ready_[ready_head_];
+        ready_head_                    = (ready_head_ + 1) % ready_.size();
+        ready_count_--;
+        return handle;
+    }
+
+    void add_timer(sleep_awaiter* timer) {
+        sleep_awaiter** position = &timers_;
+        while (*position != nullptr && (*position)->deadline_ <= timer->deadline_) position = &(*position)->next_;
+        timer->next_ = *position;
+        *position    = timer;
+    }
+
+    void complete(task::handle_type handle) {
+        if (handle.promise().report != nullptr) *handle.promise().report = handle.promise().result;
+        for (task::handle_type& spawned : spawned_) {
+            if (spawned == handle) spawned = nullptr;
+        }
+        handle.destroy();
+        tasks_--;
+    }
+
+    // Every task waits for a single thing at a time, so no more than max_tasks coroutines can be ready at once
+    std::array<task::handle_type, max_tasks>       spawned_;
+    std::array<std::coroutine_handle<>, max_tasks> ready_;
+    size_t                                         ready_head_  = 0;
+    size_t                                         ready_count_ = 0;
+    size_t                                         tasks_       = 0;
+    sleep_awaiter*                                 timers_      = nullptr;  // Sorted by deadline
+    event_source*                                  sources_     = nullptr;
+};
+
+inline std::coroutine_handle<> task::final_awaiter::await_suspend(handle_type handle) noexcept {
+    std::coroutine_handle<> continuation = handle.promise().continuation;
+    if (continuation) return continuation;
+    handle.promise().owner->complete(handle);
+    return std::noop_coroutine();
+}
+
+inline event_source::event_source(executor& loop) : loop_(loop), next_(loop.sources_) { loop.sources_ = this; }
+
+inline event_source::~event_source() {
+    event_source** position = &loop_.sources_;
+    while (*position != this) position = &(*position)->next_;
+    *position = next_;
+}
+
+// Register access as operations that can be awaited. The I2C driver completes a transaction of a few bytes in well under
+// a millisecond and does not offer an asynchronous mode per device, so these complete without suspending.
+template <uint8_t Firmware>
+class async_device : public device<Firmware> {
+   public:
+    using device<Firmware>::device;
+
+    template <typename Reg>
+    completed read(typename Reg::value_type& value) const {
+        return {device<Firmware>::template read<Reg>(value)};
+    }
+
+    template <typename Reg>
+    completed write(const typename Reg::value_type& value) const {
+        return {device<Firmware>::template write<Reg>(value)};
+    }
+};
+
+struct input_event {
+    rp2040_input_t input;
+    bool           state;
+};
+
+// Input changes reported by the RP2040 interrupt, replacing the interrupt task. The device must have been initialised
+// with an interrupt pin and without a callback, so rp2040_init does not create the interrupt task.
+class input_events : public event_source {
+   public:
+    static constexpr size_t capacity = 32;  // Changes buffered while no coroutine awaits them
+
+    class awaiter {
+       public:
+        bool await_ready() const noexcept { return events_.count_ > 0 || events_.error_ != ESP_OK; }
+        void await_suspend(std::coroutine_handle<> handle) noexcept { events_.waiter_ = handle; }
+        esp_err_t await_resume() noexcept { return events_.take(event_); }
+
+       private:
+        friend class input_events;
+
+        awaiter(input_events& events, input_event& event) : events_(events), event_(event) {}
+
+        input_events& events_;
+        input_event&  event_;
+    };
+
+    input_events(executor& loop, RP2040* device) : event_source(loop), device_(device) {}
+
+    // Wait for the next change, for one coroutine at a time. Returns the error of the I2C transaction if reading the
+    // changes failed.
+    awaiter next(input_event& event) { return awaiter(*this, event); }
+
+    uint32_t dropped() const { return dropped_; }  // Changes lost because the buffer was full
+
+   protected:
+    bool waiting() const override { return static_cast<bool>(waiter_); }
+
+    void poll() override {
+        if (!triggered_ && xSemaphoreTake(device_->_intr_trigger, 0) != pdTRUE) return;
+        triggered_ = false;
+        uint32_t state;
+        error_ = device<0x01>(device_).read<input_state>(state);
+        if (error_ == ESP_OK) {
+            uint16_t interrupt = state >> 16;
+            for (uint8_t index = 0; index < 16; index++) {
+                if (((interrupt >> index) & 0x01) == 0) continue;
+                if (count_ == capacity) {
+                    dropped_++;
+                    continue;
+                }
+                events_[(head_ + count_++) % capacity] = {(rp2040_input_t) index, ((state >> index) & 0x01) != 0};
+            }
+        }
+        if (count_ > 0 || error_ != ESP_OK) resume();
+    }
+
+    void wait(int64_t wait_us) override {
+        if (xSemaphoreTake(device_->_intr_trigger, detail::ticks(wait_us)) == pdTRUE) triggered_ = true;
+    }
+
+   private:
+    void resume() {
+        loop_.schedule(waiter_);
+        waiter_ = nullptr;
+    }
+
+    esp_err_t take(input_event& event) {
+        if (count_ == 0) {
+            esp_err_t error = error_;
+            error_          = ESP_OK;
+            return error;
+        }
+        event = events_[head_];
+        head_ = (head_ + 1) % capacity;
+        count_--;
+        return ESP_OK;
+    }
+
+    RP2040*                              device_;
+    std::coroutine_handle<>              waiter_;
+    std::array<input_event, capacity>    events_;
+    size_t                               head_      = 0;
+    size_t                               count_     = 0;
+    uint32_t                             dropped_   = 0;
+    esp_err_t                            error_     = ESP_OK;
+    bool                                 triggered_ = false;
+};
+
+#if CONFIG_RP2040_BOOTLOADER
+// Bootloader commands as operations that can be awaited, built on the non-blocking commands of rp2040bl.h. Any number
+// of coroutines can issue commands, they are sent in the order they were awaited with up to window of them in flight.
+// Like the write window of an update, only raise it above 1 if the bootloader buffers incoming commands, at most
+// RP2040_BL_MAX_PENDING. The channel must be the only user of the session while commands are in flight.
+class bl_channel : public event_source {
+   public:
+    class operation {
+       public:
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> handle) noexcept {
+            handle_ = handle;
+            channel_.submit(this);
+        }
+        bool await_resume() const noexcept { return success_; }  // Like the blocking commands
+
+       private:
+        friend class bl_channel;
+
+        enum class kind : uint8_t { erase, read, write };
+
+        operation(bl_channel& channel, kind type, uint32_t address, uint32_t length)
+            : channel_(channel), type_(type), address_(address), length_(length) {}
+
+        bl_channel&             channel_;
+        kind                    type_;
+        bool                    started_ = false;
+        bool                    success_ = false;
+        uint32_t                address_;
+        uint32_t                length_;
+        uint8_t*                read_data_  = nullptr;
+        const uint8_t*          write_data_ = nullptr;
+        uint32_t*               crc_        = nullptr;  // Receives the CRC reported for a write, may be NULL
+        std::coroutine_handle<> handle_;
+        operation*              next_ = nullptr;
+    };
+
+    bl_channel(executor& loop, rp2040_bl_t* bl, uint8_t window = 1)
+        : event_source(loop), bl_(bl), window_(window < 1 ? 1 : window > RP2040_BL_MAX_PENDING ? RP2040_BL_MAX_PENDING : window) {}
+
+    operation erase(uint32_t address, uint32_t length) { return operation(*this, operation::kind::erase, address, length); }
+
+    // data must stay valid until the operation completes
+    operation read(uint32_t address, uint32_t length, uint8_t* data) {
+        operation op(*this, operation::kind::read, address, length);
+        op.read_data_ = data;
+        return op;
+    }
+
+    operation write(uint32_t address, uint32_t length, const uint8_t* data, uint32_t* crc = nullptr) {
+        operation op(*this, operation::kind::write, address, length);
+        op.write_data_ = data;
+        op.crc_        = crc;
+        return op;
+    }
+
+   protected:
+    bool waiting() const override { return head_ != nullptr; }
+
+    void poll() override {
+        start_queued();
+        while (head_ != nullptr && head_->started_) {
+            esp_err_t res = rp2040_bl_poll(bl_, 0);
+            if (res == ESP_ERR_NOT_FINISHED) break;
+            operation* op = pop();
+            op->success_  = res == ESP_OK && finish(op);
+            loop_.schedule(op->handle_);
+            if (!op->success_ && rp2040_bl_pending(bl_) == 0) fail_started();  // The session discarded every command in flight
+            start_queued();
+        }
+    }
+
+    void wait(int64_t wait_us) override {
+        if (head_ != nullptr && head_->started_) rp2040_bl_poll(bl_, wait_us);  // poll collects the result
+    }
+
+   private:
+    void submit(operation* op) {
+        *tail_ = op;
+        tail_  = &op->next_;
+        start_queued();
+    }
+
+    // Send the commands that were waiting for a free slot, in order
+    void start_queued() {
+        operation** position = &head_;
+        while (*position != nullptr && (*position)->started_) position = &(*position)->next_;
+        while (*position != nullptr && rp2040_bl_pending(bl_) < window_) {
+            operation* op = *position;
+            op->started_  = start(op);
+            if (op->started_) {
+                position = &op->next_;
+                continue;
+            }
+            // A command that could not be sent has no reply to wait for
+            *position = op->next_;
+            if (*position == nullptr) tail_ = position;
+            loop_.schedule(op->handle_);
+        }
+    }
+
+    bool start(operation* op) {
+        switch (op->type_) {
+            case operation::kind::erase:
+                return rp2040_bl_erase_start(bl_, op->address_, op->length_);
+            case operation::kind::read:
+                return rp2040_bl_read_start(bl_, op->address_, op->length_, op->read_data_);
+            case operation::kind::write:
+                return rp2040_bl_write_start(bl_, op->address_, op->length_, op->write_data_);
+        }
+        return false;
+    }
+
+    bool finish(operation* op) {
+        switch (op->type_) {
+            case operation::kind::erase:
+                return rp2040_bl_erase_finish(bl_);
+            case operation::kind::read:
+                return rp2040_bl_read_finish(bl_);
+            case operation::kind::write: {
+                uint32_t crc;
+                bool     success = rp2040_bl_write_finish(bl_, &crc);
+                if (op->crc_ != nullptr) *op->crc_ = crc;
+                return success;
+            }
+        }
+        return false;
+    }
+
+    operation* pop() {
+        operation* op = head_;
+        head_         = op->next_;
+        if (head_ == nullptr) tail_ = &head_;
+        return op;
+    }
+
+    void fail_started() {
+        while (head_ != nullptr && head_->started_) {
+            operation* op = pop();
+            op->success_  = false;
+            loop_.schedule(op->handle_);
+        }
+    }
+
+    rp2040_bl_t* bl_;
+    uint8_t      window_;          // Commands in flight at once
+    operation*   head_ = nullptr;  // Operations in the order they were awaited, the started ones first
+    operation**  tail_ = &head_;
+};
+#endif  // CONFIG_RP2040_BOOTLOADER
+
+}  // namespace rp2040
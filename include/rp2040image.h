@@ -0,0 +1,55 @@
+#pragma once
+
+#include <esp_err.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sdkconfig.h>
+
+#include "rp2040source.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define RP2040_IMAGE_FLASH_BASE 0x10000000  // XIP address of the RP2040 flash, data outside of it is ignored
+#define RP2040_IMAGE_FLASH_SIZE (16 * 1024 * 1024)
+
+#define RP2040_IMAGE_UF2_FAMILY_ID 0xE48BFF56
+
+// Populated address range. The data is stored in the image file in blocks of block_size bytes,
+// stride bytes apart: one block for an ELF segment, or the payloads of consecutive UF2 blocks.
+typedef struct {
+    uint32_t address;
+    uint32_t length;
+    uint32_t source_offset;
+    uint32_t block_size;
+    uint32_t stride;
+} rp2040_image_segment_t;
+
+typedef struct {
+    rp2040_image_segment_t* segments;  // Sorted by address, adjacent ranges are coalesced
+    size_t                  segment_count;
+    uint32_t                start;            // Lowest populated address
+    uint32_t                end;              // End of the highest populated address
+    uint32_t                populated_bytes;  // Bytes with data, the rest of start to end is padding
+    size_t                  _capacity;
+} rp2040_image_t;
+
+#if CONFIG_RP2040_BOOTLOADER
+// Parse the load segments of a UF2 or ELF file, detected by its magic. file must allow random access.
+esp_err_t rp2040_image_load(rp2040_image_t* image, rp2040_source_t* file);
+esp_err_t rp2040_image_load_uf2(rp2040_image_t* image, rp2040_source_t* file);
+esp_err_t rp2040_image_load_elf(rp2040_image_t* image, rp2040_source_t* file);
+void      rp2040_image_free(rp2040_image_t* image);
+
+bool rp2040_image_is_populated(const rp2040_image_t* image, uint32_t address, uint32_t length);
+
+// Flat view of the image from image->start to image->end with 0xFF padding between segments. The update engine
+// only erases and writes the flash sectors that contain data. file and image must stay valid while source is used.
+esp_err_t rp2040_source_from_image(rp2040_source_t* source, rp2040_source_t* file, const rp2040_image_t* image);
+#endif  // CONFIG_RP2040_BOOTLOADER
+
+#ifdef __cplusplus
+}
+#endif
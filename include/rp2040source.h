@@ -0,0 +1,103 @@
+#pragma once
+
+#include <esp_err.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sdkconfig.h>
+
+#define RP2040_SOURCE_MAX_WINDOW_BITS     12    // Limits decompression working memory to a 4 KB window
+#define RP2040_SOURCE_PREFETCH_MAX_CHUNKS 16
+#define RP2040_SOURCE_PREFETCH_CORE       (-1)  // The second core on dual core chips, the update runs on the main task
+#define RP2040_SOURCE_PREFETCH_ANY_CORE   (-2)  // Not pinned to a core
+
+#if CONFIG_RP2040_BOOTLOADER
+#include "esp_partition.h"
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct rp2040_source rp2040_source_t;
+
+typedef bool (*rp2040_source_stream_t)(void* arg, uint8_t* buffer, uint32_t length);
+
+// Firmware image source. fetch() returns a pointer to length bytes at offset, either pointing directly
+// into the storage of the source (zero copy) or to buffer after copying the data into it, or NULL on failure.
+// populated() is optional, sparse images use it to report ranges that are only padding and need not be written.
+struct rp2040_source {
+    uint32_t length;
+    uint32_t address;     // Flash address the image is linked for, 0 if unknown
+    bool     sequential;  // Can only be fetched front to back, once
+    const uint8_t* (*fetch)(rp2040_source_t* source, uint32_t offset, uint8_t* buffer, uint32_t length);
+    bool (*populated)(rp2040_source_t* source, uint32_t offset, uint32_t length);
+    void (*close)(rp2040_source_t* source);
+    void*                  ctx;
+    uint32_t               heap_bytes;  // Working memory allocated by the source, including the sources it wraps
+    rp2040_source_stream_t _stream;
+    void*                  _arg;
+    uint32_t               _position;
+    uint32_t               _handle;
+};
+
+// Without CONFIG_RP2040_BOOTLOADER only the source type remains for the update stubs of rp2040update.h
+#if CONFIG_RP2040_BOOTLOADER
+void      rp2040_source_from_buffer(rp2040_source_t* source, const uint8_t* data, uint32_t length);
+esp_err_t rp2040_source_open_file(rp2040_source_t* source, const char* path);
+esp_err_t rp2040_source_from_partition(rp2040_source_t* source, const esp_partition_t* partition, uint32_t length);
+void      rp2040_source_from_stream(rp2040_source_t* source, uint32_t length, rp2040_source_stream_t read, void* arg);
+// Streams the decompressed contents of a compressed image container. The container is a 16 byte header,
+// "RPHS", window bits, lookahead bits, 2 reserved bytes, uncompressed length and uncompressed CRC-32
+// (little endian), followed by a heatshrink compressed stream. compressed must stay open while source is used. The
+// fetch that completes the image fails if the decompressed data does not match the CRC. tools/rp2040_compress.py
+// creates the container.
+esp_err_t rp2040_source_decompress(rp2040_source_t* source, rp2040_source_t* compressed);
+
+typedef struct {
+    uint32_t chunk_size;   // Bytes fetched from the inner source at a time
+    uint8_t  chunk_count;  // Buffers in the pool, at most RP2040_SOURCE_PREFETCH_MAX_CHUNKS, limits how far the task reads ahead
+    int      core;         // Core the prefetch task is pinned to, RP2040_SOURCE_PREFETCH_CORE or RP2040_SOURCE_PREFETCH_ANY_CORE
+    unsigned priority;
+    uint32_t stack_size;
+} rp2040_prefetch_config_t;
+
+#define RP2040_PREFETCH_DEFAULT_CONFIG()             \
+    {                                                \
+        .chunk_size  = 1024,                         \
+        .chunk_count = 8,                            \
+        .core        = RP2040_SOURCE_PREFETCH_CORE,  \
+        .priority    = 5,                            \
+        .stack_size  = 4096,                         \
+    }
+
+// Fetches inner ahead of its use on a task of its own, so reading, decompressing and padding the image overlap with
+// the transfer and with erasing. Chunks are passed between the tasks through lock-free single producer, single consumer
+// queues and a fixed pool of buffers. A fetch outside of the data read ahead restarts the task at that offset. inner must
+// stay open while source is used and is only fetched from the prefetch task, its populated() from the caller.
+esp_err_t rp2040_source_prefetch(rp2040_source_t* source, rp2040_source_t* inner, const rp2040_prefetch_config_t* config);
+
+void rp2040_source_close(rp2040_source_t* source);
+
+typedef struct rp2040_sink rp2040_sink_t;
+
+// Destination for data read from the RP2040, write() stores length bytes at offset
+struct rp2040_sink {
+    bool (*write)(rp2040_sink_t* sink, uint32_t offset, const uint8_t* data, uint32_t length);
+    void (*close)(rp2040_sink_t* sink);
+    void*                  ctx;
+    const esp_partition_t* _partition;
+    uint32_t               _position;
+    uint32_t               _erased;
+};
+
+void      rp2040_sink_to_buffer(rp2040_sink_t* sink, uint8_t* buffer);
+esp_err_t rp2040_sink_open_file(rp2040_sink_t* sink, const char* path);
+void      rp2040_sink_to_partition(rp2040_sink_t* sink, const esp_partition_t* partition);
+void      rp2040_sink_close(rp2040_sink_t* sink);
+
+#endif  // CONFIG_RP2040_BOOTLOADER
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,183 @@
+#pragma once
+
+#include <esp_err.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "rp2040.h"
+#include "rp2040bl.h"
+#include "rp2040source.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define RP2040_UPDATE_MAX_WRITE_WINDOW 4
+#define RP2040_UPDATE_VERIFY_SAMPLES   16  // Chunks read back by RP2040_UPDATE_VERIFY_SAMPLED unless verify_samples is set
+
+typedef enum {
+    RP2040_UPDATE_STATE_IDLE = 0,
+    RP2040_UPDATE_STATE_REBOOT,
+    RP2040_UPDATE_STATE_WAIT_BOOTLOADER,
+    RP2040_UPDATE_STATE_SYNC,
+    RP2040_UPDATE_STATE_INFO,
+    RP2040_UPDATE_STATE_CHECK,
+    RP2040_UPDATE_STATE_COMPARE,
+    RP2040_UPDATE_STATE_ERASE,
+    RP2040_UPDATE_STATE_WRITE,
+    RP2040_UPDATE_STATE_VERIFY,
+    RP2040_UPDATE_STATE_SEAL,
+    RP2040_UPDATE_STATE_GO,
+    RP2040_UPDATE_STATE_DONE,
+    RP2040_UPDATE_STATE_FAILED,
+} rp2040_update_state_t;
+
+// How the written image is verified before it is sealed, from fastest to most thorough
+typedef enum {
+    RP2040_UPDATE_VERIFY_WRITE_CRC = 0,  // Only the CRC in the reply to every write, which costs no extra time
+    RP2040_UPDATE_VERIFY_CRC,            // One CRC of the whole image calculated by the bootloader
+    RP2040_UPDATE_VERIFY_SAMPLED,        // Read back randomly chosen chunks and compare them with the image
+    RP2040_UPDATE_VERIFY_FULL,           // Read back the whole image and compare it
+} rp2040_update_verify_t;
+
+typedef struct {
+    uint32_t length;  // Identity of the image being written: padded length, CRC and destination
+    uint32_t crc;
+    uint32_t flash_start;
+    uint32_t erase_size;
+    uint32_t position;  // Everything before this position has been written
+} rp2040_update_journal_entry_t;
+
+// Persistent record of the progress of an update, so an interrupted update can be resumed
+typedef struct {
+    bool (*load)(void* ctx, rp2040_update_journal_entry_t* entry);
+    bool (*store)(void* ctx, const rp2040_update_journal_entry_t* entry);
+    void (*clear)(void* ctx);
+    void* ctx;
+} rp2040_update_journal_t;
+
+// Identity of a firmware image, shipped with it to decide at boot whether the RP2040 needs an update
+typedef struct {
+    uint8_t  version;    // Firmware version the image reports over I2C
+    bool     ambiguous;  // Other builds report the same version (development builds), only the CRC identifies the image
+    uint32_t length;     // Not necessarily a multiple of 4, the image is then compared together with its padding
+    uint32_t crc;        // CRC-32 (IEEE 802.3) of the length bytes of the image, as calculated by rp2040_bl_crc32
+} rp2040_update_manifest_t;
+
+typedef void (*rp2040_update_progress_t)(rp2040_update_state_t state, uint32_t position, uint32_t length, void* arg);
+
+typedef struct {
+    uint32_t bytes_written;
+    uint32_t sectors_written;
+    uint32_t sectors_skipped;            // Sectors whose contents already matched the image
+    uint32_t sectors_unpopulated;        // Sectors of a sparse image without data, neither erased nor written
+    uint32_t sectors_rewritten;          // Unchanged sectors written again because erasing their whole block was cheaper
+    uint32_t erase_commands;             // Changed sectors are erased in batches, usually with far fewer commands than sectors
+    uint32_t resumed_bytes;              // Bytes written by an earlier, interrupted update that were kept
+    int64_t  time_saved_us;              // Estimated time saved by skipping unchanged sectors
+    uint32_t bytes_per_second;           // Effective write throughput, including erase time
+    uint32_t transfer_bytes_per_second;  // Throughput while writing, excluding erase time
+    uint32_t link_bytes_per_second;      // Limit imposed by the UART baud rate
+    int64_t  write_duration_us;          // Time spent in the erase and write states
+    int64_t  bootloader_time_us;         // Time from start of the update until the bootloader answered, including the reboot
+    int64_t  duration_us;                // Time from start of the update until the GO command
+    uint32_t heap_bytes;                 // Heap used by the update and its source, independent of the image size
+    uint32_t verified_bytes;             // Bytes read back or checksummed by the verification
+    int64_t  verify_duration_us;
+} rp2040_update_stats_t;
+
+typedef struct {
+    RP2040*                  device;  // Set to NULL if the RP2040 is already running the bootloader
+    rp2040_bl_t*             bl;      // Bootloader session, its UART is installed when the bootloader is reached
+    rp2040_source_t*         source;
+    bool                     full_write;    // Write every sector, even when its contents already match the image
+    uint8_t                  write_window;  // Writes in flight at once, only raise above 1 if the bootloader buffers incoming commands
+    rp2040_update_journal_t* journal;       // Optional, makes the update resumable. Not supported for sequential sources
+    const uint32_t*          baudrates;     // Optional baud rates to try before flashing, see rp2040_bl_detect_baudrate
+    size_t                   baudrate_count;
+    rp2040_update_verify_t   verify;
+    uint16_t                 verify_samples;  // Chunks read back by RP2040_UPDATE_VERIFY_SAMPLED, 0 for RP2040_UPDATE_VERIFY_SAMPLES
+    rp2040_update_progress_t progress;
+    void*                    progress_arg;
+    rp2040_update_stats_t    stats;
+    rp2040_update_state_t    _state;
+    uint32_t                 _flash_start;
+    uint32_t                 _flash_size;
+    uint32_t                 _erase_size;
+    uint32_t                 _write_size;
+    uint32_t                 _max_data_len;
+    uint32_t                 _chunk_size;
+    uint32_t                 _length;  // Image length padded to the write size
+    uint32_t                 _position;  // Everything before this position has been written and acknowledged
+    uint32_t                 _sent;      // Everything before this position has been sent to the bootloader
+    uint32_t                 _erased;    // Everything from _position up to this position has been erased
+    uint32_t                 _prepared;  // Length of the chunk at _sent that is ready in the buffer
+    const uint8_t*           _prepared_data;
+    uint32_t                 _pending_length[RP2040_UPDATE_MAX_WRITE_WINDOW];
+    uint8_t                  _pending_head;
+    uint8_t                  _pending_count;
+    uint32_t                 _compared_start;  // Sectors compared ahead of _position: bit n of _dirty is set when the sector at
+    uint8_t                  _compared;        // _compared_start + n * _erase_size differs from the image
+    uint32_t                 _dirty;
+    uint32_t                 _crc;  // CRC of the (padded) image, used to seal it
+    uint8_t*                 _buffer;
+    uint8_t*                 _verify_buffer;  // Receives the data read back by the verification
+    uint32_t                 _verify_offset;  // Offset of the chunk being read back
+    uint32_t                 _verify_crc;     // CRC of the data read back from a sequential source
+    uint16_t                 _samples_verified;
+    bool                     _verify_retry;  // The chunk at _verify_offset did not match and is being read again
+    int64_t                  _verify_start_time;
+    int64_t                  _start_time;
+    int64_t                  _write_start_time;
+    int64_t                  _sector_start_time;
+    int64_t                  _sector_write_time;  // Total time spent erasing and writing sectors
+    int64_t                  _transfer_time;      // Total time spent writing
+    int64_t                  _deadline;
+} rp2040_update_t;
+
+// Decide whether the RP2040 runs the firmware described by manifest. A different version means an update is needed and
+// an unambiguous matching version means it is not, both only take a read of the firmware version. Otherwise the RP2040
+// is rebooted into its bootloader to compare the CRC of its flash. Matching firmware is sealed if it was found in the
+// bootloader and started again, and an update is reported as needed if it does not start. Otherwise the bootloader is
+// left running so the update can start without another reboot. The bootloader UART is left as it was found.
+#if CONFIG_RP2040_BOOTLOADER
+esp_err_t rp2040_update_check(RP2040* device, rp2040_bl_t* bl, const rp2040_update_manifest_t* manifest, bool* needed);
+#else
+static inline esp_err_t rp2040_update_check(RP2040* device, rp2040_bl_t* bl, const rp2040_update_manifest_t* manifest, bool* needed) {
+    return ESP_ERR_NOT_SUPPORTED;
+}
+#endif
+
+// Without CONFIG_RP2040_BOOTLOADER the update engine is not built, these entry points then report ESP_ERR_NOT_SUPPORTED
+// so an application can keep its update path and decide at runtime. The remaining functions are not declared.
+// The private fields of update must be zero before the first rp2040_update_init, it can then be initialised again to
+// restart the update, the buffers of the previous run are released.
+#if CONFIG_RP2040_BOOTLOADER
+esp_err_t rp2040_update_init(rp2040_update_t* update);
+esp_err_t rp2040_update_step(rp2040_update_t* update);
+esp_err_t rp2040_update_run(rp2040_update_t* update);
+void      rp2040_update_deinit(rp2040_update_t* update);
+#else
+static inline esp_err_t rp2040_update_init(rp2040_update_t* update) { return ESP_ERR_NOT_SUPPORTED; }
+static inline esp_err_t rp2040_update_step(rp2040_update_t* update) { return ESP_ERR_NOT_SUPPORTED; }
+static inline esp_err_t rp2040_update_run(rp2040_update_t* update) { return ESP_ERR_NOT_SUPPORTED; }
+static inline void      rp2040_update_deinit(rp2040_update_t* update) {}
+#endif
+
+#if CONFIG_RP2040_BOOTLOADER
+esp_err_t rp2040_update_journal_open_nvs(rp2040_update_journal_t* journal, const char* name_space);
+void      rp2040_update_journal_close_nvs(rp2040_update_journal_t* journal);
+
+// Expected duration of verifying a length byte image that is read back in chunks of chunk_size, for samples chunks when
+// sampling. Based on the baud rate and the timing of bl, the update logs the estimate of every strategy once it knows the
+// flash geometry.
+int64_t rp2040_update_estimate_verify_time(rp2040_bl_t* bl, rp2040_update_verify_t verify, uint32_t length, uint32_t chunk_size, uint32_t samples);
+
+const char* rp2040_update_state_to_name(rp2040_update_state_t state);
+const char* rp2040_update_verify_to_name(rp2040_update_verify_t verify);
+#endif  // CONFIG_RP2040_BOOTLOADER
+
+#ifdef __cplusplus
+}
+#endif
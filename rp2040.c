@@ -9,8 +9,9 @@
 
 #include <driver/gpio.h>
 #include <driver/i2c_master.h>
+#include <esp_timer.h>
+#include <inttypes.h>
 #include <sdkconfig.h>
-#include <stdlib.h>
 #include <string.h>
 
 #include "esp_check.h"
@@ -18,26 +19,33 @@
 
 static const char* TAG = "RP2040";
 
-i2c_master_dev_handle_t i2c_device_handle = NULL;
+#if CONFIG_RP2040_STATIC_ALLOCATION
+_Static_assert(CONFIG_RP2040_STATIC_MEMORY_BUDGET == 0 || RP2040_STATIC_FOOTPRINT <= CONFIG_RP2040_STATIC_MEMORY_BUDGET,
+               "The RP2040 struct exceeds CONFIG_RP2040_STATIC_MEMORY_BUDGET");
+#endif
 
 esp_err_t rp2040_read_reg(RP2040* device, uint8_t reg, uint8_t* value, size_t value_len) {
     uint8_t reg_buf[1] = {reg};
 
     if (device->i2c_semaphore != NULL) xSemaphoreTake(device->i2c_semaphore, portMAX_DELAY);
-    ESP_RETURN_ON_ERROR(i2c_master_transmit_receive(i2c_device_handle, reg_buf, sizeof(reg_buf), value, value_len, 500), TAG, "RP2040 I2C transaction failed");
+    esp_err_t res = i2c_master_transmit_receive(device->_i2c_device, reg_buf, sizeof(reg_buf), value, value_len, 500);
     if (device->i2c_semaphore != NULL) xSemaphoreGive(device->i2c_semaphore);
+    ESP_RETURN_ON_ERROR(res, TAG, "RP2040 I2C transaction failed");
 
     return ESP_OK;
 }
 
-esp_err_t rp2040_write_reg(RP2040* device, uint8_t reg, uint8_t* value, size_t value_len) {
-    uint8_t* buf = malloc(value_len + 1);
-    buf[0]       = reg;
+esp_err_t rp2040_write_reg(RP2040* device, uint8_t reg, const uint8_t* value, size_t value_len) {
+    // A write never covers more than the whole register map, so it is staged on the stack
+    uint8_t buf[1 + RP2040_REG_COUNT];
+    if (value_len > RP2040_REG_COUNT) return ESP_ERR_INVALID_SIZE;
+    buf[0] = reg;
     memcpy(&buf[1], value, value_len);
 
     if (device->i2c_semaphore != NULL) xSemaphoreTake(device->i2c_semaphore, portMAX_DELAY);
-    ESP_RETURN_ON_ERROR(i2c_master_transmit(i2c_device_handle, buf, value_len + 1, 500), TAG, "RP2040 I2C transaction failed");
+    esp_err_t res = i2c_master_transmit(device->_i2c_device, buf, value_len + 1, 500);
     if (device->i2c_semaphore != NULL) xSemaphoreGive(device->i2c_semaphore);
+    ESP_RETURN_ON_ERROR(res, TAG, "RP2040 I2C transaction failed");
 
     return ESP_OK;
 }
@@ -50,6 +58,7 @@ static void rp2040_intr_task(void* arg) {
 
     while (1) {
         if (xSemaphoreTake(device->_intr_trigger, portMAX_DELAY)) {
+            if (device->_intr_stop_waiter != NULL) break;
             esp_err_t res = rp2040_read_reg(device, RP2040_REG_INPUT1, (uint8_t*) &state, 4);
             if (res != ESP_OK) {
                 ESP_LOGE(TAG, "RP2040 interrupt task failed to read from RP2040");
@@ -65,6 +74,11 @@ static void rp2040_intr_task(void* arg) {
             }
         }
     }
+
+    // rp2040_deinit deletes the task once it is suspended. A task that deletes itself leaves its TCB to the idle task,
+    // which would still use a static TCB when the device is initialised again right away.
+    xTaskNotifyGive(device->_intr_stop_waiter);
+    vTaskSuspend(NULL);
 }
 
 static void IRAM_ATTR rp2040_intr_handler(void* arg) {
@@ -75,41 +89,49 @@ static void IRAM_ATTR rp2040_intr_handler(void* arg) {
 }
 
 esp_err_t rp2040_init(RP2040* device) {
+    int64_t   start = esp_timer_get_time();
     esp_err_t res;
 
+    device->_i2c_device       = NULL;
+    device->_intr_task_handle = NULL;
+    device->_intr_stop_waiter = NULL;
+    device->_intr_trigger     = NULL;
+
     i2c_device_config_t dev_cfg = {
         .dev_addr_length = I2C_ADDR_BIT_LEN_7,
         .device_address  = device->i2c_address,
         .scl_speed_hz    = 400 * 1000,
     };
 
-    ESP_ERROR_CHECK(i2c_master_bus_add_device(device->i2c_bus_handle, &dev_cfg, &i2c_device_handle));
+    res = i2c_master_bus_add_device(device->i2c_bus_handle, &dev_cfg, &device->_i2c_device);
+    if (res != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to add I2C device");
+        return res;
+    }
 
-    res = rp2040_get_firmware_version(device, &device->_fw_version);
+    // The firmware version and GPIO state are adjacent, so a single transaction reads them
+    uint8_t state[RP2040_REG_GPIO_OUT + 1];
+    res = rp2040_read_reg(device, RP2040_REG_FW_VER, state, sizeof(state));
     if (res != ESP_OK) {
         ESP_LOGE(TAG, "Failed to read firmware version");
         return res;
     }
 
+    device->_fw_version = state[RP2040_REG_FW_VER];
     if (device->_fw_version < 0x01) {
         ESP_LOGE(TAG, "Unsupported RP2040 firmware version (%u) found", device->_fw_version);
         return ESP_ERR_INVALID_VERSION;
     }
 
-    res = rp2040_read_reg(device, RP2040_REG_GPIO_DIR, &device->_gpio_direction, 1);
-    if (res != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to read GPIO direction");
-        return res;
-    }
-
-    res = rp2040_read_reg(device, RP2040_REG_GPIO_OUT, &device->_gpio_value, 1);
-    if (res != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to read GPIO state");
-        return res;
-    }
+    device->_gpio_direction = state[RP2040_REG_GPIO_DIR];
+    device->_gpio_value     = state[RP2040_REG_GPIO_OUT];
 
     // Create interrupt trigger
+#if CONFIG_RP2040_STATIC_ALLOCATION
+    device->_intr_trigger = xSemaphoreCreateBinaryStatic(&device->_intr_trigger_buffer);
+#else
     device->_intr_trigger = xSemaphoreCreateBinary();
+#endif
     if (device->_intr_trigger == NULL) return ESP_ERR_NO_MEM;
 
     // Attach interrupt to interrupt pin
@@ -128,13 +150,63 @@ esp_err_t rp2040_init(RP2040* device) {
         res = gpio_config(&io_conf);
         if (res != ESP_OK) return res;
 
-        xTaskCreate(&rp2040_intr_task, "RP2040 interrupt", 4096, (void*) device, 10, &device->_intr_task_handle);
+        // Without a callback the interrupts are left to the caller, which takes _intr_trigger from a task of its own
+        if (device->callback != NULL) {
+#if CONFIG_RP2040_STATIC_ALLOCATION
+            device->_intr_task_handle = xTaskCreateStatic(&rp2040_intr_task, "RP2040 interrupt", sizeof(device->_intr_task_stack) / sizeof(StackType_t),
+                                                          (void*) device, 10, device->_intr_task_stack, &device->_intr_task_buffer);
+#else
+            BaseType_t created = xTaskCreate(&rp2040_intr_task, "RP2040 interrupt", CONFIG_RP2040_INTR_TASK_STACK_SIZE, (void*) device, 10,
+                                             &device->_intr_task_handle);
+            if (created != pdPASS) device->_intr_task_handle = NULL;
+#endif
+            if (device->_intr_task_handle == NULL) return ESP_ERR_NO_MEM;
+        }
         xSemaphoreGive(device->_intr_trigger);
     }
 
+    ESP_LOGD(TAG, "Initialised in %" PRId64 " us", esp_timer_get_time() - start);
     return ESP_OK;
 }
 
+esp_err_t rp2040_deinit(RP2040* device) {
+    int64_t   start = esp_timer_get_time();
+    esp_err_t res   = ESP_OK;
+
+    // Interrupts stop first, so nothing gives the trigger while the task and the trigger are released
+    if (device->pin_interrupt >= 0 && device->_intr_trigger != NULL) {
+        gpio_intr_disable(device->pin_interrupt);
+        gpio_isr_handler_remove(device->pin_interrupt);
+        gpio_reset_pin(device->pin_interrupt);
+    }
+
+    // The task is asked to stop before it is deleted, so it never stops halfway through an I2C transaction while holding
+    // i2c_semaphore. This blocks until the task has handled the input change it may be busy with.
+    if (device->_intr_task_handle != NULL) {
+        device->_intr_stop_waiter = xTaskGetCurrentTaskHandle();
+        xSemaphoreGive(device->_intr_trigger);
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        while (eTaskGetState(device->_intr_task_handle) != eSuspended) vTaskDelay(1);
+        vTaskDelete(device->_intr_task_handle);
+        device->_intr_task_handle = NULL;
+        device->_intr_stop_waiter = NULL;
+    }
+
+    if (device->_intr_trigger != NULL) {
+        vSemaphoreDelete(device->_intr_trigger);
+        device->_intr_trigger = NULL;
+    }
+
+    if (device->_i2c_device != NULL) {
+        res                 = i2c_master_bus_rm_device(device->_i2c_device);
+        device->_i2c_device = NULL;
+        if (res != ESP_OK) ESP_LOGE(TAG, "Failed to remove I2C device");
+    }
+
+    ESP_LOGD(TAG, "Deinitialised in %" PRId64 " us", esp_timer_get_time() - start);
+    return res;
+}
+
 esp_err_t rp2040_get_firmware_version(RP2040* device, uint8_t* version) {
     esp_err_t res = rp2040_read_reg(device, RP2040_REG_FW_VER, version, 1);
     if (res == ESP_OK) {
@@ -143,6 +215,7 @@ esp_err_t rp2040_get_firmware_version(RP2040* device, uint8_t* version) {
     return res;
 }
 
+#if CONFIG_RP2040_BOOTLOADER
 esp_err_t rp2040_get_bootloader_version(RP2040* device, uint8_t* version) {
     if (device->_fw_version != 0xFF) return ESP_FAIL;
     return rp2040_read_reg(device, RP2040_BL_REG_BL_VER, version, 1);
@@ -163,7 +236,9 @@ esp_err_t rp2040_reboot_to_bootloader(RP2040* device) {
     uint8_t value = 0xBE;
     return rp2040_write_reg(device, RP2040_REG_BL_TRIGGER, &value, 1);
 }
+#endif  // CONFIG_RP2040_BOOTLOADER
 
+#if CONFIG_RP2040_GPIO
 esp_err_t rp2040_get_gpio_dir(RP2040* device, uint8_t gpio, bool* direction) {
     if ((device->_fw_version < 0x01) || (device->_fw_version == 0xFF)) return ESP_FAIL;
     esp_err_t res = rp2040_read_reg(device, RP2040_REG_GPIO_DIR, &device->_gpio_direction, 1);
@@ -199,6 +274,7 @@ esp_err_t rp2040_set_gpio_value(RP2040* device, uint8_t gpio, bool value) {
     }
     return rp2040_write_reg(device, RP2040_REG_GPIO_OUT, &device->_gpio_value, 1);
 }
+#endif  // CONFIG_RP2040_GPIO
 
 esp_err_t rp2040_get_lcd_backlight(RP2040* device, uint8_t* brightness) {
     if ((device->_fw_version < 0x01) || (device->_fw_version == 0xFF)) return ESP_FAIL;
@@ -232,6 +308,7 @@ esp_err_t rp2040_get_uid(RP2040* device, uint8_t* uid) {
     return rp2040_read_reg(device, RP2040_REG_UID0, uid, 8);
 }
 
+#if CONFIG_RP2040_ADC
 const float conversion_factor = 3.3f / (1 << 12);  // 12-bit ADC with 3.3v vref
 
 esp_err_t rp2040_read_vbat_raw(RP2040* device, uint16_t* value) {
@@ -269,6 +346,7 @@ esp_err_t rp2040_get_charging(RP2040* device, uint8_t* charging) {
     if ((device->_fw_version < 0x02) || (device->_fw_version == 0xFF)) return ESP_FAIL;
     return rp2040_read_reg(device, RP2040_REG_CHARGING_STATE, charging, 1);
 }
+#endif  // CONFIG_RP2040_ADC
 
 esp_err_t rp2040_get_usb(RP2040* device, uint8_t* usb) {
     if ((device->_fw_version < 0x01) || (device->_fw_version == 0xFF)) return ESP_FAIL;
@@ -291,6 +369,7 @@ esp_err_t rp2040_get_crash_state(RP2040* device, uint8_t* crash_debug) {
     return rp2040_read_reg(device, RP2040_REG_CRASH_DEBUG, crash_debug, 1);
 }
 
+#if CONFIG_RP2040_IR
 esp_err_t rp2040_ir_send(RP2040* device, uint16_t address, uint8_t command) {
     if ((device->_fw_version < 0x06) || (device->_fw_version == 0xFF)) return ESP_FAIL;
     uint8_t buffer[4];
@@ -300,6 +379,7 @@ esp_err_t rp2040_ir_send(RP2040* device, uint16_t address, uint8_t command) {
     buffer[3] = 0x01;            // Trigger
     return rp2040_write_reg(device, RP2040_REG_IR_ADDRESS_LO, buffer, sizeof(buffer));
 }
+#endif  // CONFIG_RP2040_IR
 
 esp_err_t rp2040_get_reset_attempted(RP2040* device, uint8_t* reset_attempted) {
     if ((device->_fw_version < 0x08) || (device->_fw_version == 0xFF)) return ESP_FAIL;
@@ -316,6 +396,7 @@ esp_err_t rp2040_set_reset_lock(RP2040* device, uint8_t lock) {
     return rp2040_write_reg(device, RP2040_REG_RESET_LOCK, &lock, 1);
 }
 
+#if CONFIG_RP2040_WS2812
 esp_err_t rp2040_set_ws2812_mode(RP2040* device, uint8_t mode) {
     if ((device->_fw_version < 0x09) || (device->_fw_version == 0xFF)) return ESP_FAIL;
     return rp2040_write_reg(device, RP2040_REG_WS2812_MODE, &mode, 1);
@@ -337,7 +418,9 @@ esp_err_t rp2040_ws2812_trigger(RP2040* device) {
     uint8_t value = 0;
     return rp2040_write_reg(device, RP2040_REG_WS2812_TRIGGER, (uint8_t*) &value, 1);
 }
+#endif  // CONFIG_RP2040_WS2812
 
+#if CONFIG_RP2040_MSC
 esp_err_t rp2040_set_msc_control(RP2040* device, uint8_t value) {
     if ((device->_fw_version < 0x0D) || (device->_fw_version == 0xFF)) return ESP_FAIL;
     return rp2040_write_reg(device, RP2040_REG_MSC_CONTROL, &value, 1);
@@ -359,3 +442,4 @@ esp_err_t rp2040_set_msc_block_size(RP2040* device, uint8_t lun, uint16_t value)
     if (lun > 1) return ESP_FAIL;
     return rp2040_write_reg(device, (lun == 1) ? RP2040_REG_MSC1_BLOCK_SIZE_LO : RP2040_REG_MSC0_BLOCK_SIZE_LO, (uint8_t*) &value, 2);
 }
+#endif  // CONFIG_RP2040_MSC
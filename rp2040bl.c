@@ -1,157 +1,644 @@
 #include "rp2040bl.h"
 
+#include <esp_check.h>
 #include <esp_log.h>
+#include <esp_timer.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/queue.h>
 #include <freertos/task.h>
+#include <inttypes.h>
+#include <stdlib.h>
 #include <sdkconfig.h>
 
 #include "driver/uart.h"
+#if !CONFIG_IDF_TARGET_LINUX
+#include "esp_rom_crc.h"
+#endif
 #include "rp2040.h"
+#include "rp2040source.h"
 #include "string.h"
 
-#define RP2040_BL_UART 0
+static const char* TAG = "RP2040 bootloader";
 
-void rp2040_bl_install_uart() {
-    if (uart_is_driver_installed(RP2040_BL_UART)) return;
-    fflush(stdout);
-    ESP_ERROR_CHECK(uart_driver_install(RP2040_BL_UART, 2048, 0, 0, NULL, 0));
+esp_err_t rp2040_bl_install_uart(rp2040_bl_t* bl) {
+    bool installed = uart_is_driver_installed(bl->uart);
+    if (installed && bl->_pending_count > 0) return ESP_ERR_INVALID_STATE;
+    // Until INFO has been read assume the geometry of the RP2040 flash
+    if (!installed || bl->_erase_size == 0 || bl->_write_size == 0) {
+        bl->_erase_size = RP2040_BL_DEFAULT_ERASE_SIZE;
+        bl->_write_size = RP2040_BL_DEFAULT_WRITE_SIZE;
+    }
+    if (!installed) {
+        bl->_pending_count = 0;
+#ifdef CONFIG_ESP_CONSOLE_UART_NUM
+        // Log output still queued for the console would be sent to the bootloader
+        if (bl->uart == CONFIG_ESP_CONSOLE_UART_NUM) fflush(stdout);
+#endif
+        QueueHandle_t* event_queue = bl->event_queue_size > 0 ? &bl->event_queue : NULL;
+        ESP_RETURN_ON_ERROR(uart_driver_install(bl->uart, bl->rx_buffer_size, bl->tx_buffer_size, bl->event_queue_size, event_queue, 0), TAG,
+                            "Failed to install UART driver");
+    }
     uart_config_t uart_config = {
-        .baud_rate  = 921600,
+        .baud_rate  = bl->baudrate,
         .data_bits  = UART_DATA_8_BITS,
         .parity     = UART_PARITY_DISABLE,
         .stop_bits  = UART_STOP_BITS_1,
         .flow_ctrl  = UART_HW_FLOWCTRL_DISABLE,
         .source_clk = UART_SCLK_DEFAULT,
     };
-    ESP_ERROR_CHECK(uart_param_config(RP2040_BL_UART, &uart_config));
+    esp_err_t res = uart_param_config(bl->uart, &uart_config);
+    if (res == ESP_OK) res = uart_set_pin(bl->uart, bl->pin_tx, bl->pin_rx, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE);
+    if (res != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to configure UART %d: %s", bl->uart, esp_err_to_name(res));
+        if (!installed) rp2040_bl_uninstall_uart(bl);
+    }
+    return res;
 }
 
-void rp2040_bl_uninstall_uart() {
-    if (!uart_is_driver_installed(RP2040_BL_UART)) return;
-    uart_driver_delete(RP2040_BL_UART);
+void rp2040_bl_uninstall_uart(rp2040_bl_t* bl) {
+    if (!uart_is_driver_installed(bl->uart)) return;
+    uart_driver_delete(bl->uart);
+    bl->event_queue = NULL;
 }
 
-void flush_stdin() {
-    if (!uart_is_driver_installed(RP2040_BL_UART)) return;
-    uint8_t data[256];
-    uart_read_bytes(RP2040_BL_UART, data, sizeof(data), 10 / portTICK_PERIOD_MS);
+// Discard stale bytes that are already buffered without waiting for more to arrive
+static void drain_input(rp2040_bl_t* bl) { uart_flush_input(bl->uart); }
+
+static void send_bytes(rp2040_bl_t* bl, rp2040_bl_phase_t phase, const void* data, uint32_t length) {
+    int64_t start = esp_timer_get_time();
+    uart_write_bytes(bl->uart, data, length);
+    bl->stats.phases[phase].send_us += esp_timer_get_time() - start;
 }
 
-bool read_stdin(uint8_t* buffer, uint32_t len, uint32_t timeout) {
-    if (!uart_is_driver_installed(RP2040_BL_UART)) return false;
-    int read = uart_read_bytes(RP2040_BL_UART, buffer, len, timeout / portTICK_PERIOD_MS);
-    return (read == len);
+static void send_command(rp2040_bl_t* bl, rp2040_bl_phase_t phase, const char* opcode, const uint32_t* args, uint8_t arg_count) {
+    uint8_t command[4 + 4 * 3];
+    memcpy(command, opcode, 4);
+    if (arg_count > 0) memcpy(command + 4, args, 4 * arg_count);
+    send_bytes(bl, phase, command, 4 + 4 * arg_count);
+    bl->stats.phases[phase].commands++;
 }
 
-bool rp2040_bl_sync() {
-    if (!uart_is_driver_installed(RP2040_BL_UART)) return false;
-    flush_stdin();
-    char command[] = "SYNC";
-    uart_write_bytes(RP2040_BL_UART, command, 4);
-    uint8_t rx_buffer[4 * 6];
-    read_stdin(rx_buffer, sizeof(rx_buffer), 1000);
-    if (memcmp(rx_buffer, "PICO", 4) != 0) return false;
+static bool read_bytes(rp2040_bl_t* bl, uint8_t* buffer, uint32_t len, int64_t deadline) {
+    while (len > 0) {
+        int64_t remaining = deadline - esp_timer_get_time();
+        if (remaining < 0) return false;
+        int read = uart_read_bytes(bl->uart, buffer, len, pdMS_TO_TICKS(remaining / 1000) + 1);
+        if (read <= 0) return false;
+        buffer += read;
+        len    -= read;
+    }
     return true;
 }
 
-bool rp2040_bl_get_info(uint32_t* flash_start, uint32_t* flash_size, uint32_t* erase_size, uint32_t* write_size, uint32_t* max_data_len) {
-    if (!uart_is_driver_installed(RP2040_BL_UART)) return false;
-    flush_stdin();
-    char command[] = "INFO";
-    uart_write_bytes(RP2040_BL_UART, command, 4);
-    uint8_t rx_buffer[4 * 6];
-    read_stdin(rx_buffer, sizeof(rx_buffer), 1000);
-    if (memcmp(rx_buffer, "OKOK", 4) != 0) return false;
-    memcpy((uint8_t*) flash_start, &rx_buffer[4 * 1], 4);
-    memcpy((uint8_t*) flash_size, &rx_buffer[4 * 2], 4);
-    memcpy((uint8_t*) erase_size, &rx_buffer[4 * 3], 4);
-    memcpy((uint8_t*) write_size, &rx_buffer[4 * 4], 4);
-    memcpy((uint8_t*) max_data_len, &rx_buffer[4 * 5], 4);
+static int64_t wire_time(rp2040_bl_t* bl, uint32_t bytes) { return (int64_t) bytes * 10 * 1000000 / bl->baudrate; }
+
+static uint32_t units(uint32_t length, uint32_t size) { return (length + size - 1) / size; }
+
+static int64_t timeout(rp2040_bl_t* bl, uint32_t tx_bytes, uint32_t rx_bytes, int64_t processing_us) {
+    int64_t time = wire_time(bl, tx_bytes + rx_bytes) + bl->timing.turnaround_us + processing_us;
+    return time + time * bl->timing.margin / 100;
+}
+
+// Split an erase the way the boot ROM does: aligned blocks with a single block erase, everything else sector by sector
+static void erase_units(rp2040_bl_t* bl, uint32_t address, uint32_t length, uint32_t* blocks, uint32_t* sectors) {
+    uint32_t block_size = bl->timing.block_size;
+    uint32_t end        = address + length;
+    *blocks             = 0;
+    *sectors            = 0;
+    while (address < end) {
+        if (block_size > bl->_erase_size && address % block_size == 0 && end - address >= block_size) {
+            (*blocks)++;
+            address += block_size;
+        } else {
+            (*sectors)++;
+            address += bl->_erase_size;
+        }
+    }
+}
+
+// Timeouts always allow the worst case: erase and program times of NOR flash vary several times over with wear and
+// temperature, so learned times are only used for estimates
+static int64_t erase_timeout(rp2040_bl_t* bl, uint32_t address, uint32_t length) {
+    uint32_t blocks, sectors;
+    erase_units(bl, address, length, &blocks, &sectors);
+    int64_t processing = (int64_t) blocks * bl->timing.block_erase_us + (int64_t) sectors * bl->timing.erase_us;
+    return timeout(bl, 12, 4, processing);
+}
+
+// Expected time of a sector or block erase. Until one of them has been measured it is scaled from the other.
+static uint32_t expected_erase_time(rp2040_bl_t* bl, bool block) {
+    const rp2040_bl_timing_t* timing      = &bl->timing;
+    uint32_t                  learned     = block ? timing->learned_block_erase_us : timing->learned_erase_us;
+    uint32_t                  worst       = block ? timing->block_erase_us : timing->erase_us;
+    uint32_t                  other       = block ? timing->learned_erase_us : timing->learned_block_erase_us;
+    uint32_t                  other_worst = block ? timing->erase_us : timing->block_erase_us;
+    if (!timing->learn) return worst;
+    if (learned != 0) return learned;
+    if (other != 0 && other_worst != 0) return (uint64_t) other * worst / other_worst;
+    return worst;
+}
+
+int64_t rp2040_bl_estimate_erase_time(rp2040_bl_t* bl, uint32_t address, uint32_t length) {
+    uint32_t blocks, sectors;
+    erase_units(bl, address, length, &blocks, &sectors);
+    return wire_time(bl, 12 + 4) + bl->timing.turnaround_us + (int64_t) blocks * expected_erase_time(bl, true) +
+           (int64_t) sectors * expected_erase_time(bl, false);
+}
+
+static int64_t write_timeout(rp2040_bl_t* bl, uint32_t length) {
+    int64_t processing = (int64_t) units(length, bl->_write_size) * bl->timing.write_us;
+    return timeout(bl, 12 + length, 8, processing + units(length, 1024) * bl->timing.crc_us);
+}
+
+// Peak-hold average: follows slower durations immediately and decays slowly towards faster ones
+static void learn(rp2040_bl_t* bl, uint32_t* learned, int64_t elapsed, uint32_t wire_bytes, uint32_t count) {
+    if (!bl->timing.learn || count == 0) return;
+    int64_t processing = elapsed - wire_time(bl, wire_bytes) - bl->timing.turnaround_us;
+    if (processing < 0) processing = 0;
+    uint32_t observed = processing / count;
+    if (observed == 0) observed = 1;  // 0 means nothing has been learned yet
+    *learned          = (observed > *learned) ? observed : *learned - (*learned - observed) / 8;
+}
+
+static void reset_parser(rp2040_bl_t* bl) {
+    bl->_header_len = 0;
+    bl->_received   = 0;
+}
+
+// Send a command and queue the reply it expects, with a 4 byte payload received into the word of the returned entry
+static rp2040_bl_pending_t* submit(rp2040_bl_t* bl, rp2040_bl_phase_t phase, const char* opcode, const uint32_t* args, uint8_t arg_count,
+                                   uint32_t length, int64_t timeout_us) {
+    if (!uart_is_driver_installed(bl->uart)) return NULL;
+    if (bl->_pending_count >= RP2040_BL_MAX_PENDING) return NULL;
+    int64_t now = esp_timer_get_time();
+    if (bl->_pending_count == 0) {
+        drain_input(bl);  // Must not discard the replies of commands that are still in flight
+        reset_parser(bl);
+        bl->_deadline = now + timeout_us;
+    }
+    rp2040_bl_pending_t* pending = &bl->_pending[(bl->_pending_head + bl->_pending_count++) % RP2040_BL_MAX_PENDING];
+    memcpy(pending->opcode, opcode, 4);
+    memcpy(pending->magic, memcmp(opcode, "SYNC", 4) == 0 ? "PICO" : "OKOK", 4);
+    pending->payload     = (uint8_t*) &pending->word;
+    pending->payload_len = sizeof(pending->word);
+    pending->length      = length;
+    pending->timeout_us  = timeout_us;
+    pending->sent        = bl->_pending_count == 1 ? now : 0;
+    pending->completed   = 0;
+    pending->phase       = phase;
+    send_command(bl, phase, opcode, args, arg_count);
+    return pending;
+}
+
+// Receive reply bytes of the oldest pending command until it is complete or the time until has passed. Header bytes
+// are collected in bl->_header and payload bytes are read straight into the payload buffer.
+static esp_err_t parse(rp2040_bl_t* bl, rp2040_bl_pending_t* pending, int64_t until) {
+    while (bl->_header_len < sizeof(bl->_header) || bl->_received < pending->payload_len) {
+        bool     header = bl->_header_len < sizeof(bl->_header);
+        uint8_t* target = header ? bl->_header + bl->_header_len : pending->payload + bl->_received;
+        uint32_t wanted = header ? sizeof(bl->_header) - bl->_header_len : pending->payload_len - bl->_received;
+
+        int64_t remaining = until - esp_timer_get_time();
+        int     read      = uart_read_bytes(bl->uart, target, wanted, remaining > 0 ? pdMS_TO_TICKS(remaining / 1000) + 1 : 0);
+        if (read <= 0) return ESP_ERR_NOT_FINISHED;
+        if (!header) {
+            bl->_received += read;
+            continue;
+        }
+        bl->_header_len += read;
+        if (bl->_header_len < sizeof(bl->_header) || memcmp(bl->_header, pending->magic, 4) == 0) continue;
+        if (memcmp(bl->_header, "ERR!", 4) == 0) return ESP_FAIL;
+        // Bytes preceding the magic are skipped, so the link resynchronises on the next reply instead of relying on idle time
+        memmove(bl->_header, bl->_header + 1, sizeof(bl->_header) - 1);
+        bl->_header_len = sizeof(bl->_header) - 1;
+    }
+    return ESP_OK;
+}
+
+esp_err_t rp2040_bl_poll(rp2040_bl_t* bl, int64_t wait_us) {
+    if (bl->_pending_count == 0 || !uart_is_driver_installed(bl->uart)) return ESP_ERR_INVALID_STATE;
+    rp2040_bl_pending_t* pending = &bl->_pending[bl->_pending_head];
+    int64_t              start   = esp_timer_get_time();
+    int64_t              until   = wait_us < bl->_deadline - start ? start + wait_us : bl->_deadline;
+    esp_err_t            res     = parse(bl, pending, until);
+    int64_t              now     = esp_timer_get_time();
+    if (res == ESP_ERR_NOT_FINISHED && now >= bl->_deadline) res = ESP_ERR_TIMEOUT;
+    if (res == ESP_OK && pending->completed == 0) pending->completed = now;
+    bl->stats.phases[pending->phase].wait_us += now - start;
+    if (res == ESP_FAIL || res == ESP_ERR_TIMEOUT) {
+        ESP_LOGD(TAG, "%.4s failed: %s", pending->opcode, esp_err_to_name(res));
+        bl->_pending_count = 0;  // Replies of any other commands in flight can no longer be matched up
+    }
+    return res;
+}
+
+uint8_t rp2040_bl_pending(const rp2040_bl_t* bl) { return bl->_pending_count; }
+
+// Wait for the reply of the oldest pending command, which must be opcode, and remove it from the queue
+static bool finish(rp2040_bl_t* bl, const char* opcode, rp2040_bl_pending_t* reply) {
+    if (bl->_pending_count == 0 || memcmp(bl->_pending[bl->_pending_head].opcode, opcode, 4) != 0) return false;
+    esp_err_t res;
+    do {
+        res = rp2040_bl_poll(bl, bl->_deadline - esp_timer_get_time());
+    } while (res == ESP_ERR_NOT_FINISHED);
+    if (res != ESP_OK) return false;
+
+    *reply            = bl->_pending[bl->_pending_head];
+    bl->_pending_head = (bl->_pending_head + 1) % RP2040_BL_MAX_PENDING;
+    bl->_pending_count--;
+    reset_parser(bl);
+    if (bl->_pending_count > 0) bl->_deadline = esp_timer_get_time() + bl->_pending[bl->_pending_head].timeout_us;
+    bl->stats.phases[reply->phase].bytes += reply->length;
     return true;
 }
 
-bool rp2040_bl_erase(uint32_t address, uint32_t length) {
-    if (!uart_is_driver_installed(RP2040_BL_UART)) return false;
-    flush_stdin();
-    char command[12];
-    snprintf(command, 5, "ERAS");
-    memcpy(command + 4, (char*) &address, 4);
-    memcpy(command + 8, (char*) &length, 4);
-    uart_write_bytes(RP2040_BL_UART, command, sizeof(command));
-    uint8_t rx_buffer[4];
-    read_stdin(rx_buffer, sizeof(rx_buffer), 10000);
-    if (memcmp(rx_buffer, "OKOK", 4) != 0) return false;
+static bool sync_once(rp2040_bl_t* bl, int64_t timeout_us) {
+    rp2040_bl_pending_t  reply;
+    rp2040_bl_pending_t* pending = submit(bl, RP2040_BL_PHASE_SYNC, "SYNC", NULL, 0, 0, timeout_us);
+    if (pending == NULL) return false;
+    pending->payload_len = 0;
+    return finish(bl, "SYNC", &reply);
+}
+
+bool rp2040_bl_sync(rp2040_bl_t* bl) { return sync_once(bl, timeout(bl, 4, 4, 0)); }
+
+bool rp2040_bl_sync_wait(rp2040_bl_t* bl, int64_t timeout_us, int64_t* sync_time_us) {
+    if (!uart_is_driver_installed(bl->uart) || bl->_pending_count > 0) return false;
+    int64_t start    = esp_timer_get_time();
+    int64_t deadline = start + timeout_us;
+    int64_t interval = timeout(bl, 4, 4, 0);
+    uint8_t matched  = 0;  // Bytes of "PICO" received so far, kept across attempts
+    drain_input(bl);
+    while (true) {
+        send_command(bl, RP2040_BL_PHASE_SYNC, "SYNC", NULL, 0);
+        int64_t attempt_start    = esp_timer_get_time();
+        int64_t attempt_deadline = attempt_start + interval;
+        if (attempt_deadline > deadline) attempt_deadline = deadline;
+        uint8_t byte;
+        while (matched < 4 && read_bytes(bl, &byte, 1, attempt_deadline)) {
+            // No prefix of "PICO" reappears inside it, so a mismatch can only restart the match
+            matched = (byte == "PICO"[matched]) ? matched + 1 : (byte == 'P');
+        }
+        int64_t now = esp_timer_get_time();
+        bl->stats.phases[RP2040_BL_PHASE_SYNC].wait_us += now - attempt_start;
+        if (matched == 4) {
+            if (sync_time_us != NULL) *sync_time_us = now - start;
+            return true;
+        }
+        if (now >= deadline) return false;
+        interval *= 2;
+        if (interval > RP2040_BL_SYNC_MAX_INTERVAL_US) interval = RP2040_BL_SYNC_MAX_INTERVAL_US;
+    }
+}
+
+bool rp2040_bl_get_info(rp2040_bl_t* bl, uint32_t* flash_start, uint32_t* flash_size, uint32_t* erase_size, uint32_t* write_size, uint32_t* max_data_len) {
+    uint8_t              rx_buffer[4 * 5];
+    rp2040_bl_pending_t  reply;
+    rp2040_bl_pending_t* pending = submit(bl, RP2040_BL_PHASE_SYNC, "INFO", NULL, 0, 0, timeout(bl, 4, 4 + sizeof(rx_buffer), 0));
+    if (pending == NULL) return false;
+    pending->payload     = rx_buffer;
+    pending->payload_len = sizeof(rx_buffer);
+    if (!finish(bl, "INFO", &reply)) return false;
+    memcpy((uint8_t*) flash_start, &rx_buffer[4 * 0], 4);
+    memcpy((uint8_t*) flash_size, &rx_buffer[4 * 1], 4);
+    memcpy((uint8_t*) erase_size, &rx_buffer[4 * 2], 4);
+    memcpy((uint8_t*) write_size, &rx_buffer[4 * 3], 4);
+    memcpy((uint8_t*) max_data_len, &rx_buffer[4 * 4], 4);
+    if (*erase_size > 0) bl->_erase_size = *erase_size;
+    if (*write_size > 0) bl->_write_size = *write_size;
     return true;
 }
 
-bool rp2040_bl_crc(uint32_t address, uint32_t length, uint32_t* crc) {
-    if (!uart_is_driver_installed(RP2040_BL_UART)) return false;
-    flush_stdin();
-    char command[12];
-    snprintf(command, 5, "CRCC");
-    memcpy(command + 4, (char*) &address, 4);
-    memcpy(command + 8, (char*) &length, 4);
-    uart_write_bytes(RP2040_BL_UART, command, sizeof(command));
-    uint8_t rx_buffer[8];
-    read_stdin(rx_buffer, sizeof(rx_buffer), 10000);
-    if (memcmp(rx_buffer, "OKOK", 4) != 0) return false;
-    memcpy((uint8_t*) crc, &rx_buffer[4 * 1], 4);
+bool rp2040_bl_erase_start(rp2040_bl_t* bl, uint32_t address, uint32_t length) {
+    uint32_t             args[]  = {address, length};
+    rp2040_bl_pending_t* pending = submit(bl, RP2040_BL_PHASE_ERASE, "ERAS", args, 2, length, erase_timeout(bl, address, length));
+    if (pending == NULL) return false;
+    pending->payload_len = 0;
+    pending->address     = address;
     return true;
 }
 
-bool rp2040_bl_read(uint32_t address, uint32_t length, uint8_t* data) {
-    if (!uart_is_driver_installed(RP2040_BL_UART)) return false;
-    flush_stdin();
-    char command[12];
-    snprintf(command, 5, "READ");
-    memcpy(command + 4, (char*) &address, 4);
-    memcpy(command + 8, (char*) &length, 4);
-    uart_write_bytes(RP2040_BL_UART, command, sizeof (command));
-    uint8_t rx_buffer[4];
-    read_stdin(rx_buffer, sizeof(rx_buffer), 10000);
-    read_stdin(data, length, 10000);
-    if (memcmp(rx_buffer, "OKOK", 4) != 0) return false;
+bool rp2040_bl_erase_finish(rp2040_bl_t* bl) {
+    rp2040_bl_pending_t reply;
+    if (!finish(bl, "ERAS", &reply)) return false;
+    if (reply.sent == 0) return true;
+    uint32_t blocks, sectors;
+    erase_units(bl, reply.address, reply.length, &blocks, &sectors);
+    int64_t elapsed = reply.completed - reply.sent;
+    if (blocks == 0) {
+        learn(bl, &bl->timing.learned_erase_us, elapsed, 12 + 4, sectors);
+    } else {
+        // The sectors around the blocks are accounted at their expected time, the rest is learned as block time
+        learn(bl, &bl->timing.learned_block_erase_us, elapsed - (int64_t) sectors * expected_erase_time(bl, false), 12 + 4, blocks);
+    }
     return true;
 }
 
-bool rp2040_bl_write(uint32_t address, uint32_t length, uint8_t* data, uint32_t* crc) {
-    if (!uart_is_driver_installed(RP2040_BL_UART)) return false;
-    flush_stdin();
-    char command[12];
-    snprintf(command, 5, "WRIT");
-    memcpy(command + 4, (char*) &address, 4);
-    memcpy(command + 8, (char*) &length, 4);
-    uart_write_bytes(RP2040_BL_UART, command, sizeof(command));
-    uart_write_bytes(RP2040_BL_UART, data, length);
-    uint8_t rx_buffer[8];
-    read_stdin(rx_buffer, sizeof(rx_buffer), 10000);
-    if (memcmp(rx_buffer, "OKOK", 4) != 0) return false;
-    memcpy((uint8_t*) crc, &rx_buffer[4 * 1], 4);
+bool rp2040_bl_erase(rp2040_bl_t* bl, uint32_t address, uint32_t length) {
+    if (!rp2040_bl_erase_start(bl, address, length)) return false;
+    return rp2040_bl_erase_finish(bl);
+}
+
+bool rp2040_bl_crc(rp2040_bl_t* bl, uint32_t address, uint32_t length, uint32_t* crc) {
+    uint32_t             args[]     = {address, length};
+    int64_t              timeout_us = timeout(bl, 12, 8, (int64_t) units(length, 1024) * bl->timing.crc_us);
+    rp2040_bl_pending_t  reply;
+    rp2040_bl_pending_t* pending = submit(bl, RP2040_BL_PHASE_VERIFY, "CRCC", args, 2, length, timeout_us);
+    if (pending == NULL) return false;
+    pending->payload = (uint8_t*) crc;
+    return finish(bl, "CRCC", &reply);
+}
+
+bool rp2040_bl_read_start(rp2040_bl_t* bl, uint32_t address, uint32_t length, uint8_t* data) {
+    uint32_t             args[]     = {address, length};
+    int64_t              timeout_us = timeout(bl, 12, 4 + length, (int64_t) units(length, 1024) * bl->timing.crc_us);
+    rp2040_bl_pending_t* pending    = submit(bl, RP2040_BL_PHASE_VERIFY, "READ", args, 2, length, timeout_us);
+    if (pending == NULL) return false;
+    pending->payload     = data;
+    pending->payload_len = length;
     return true;
 }
 
-bool rp2040_bl_seal(uint32_t vtor, uint32_t length, uint32_t crc) {
-    if (!uart_is_driver_installed(RP2040_BL_UART)) return false;
-    flush_stdin();
-    char command[16];
-    snprintf(command, 5, "SEAL");
-    memcpy(command + 4, (char*) &vtor, 4);
-    memcpy(command + 8, (char*) &length, 4);
-    memcpy(command + 12, (char*) &crc, 4);
-    uart_write_bytes(RP2040_BL_UART, command, sizeof(command));
-    uint8_t rx_buffer[4];
-    read_stdin(rx_buffer, sizeof(rx_buffer), 10000);
-    if (memcmp(rx_buffer, "OKOK", 4) != 0) return false;
+bool rp2040_bl_read_finish(rp2040_bl_t* bl) {
+    rp2040_bl_pending_t reply;
+    return finish(bl, "READ", &reply);
+}
+
+bool rp2040_bl_read(rp2040_bl_t* bl, uint32_t address, uint32_t length, uint8_t* data) {
+    if (!rp2040_bl_read_start(bl, address, length, data)) return false;
+    return rp2040_bl_read_finish(bl);
+}
+
+bool rp2040_bl_write_start(rp2040_bl_t* bl, uint32_t address, uint32_t length, const uint8_t* data) {
+    uint32_t             args[]  = {address, length};
+    rp2040_bl_pending_t* pending = submit(bl, RP2040_BL_PHASE_WRITE, "WRIT", args, 2, length, write_timeout(bl, length));
+    if (pending == NULL) return false;
+    send_bytes(bl, RP2040_BL_PHASE_WRITE, data, length);
+    // Calculated while the command is being transmitted, to verify the CRC in the reply
+    pending->crc = rp2040_bl_crc32(0, data, length);
     return true;
 }
 
-bool rp2040_bl_go(uint32_t vtor) {
-    if (!uart_is_driver_installed(RP2040_BL_UART)) return false;
-    flush_stdin();
-    char command[8];
-    snprintf(command, 5, "GOGO");
-    memcpy(command + 4, (char*) &vtor, 4);
-    uart_write_bytes(RP2040_BL_UART, command, sizeof(command));
+bool rp2040_bl_write_finish(rp2040_bl_t* bl, uint32_t* crc) {
+    rp2040_bl_pending_t reply;
+    if (!finish(bl, "WRIT", &reply)) return false;
+    *crc = reply.word;
+    if (*crc != reply.crc) {
+        ESP_LOGE(TAG, "CRC mismatch in written data (0x%08" PRIx32 " instead of 0x%08" PRIx32 ")", *crc, reply.crc);
+        bl->_pending_count = 0;
+        return false;
+    }
+    // Only a write that was sent while nothing else was in flight has a meaningful duration
+    if (reply.sent != 0) learn(bl, &bl->timing.learned_write_us, reply.completed - reply.sent, 12 + reply.length + 8, units(reply.length, bl->_write_size));
     return true;
 }
+
+bool rp2040_bl_write(rp2040_bl_t* bl, uint32_t address, uint32_t length, const uint8_t* data, uint32_t* crc) {
+    if (!rp2040_bl_write_start(bl, address, length, data)) return false;
+    return rp2040_bl_write_finish(bl, crc);
+}
+
+bool rp2040_bl_seal(rp2040_bl_t* bl, uint32_t vtor, uint32_t length, uint32_t crc) {
+    uint32_t args[] = {vtor, length, crc};
+    // Sealing checks the CRC of the image and then stores it in a sector of its own
+    int64_t              processing = (int64_t) units(length, 1024) * bl->timing.crc_us + bl->timing.erase_us + bl->timing.write_us;
+    rp2040_bl_pending_t  reply;
+    rp2040_bl_pending_t* pending = submit(bl, RP2040_BL_PHASE_SEAL, "SEAL", args, 3, length, timeout(bl, 16, 4, processing));
+    if (pending == NULL) return false;
+    pending->payload_len = 0;
+    return finish(bl, "SEAL", &reply);
+}
+
+bool rp2040_bl_go(rp2040_bl_t* bl, uint32_t vtor) {
+    if (!uart_is_driver_installed(bl->uart) || bl->_pending_count > 0) return false;
+    drain_input(bl);
+    send_command(bl, RP2040_BL_PHASE_SEAL, "GOGO", &vtor, 1);
+    return true;
+}
+
+bool rp2040_bl_dump(rp2040_bl_t* bl, uint32_t address, uint32_t length, rp2040_sink_t* sink, rp2040_bl_dump_stats_t* stats) {
+    if (!uart_is_driver_installed(bl->uart)) return false;
+    // The bootloader only calculates CRCs over whole words, a batch with a partial word at its end could not be verified
+    if (address % 4 != 0 || length % 4 != 0) {
+        ESP_LOGE(TAG, "Dump range 0x%08" PRIx32 ", %" PRIu32 " bytes is not word aligned", address, length);
+        return false;
+    }
+    uint32_t flash_start, flash_size, erase_size, write_size, max_data_len;
+    if (!rp2040_bl_get_info(bl, &flash_start, &flash_size, &erase_size, &write_size, &max_data_len)) return false;
+
+    // The next chunk streams into the UART RX buffer while the current one is handed to the sink. Replies are
+    // received straight into the buffer passed to rp2040_bl_read_start, so the chunks alternate between two buffers.
+    uint32_t chunk_size = max_data_len;
+    if (chunk_size > bl->rx_buffer_size / 2) chunk_size = bl->rx_buffer_size / 2;
+    uint8_t* buffers = malloc(2 * chunk_size);
+    if (buffers == NULL) return false;
+
+    rp2040_bl_dump_stats_t dump_stats = {.chunk_size = chunk_size};
+    int64_t                start      = esp_timer_get_time();
+    uint32_t               offset     = 0;
+    uint8_t                retries    = 0;
+    bool                   success    = true;
+    while (success && offset < length) {
+        uint32_t batch     = length - offset < RP2040_BL_DUMP_BATCH_SIZE ? length - offset : RP2040_BL_DUMP_BATCH_SIZE;
+        uint32_t local_crc = 0;
+        uint32_t position  = 0;
+        uint8_t  index     = 0;
+        success            = rp2040_bl_read_start(bl, address + offset, batch < chunk_size ? batch : chunk_size, buffers);
+        while (success && position < batch) {
+            uint8_t* buffer = buffers + index * chunk_size;
+            uint32_t size   = batch - position < chunk_size ? batch - position : chunk_size;
+            if (!rp2040_bl_read_finish(bl)) {
+                success = false;
+                break;
+            }
+            uint32_t next = position + size;
+            index         = !index;
+            if (next < batch) {
+                uint32_t next_size = batch - next < chunk_size ? batch - next : chunk_size;
+                success            = rp2040_bl_read_start(bl, address + offset + next, next_size, buffers + index * chunk_size);
+            }
+            local_crc = rp2040_bl_crc32(local_crc, buffer, size);
+            if (!sink->write(sink, offset + position, buffer, size)) {
+                ESP_LOGE(TAG, "Failed to write dump at offset %" PRIu32, offset + position);
+                success = false;
+                break;
+            }
+            position = next;
+        }
+
+        uint32_t remote_crc;
+        if (!success || !rp2040_bl_crc(bl, address + offset, batch, &remote_crc)) {
+            success = false;
+        } else if (remote_crc != local_crc) {
+            ESP_LOGW(TAG, "CRC mismatch in dump at 0x%08" PRIx32 ", reading it again", address + offset);
+            dump_stats.crc_retries++;
+            success = ++retries <= 3;
+        } else {
+            offset  += batch;
+            retries  = 0;
+        }
+    }
+    free(buffers);
+    if (!success) bl->_pending_count = 0;  // A read may still be in flight after a failed sink write
+
+    dump_stats.bytes       = offset;
+    dump_stats.duration_us = esp_timer_get_time() - start;
+    if (dump_stats.duration_us > 0) dump_stats.bytes_per_second = (uint32_t) ((uint64_t) offset * 1000000 / dump_stats.duration_us);
+    ESP_LOGI(TAG, "Dumped %" PRIu32 " bytes in %" PRId64 " ms (%" PRIu32 " bytes/s)", dump_stats.bytes, dump_stats.duration_us / 1000,
+             dump_stats.bytes_per_second);
+    if (stats != NULL) *stats = dump_stats;
+    return success;
+}
+
+// The bootloader calculates the CRC with the DMA sniffer in bit reversed mode with the result reversed and inverted,
+// which is the CRC-32 of IEEE 802.3 and zlib. Its polynomial is used bit reversed, x^0 is the most significant bit.
+#define CRC32_POLYNOMIAL 0xEDB88320
+
+#if CONFIG_IDF_TARGET_LINUX
+static uint32_t crc32_table[4][256];
+
+static void crc32_init_table() {
+    for (uint32_t index = 0; index < 256; index++) {
+        uint32_t crc = index;
+        for (uint8_t bit = 0; bit < 8; bit++) crc = (crc & 0x01) ? (crc >> 1) ^ CRC32_POLYNOMIAL : crc >> 1;
+        crc32_table[0][index] = crc;
+    }
+    for (uint32_t index = 0; index < 256; index++) {
+        for (uint8_t slice = 1; slice < 4; slice++) {
+            uint32_t previous         = crc32_table[slice - 1][index];
+            crc32_table[slice][index] = (previous >> 8) ^ crc32_table[0][previous & 0xFF];
+        }
+    }
+}
+
+// Slice-by-4, processes a 32-bit word per iteration
+uint32_t rp2040_bl_crc32(uint32_t crc, const uint8_t* data, uint32_t length) {
+    if (crc32_table[0][1] == 0) crc32_init_table();
+    crc = ~crc;
+    while (length >= 4) {
+        crc ^= data[0] | ((uint32_t) data[1] << 8) | ((uint32_t) data[2] << 16) | ((uint32_t) data[3] << 24);
+        crc  = crc32_table[3][crc & 0xFF] ^ crc32_table[2][(crc >> 8) & 0xFF] ^ crc32_table[1][(crc >> 16) & 0xFF] ^ crc32_table[0][crc >> 24];
+        data   += 4;
+        length -= 4;
+    }
+    while (length--) crc = (crc >> 8) ^ crc32_table[0][(crc ^ *data++) & 0xFF];
+    return ~crc;
+}
+#else
+// The ROM implementation inverts the CRC on the way in and out, like the crc32 function of zlib
+uint32_t rp2040_bl_crc32(uint32_t crc, const uint8_t* data, uint32_t length) { return esp_rom_crc32_le(crc, data, length); }
+#endif
+
+// Multiplication of two polynomials modulo the CRC polynomial
+static uint32_t crc32_multiply(uint32_t a, uint32_t b) {
+    uint32_t product = 0;
+    for (uint32_t bit = 0x80000000; bit != 0; bit >>= 1) {
+        if (a & bit) product ^= b;
+        b = (b & 0x01) ? (b >> 1) ^ CRC32_POLYNOMIAL : b >> 1;
+    }
+    return product;
+}
+
+uint32_t rp2040_bl_crc32_combine(uint32_t crc_a, uint32_t crc_b, uint32_t length_b) {
+    // Appending length_b bytes multiplies the CRC of the first block by x^(8 * length_b), the inversions cancel out
+    uint32_t shift = 0x80000000;  // x^0
+    uint32_t power = 0x00800000;  // x^8
+    for (; length_b > 0; length_b >>= 1) {
+        if (length_b & 0x01) shift = crc32_multiply(shift, power);
+        power = crc32_multiply(power, power);
+    }
+    return crc32_multiply(shift, crc_a) ^ crc_b;
+}
+
+bool rp2040_bl_set_baudrate(rp2040_bl_t* bl, uint32_t baudrate) {
+    if (bl->_pending_count > 0) return false;
+    if (uart_is_driver_installed(bl->uart)) {
+        uart_wait_tx_done(bl->uart, pdMS_TO_TICKS(100));
+        if (uart_set_baudrate(bl->uart, baudrate) != ESP_OK) return false;
+        drain_input(bl);
+    }
+    bl->baudrate = baudrate;
+    return true;
+}
+
+uint32_t rp2040_bl_get_baudrate(rp2040_bl_t* bl) { return bl->baudrate; }
+
+const char* rp2040_bl_phase_to_name(rp2040_bl_phase_t phase) {
+    switch (phase) {
+        case RP2040_BL_PHASE_SYNC: return "sync";
+        case RP2040_BL_PHASE_ERASE: return "erase";
+        case RP2040_BL_PHASE_WRITE: return "write";
+        case RP2040_BL_PHASE_VERIFY: return "verify";
+        case RP2040_BL_PHASE_SEAL: return "seal";
+        case RP2040_BL_PHASE_COUNT: break;
+    }
+    return "unknown";
+}
+
+uint32_t rp2040_bl_phase_bytes_per_second(const rp2040_bl_phase_stats_t* phase) {
+    int64_t duration = phase->send_us + phase->wait_us;
+    if (duration <= 0) return 0;
+    return (uint32_t) ((uint64_t) phase->bytes * 1000000 / duration);
+}
+
+void rp2040_bl_log_stats(const rp2040_bl_t* bl) {
+    for (rp2040_bl_phase_t phase = 0; phase < RP2040_BL_PHASE_COUNT; phase++) {
+        const rp2040_bl_phase_stats_t* stats = &bl->stats.phases[phase];
+        if (stats->commands == 0) continue;
+        ESP_LOGI(TAG, "%-6s %5" PRIu32 " commands %8" PRIu32 " bytes, send %5" PRId64 " ms, wait %5" PRId64 " ms, %7" PRIu32 " bytes/s",
+                 rp2040_bl_phase_to_name(phase), stats->commands, stats->bytes, stats->send_us / 1000, stats->wait_us / 1000,
+                 rp2040_bl_phase_bytes_per_second(stats));
+    }
+}
+
+int64_t rp2040_bl_estimate_transfer_time(uint32_t length, uint32_t chunk_size, uint32_t baudrate) {
+    uint32_t chunks = (length + chunk_size - 1) / chunk_size;
+    uint64_t bytes  = length + (uint64_t) chunks * (12 + 8);  // Command header and reply of every write
+    return bytes * 10 * 1000000 / baudrate;                  // 8N1 framing
+}
+
+// A rate is reliable when the bootloader answers SYNC and a READ matches the CRC calculated by the bootloader. Sets
+// chunk_size to the largest chunk an update sends, which never crosses an erase sector.
+static bool probe_link(rp2040_bl_t* bl, uint32_t* chunk_size) {
+    bool synced = false;
+    for (uint8_t attempt = 0; attempt < 3 && !synced; attempt++) synced = sync_once(bl, 20000);
+    if (!synced) return false;
+
+    uint32_t flash_start, flash_size, erase_size, write_size, max_data_len;
+    if (!rp2040_bl_get_info(bl, &flash_start, &flash_size, &erase_size, &write_size, &max_data_len)) return false;
+    *chunk_size = max_data_len < erase_size ? max_data_len : erase_size;
+
+    uint8_t  data[256];
+    uint32_t crc;
+    if (!rp2040_bl_read(bl, flash_start, sizeof(data), data)) return false;
+    if (!rp2040_bl_crc(bl, flash_start, sizeof(data), &crc)) return false;
+    return crc == rp2040_bl_crc32(0, data, sizeof(data));
+}
+
+uint32_t rp2040_bl_detect_baudrate(rp2040_bl_t* bl, const uint32_t* baudrates, size_t count, uint32_t image_length) {
+    uint32_t known = rp2040_bl_get_baudrate(bl), best = 0, chunk_size;
+    for (size_t index = 0; index < count; index++) {
+        if (baudrates[index] <= best || !rp2040_bl_set_baudrate(bl, baudrates[index])) continue;
+        if (!probe_link(bl, &chunk_size)) {
+            ESP_LOGI(TAG, "%" PRIu32 " baud: unreliable", baudrates[index]);
+            // The bootloader received the probe as garbage, which may have left it halfway a command. Its replies are
+            // skipped and it is synced again at the rate that is known to work, before the next rate is tried.
+            rp2040_bl_set_baudrate(bl, best != 0 ? best : known);
+            rp2040_bl_sync_wait(bl, RP2040_BL_RESYNC_TIMEOUT_US, NULL);
+            continue;
+        }
+        best = baudrates[index];
+        known = best;
+        if (image_length > 0) {
+            ESP_LOGI(TAG, "%" PRIu32 " baud: reliable, %" PRIu32 " byte image transfers in %" PRId64 " ms", best, image_length,
+                     rp2040_bl_estimate_transfer_time(image_length, chunk_size, best) / 1000);
+        } else {
+            ESP_LOGI(TAG, "%" PRIu32 " baud: reliable", best);
+        }
+    }
+
+    if (best == 0) best = RP2040_BL_BAUDRATE;
+    rp2040_bl_set_baudrate(bl, best);
+    if (!rp2040_bl_sync_wait(bl, RP2040_BL_RESYNC_TIMEOUT_US, NULL)) ESP_LOGW(TAG, "No response from bootloader at %" PRIu32 " baud", best);
+    return best;
+}
@@ -0,0 +1,299 @@
+/**
+ * Copyright (c) 2024 Orange-Murker
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "rp2040image.h"
+
+#include <esp_log.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char* TAG = "RP2040 image";
+
+#define UF2_BLOCK_SIZE          512
+#define UF2_DATA_OFFSET         32
+#define UF2_MAX_PAYLOAD         476
+#define UF2_MAGIC_START0        0x0A324655  // "UF2\n"
+#define UF2_MAGIC_START1        0x9E5D5157
+#define UF2_MAGIC_END           0x0AB16F30
+#define UF2_FLAG_NOT_MAIN_FLASH 0x00000001
+#define UF2_FLAG_FAMILY_ID      0x00002000
+
+#define ELF_HEADER_SIZE  52
+#define ELF_PHDR_SIZE    32
+#define ELF_CLASS_32     1
+#define ELF_DATA_LSB     1
+#define ELF_MACHINE_ARM  40
+#define ELF_PT_LOAD      1
+
+static uint32_t get_u32(const uint8_t* data) {
+    uint32_t value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+static uint16_t get_u16(const uint8_t* data) {
+    uint16_t value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+static bool in_flash(uint32_t address, uint32_t length) {
+    return address >= RP2040_IMAGE_FLASH_BASE && length <= RP2040_IMAGE_FLASH_SIZE && address - RP2040_IMAGE_FLASH_BASE <= RP2040_IMAGE_FLASH_SIZE - length;
+}
+
+// Extends segment with next when next continues it both in flash and in the file
+static bool extend_segment(rp2040_image_segment_t* segment, const rp2040_image_segment_t* next) {
+    if (segment->address + segment->length != next->address) return false;
+    bool contiguous = segment->stride == segment->block_size || segment->length <= segment->block_size;
+    if (contiguous && next->stride == next->block_size && segment->source_offset + segment->length == next->source_offset) {
+        segment->length     += next->length;
+        segment->block_size  = segment->length;
+        segment->stride      = segment->length;
+        return true;
+    }
+    // A shorter block can only be the last one
+    bool same_blocks = next->block_size == segment->block_size || (next->length == next->block_size && next->length < segment->block_size);
+    if (segment->length % segment->block_size == 0 && same_blocks && next->stride == segment->stride &&
+        next->source_offset == segment->source_offset + segment->length / segment->block_size * segment->stride) {
+        segment->length += next->length;
+        return true;
+    }
+    return false;
+}
+
+static esp_err_t add_segment(rp2040_image_t* image, const rp2040_image_segment_t* segment) {
+    if (image->segment_count > 0 && extend_segment(&image->segments[image->segment_count - 1], segment)) return ESP_OK;
+    if (image->segment_count == image->_capacity) {
+        size_t                  capacity = image->_capacity > 0 ? image->_capacity * 2 : 8;
+        rp2040_image_segment_t* segments = realloc(image->segments, capacity * sizeof(rp2040_image_segment_t));
+        if (segments == NULL) return ESP_ERR_NO_MEM;
+        image->segments  = segments;
+        image->_capacity = capacity;
+    }
+    image->segments[image->segment_count++] = *segment;
+    return ESP_OK;
+}
+
+static int compare_segments(const void* a, const void* b) {
+    uint32_t address_a = ((const rp2040_image_segment_t*) a)->address;
+    uint32_t address_b = ((const rp2040_image_segment_t*) b)->address;
+    return (address_a > address_b) - (address_a < address_b);
+}
+
+// Sorts the segments and coalesces the ones that were not stored in address order
+static esp_err_t finish_image(rp2040_image_t* image) {
+    if (image->segment_count == 0) {
+        ESP_LOGE(TAG, "Image contains no flash data");
+        return ESP_ERR_INVALID_SIZE;
+    }
+    qsort(image->segments, image->segment_count, sizeof(rp2040_image_segment_t), compare_segments);
+    size_t count = 1;
+    for (size_t index = 1; index < image->segment_count; index++) {
+        rp2040_image_segment_t* last    = &image->segments[count - 1];
+        rp2040_image_segment_t* segment = &image->segments[index];
+        if (segment->address < last->address + last->length) {
+            ESP_LOGE(TAG, "Overlapping data at 0x%08" PRIx32, segment->address);
+            return ESP_ERR_INVALID_ARG;
+        }
+        if (!extend_segment(last, segment)) image->segments[count++] = *segment;
+    }
+    image->segment_count = count;
+
+    image->start           = image->segments[0].address;
+    image->end             = image->segments[count - 1].address + image->segments[count - 1].length;
+    image->populated_bytes = 0;
+    for (size_t index = 0; index < count; index++) image->populated_bytes += image->segments[index].length;
+    ESP_LOGI(TAG, "%zu ranges from 0x%08" PRIx32 " to 0x%08" PRIx32 ", %" PRIu32 " of %" PRIu32 " bytes populated", count, image->start, image->end,
+             image->populated_bytes, image->end - image->start);
+    return ESP_OK;
+}
+
+esp_err_t rp2040_image_load_uf2(rp2040_image_t* image, rp2040_source_t* file) {
+    memset(image, 0, sizeof(rp2040_image_t));
+    if (file->sequential || file->length == 0 || file->length % UF2_BLOCK_SIZE != 0) {
+        ESP_LOGE(TAG, "UF2 files must be a multiple of %u bytes and allow random access", UF2_BLOCK_SIZE);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    esp_err_t res = ESP_OK;
+    for (uint32_t offset = 0; offset < file->length && res == ESP_OK; offset += UF2_BLOCK_SIZE) {
+        uint8_t        header_buffer[UF2_DATA_OFFSET];
+        uint8_t        end_buffer[4];
+        const uint8_t* header = file->fetch(file, offset, header_buffer, sizeof(header_buffer));
+        const uint8_t* end    = header != NULL ? file->fetch(file, offset + UF2_BLOCK_SIZE - sizeof(end_buffer), end_buffer, sizeof(end_buffer)) : NULL;
+        if (end == NULL) {
+            res = ESP_FAIL;
+            break;
+        }
+        if (get_u32(header) != UF2_MAGIC_START0 || get_u32(header + 4) != UF2_MAGIC_START1 || get_u32(end) != UF2_MAGIC_END ||
+            get_u32(header + 16) > UF2_MAX_PAYLOAD) {
+            ESP_LOGE(TAG, "Invalid UF2 block at offset %" PRIu32, offset);
+            res = ESP_ERR_INVALID_ARG;
+            break;
+        }
+
+        uint32_t flags   = get_u32(header + 8);
+        uint32_t address = get_u32(header + 12);
+        uint32_t length  = get_u32(header + 16);
+        if (flags & UF2_FLAG_NOT_MAIN_FLASH || length == 0) continue;
+        if (flags & UF2_FLAG_FAMILY_ID && get_u32(header + 28) != RP2040_IMAGE_UF2_FAMILY_ID) continue;
+        if (!in_flash(address, length)) continue;
+        rp2040_image_segment_t segment = {
+            .address       = address,
+            .length        = length,
+            .source_offset = offset + UF2_DATA_OFFSET,
+            .block_size    = length,
+            .stride        = UF2_BLOCK_SIZE,
+        };
+        res = add_segment(image, &segment);
+    }
+
+    if (res == ESP_OK) res = finish_image(image);
+    if (res != ESP_OK) rp2040_image_free(image);
+    return res;
+}
+
+esp_err_t rp2040_image_load_elf(rp2040_image_t* image, rp2040_source_t* file) {
+    memset(image, 0, sizeof(rp2040_image_t));
+    uint8_t        header_buffer[ELF_HEADER_SIZE];
+    const uint8_t* header = !file->sequential && file->length >= sizeof(header_buffer) ? file->fetch(file, 0, header_buffer, sizeof(header_buffer)) : NULL;
+    if (header == NULL || memcmp(header, "\x7F" "ELF", 4) != 0 || header[4] != ELF_CLASS_32 || header[5] != ELF_DATA_LSB ||
+        get_u16(header + 18) != ELF_MACHINE_ARM) {
+        ESP_LOGE(TAG, "Not a 32-bit little endian ARM ELF file");
+        return ESP_ERR_INVALID_ARG;
+    }
+    uint32_t phoff     = get_u32(header + 28);
+    uint16_t phentsize = get_u16(header + 42);
+    uint16_t phnum     = get_u16(header + 44);
+    if (phentsize < ELF_PHDR_SIZE) return ESP_ERR_INVALID_ARG;
+
+    esp_err_t res = ESP_OK;
+    for (uint16_t index = 0; index < phnum && res == ESP_OK; index++) {
+        uint32_t       offset = phoff + index * phentsize;
+        uint8_t        phdr_buffer[ELF_PHDR_SIZE];
+        const uint8_t* phdr = offset <= file->length - sizeof(phdr_buffer) ? file->fetch(file, offset, phdr_buffer, sizeof(phdr_buffer)) : NULL;
+        if (phdr == NULL) {
+            res = ESP_ERR_INVALID_ARG;
+            break;
+        }
+
+        uint32_t type        = get_u32(phdr);
+        uint32_t file_offset = get_u32(phdr + 4);
+        uint32_t address     = get_u32(phdr + 12);  // Load address, initialised data is copied to RAM by the firmware
+        uint32_t length      = get_u32(phdr + 16);
+        if (type != ELF_PT_LOAD || length == 0 || !in_flash(address, length)) continue;
+        if (file_offset > file->length || length > file->length - file_offset) {
+            ESP_LOGE(TAG, "Segment %u extends past the end of the file", index);
+            res = ESP_ERR_INVALID_SIZE;
+            break;
+        }
+        rp2040_image_segment_t segment = {
+            .address       = address,
+            .length        = length,
+            .source_offset = file_offset,
+            .block_size    = length,
+            .stride        = length,
+        };
+        res = add_segment(image, &segment);
+    }
+
+    if (res == ESP_OK) res = finish_image(image);
+    if (res != ESP_OK) rp2040_image_free(image);
+    return res;
+}
+
+esp_err_t rp2040_image_load(rp2040_image_t* image, rp2040_source_t* file) {
+    uint8_t        magic_buffer[4];
+    const uint8_t* magic = !file->sequential && file->length >= sizeof(magic_buffer) ? file->fetch(file, 0, magic_buffer, sizeof(magic_buffer)) : NULL;
+    if (magic != NULL && get_u32(magic) == UF2_MAGIC_START0) return rp2040_image_load_uf2(image, file);
+    if (magic != NULL && memcmp(magic, "\x7F" "ELF", 4) == 0) return rp2040_image_load_elf(image, file);
+    memset(image, 0, sizeof(rp2040_image_t));
+    ESP_LOGE(TAG, "Unknown image format");
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+void rp2040_image_free(rp2040_image_t* image) {
+    free(image->segments);
+    memset(image, 0, sizeof(rp2040_image_t));
+}
+
+// Index of the first segment that ends after address
+static size_t find_segment(const rp2040_image_t* image, uint32_t address) {
+    size_t low  = 0;
+    size_t high = image->segment_count;
+    while (low < high) {
+        size_t                        middle  = (low + high) / 2;
+        const rp2040_image_segment_t* segment = &image->segments[middle];
+        if (segment->address + segment->length <= address) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+bool rp2040_image_is_populated(const rp2040_image_t* image, uint32_t address, uint32_t length) {
+    size_t index = find_segment(image, address);
+    return index < image->segment_count && image->segments[index].address < address + length;
+}
+
+static uint32_t file_offset(const rp2040_image_segment_t* segment, uint32_t address) {
+    uint32_t position = address - segment->address;
+    return segment->source_offset + position / segment->block_size * segment->stride + position % segment->block_size;
+}
+
+static const uint8_t* image_fetch(rp2040_source_t* source, uint32_t offset, uint8_t* buffer, uint32_t length) {
+    const rp2040_image_t* image   = (const rp2040_image_t*) source->ctx;
+    rp2040_source_t*      file    = (rp2040_source_t*) source->_arg;
+    uint32_t              address = image->start + offset;
+    size_t                index   = find_segment(image, address);
+
+    // Ranges within a single block of the file are returned without copying
+    if (index < image->segment_count) {
+        const rp2040_image_segment_t* segment = &image->segments[index];
+        uint32_t                      block   = (address - segment->address) % segment->block_size;
+        if (segment->address <= address && address + length <= segment->address + segment->length && block + length <= segment->block_size) {
+            return file->fetch(file, file_offset(segment, address), buffer, length);
+        }
+    }
+
+    memset(buffer, 0xFF, length);
+    for (; index < image->segment_count && image->segments[index].address < address + length; index++) {
+        const rp2040_image_segment_t* segment = &image->segments[index];
+        uint32_t                      start   = segment->address > address ? segment->address : address;
+        uint32_t                      end     = segment->address + segment->length;
+        if (end > address + length) end = address + length;
+        while (start < end) {
+            uint32_t size = segment->block_size - (start - segment->address) % segment->block_size;
+            if (size > end - start) size = end - start;
+            uint8_t*       target = buffer + (start - address);
+            const uint8_t* data   = file->fetch(file, file_offset(segment, start), target, size);
+            if (data == NULL) return NULL;
+            if (data != target) memcpy(target, data, size);
+            start += size;
+        }
+    }
+    return buffer;
+}
+
+static bool image_populated(rp2040_source_t* source, uint32_t offset, uint32_t length) {
+    const rp2040_image_t* image = (const rp2040_image_t*) source->ctx;
+    return rp2040_image_is_populated(image, image->start + offset, length);
+}
+
+esp_err_t rp2040_source_from_image(rp2040_source_t* source, rp2040_source_t* file, const rp2040_image_t* image) {
+    memset(source, 0, sizeof(rp2040_source_t));
+    if (file->sequential || image->segment_count == 0) return ESP_ERR_INVALID_ARG;
+    source->length    = image->end - image->start;
+    source->address   = image->start;
+    source->fetch     = image_fetch;
+    source->populated = image_populated;
+    source->ctx       = (void*) image;
+    source->_arg      = file;
+    return ESP_OK;
+}
@@ -0,0 +1,492 @@
+/**
+ * Copyright (c) 2024 Orange-Murker
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "rp2040source.h"
+
+#include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rp2040bl.h"
+
+static const char* TAG = "RP2040 source";
+
+static const uint8_t* buffer_fetch(rp2040_source_t* source, uint32_t offset, uint8_t* buffer, uint32_t length) {
+    return (const uint8_t*) source->ctx + offset;
+}
+
+void rp2040_source_from_buffer(rp2040_source_t* source, const uint8_t* data, uint32_t length) {
+    memset(source, 0, sizeof(rp2040_source_t));
+    source->length = length;
+    source->fetch  = buffer_fetch;
+    source->ctx    = (void*) data;
+}
+
+static const uint8_t* file_fetch(rp2040_source_t* source, uint32_t offset, uint8_t* buffer, uint32_t length) {
+    FILE* file = (FILE*) source->ctx;
+    if (offset != source->_position && fseek(file, offset, SEEK_SET) != 0) return NULL;
+    size_t read       = fread(buffer, 1, length, file);
+    source->_position = offset + read;
+    return (read == length) ? buffer : NULL;
+}
+
+static void file_close(rp2040_source_t* source) { fclose((FILE*) source->ctx); }
+
+esp_err_t rp2040_source_open_file(rp2040_source_t* source, const char* path) {
+    memset(source, 0, sizeof(rp2040_source_t));
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        ESP_LOGE(TAG, "Failed to open %s", path);
+        return ESP_ERR_NOT_FOUND;
+    }
+    if (fseek(file, 0, SEEK_END) != 0) {
+        fclose(file);
+        return ESP_FAIL;
+    }
+    long length = ftell(file);
+    if (length <= 0 || fseek(file, 0, SEEK_SET) != 0) {
+        fclose(file);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    source->length = length;
+    source->fetch  = file_fetch;
+    source->close  = file_close;
+    source->ctx    = file;
+    return ESP_OK;
+}
+
+static void partition_close(rp2040_source_t* source) { esp_partition_munmap((esp_partition_mmap_handle_t) source->_handle); }
+
+esp_err_t rp2040_source_from_partition(rp2040_source_t* source, const esp_partition_t* partition, uint32_t length) {
+    memset(source, 0, sizeof(rp2040_source_t));
+    if (length == 0 || length > partition->size) return ESP_ERR_INVALID_SIZE;
+
+    // Memory mapping the partition lets every fetch point straight into flash
+    const void*                 data;
+    esp_partition_mmap_handle_t handle;
+    esp_err_t                   res = esp_partition_mmap(partition, 0, length, ESP_PARTITION_MMAP_DATA, &data, &handle);
+    if (res != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to map partition %s", partition->label);
+        return res;
+    }
+    source->length  = length;
+    source->fetch   = buffer_fetch;
+    source->close   = partition_close;
+    source->ctx     = (void*) data;
+    source->_handle = handle;
+    return ESP_OK;
+}
+
+static const uint8_t* stream_fetch(rp2040_source_t* source, uint32_t offset, uint8_t* buffer, uint32_t length) {
+    if (offset != source->_position) return NULL;
+    if (!source->_stream(source->_arg, buffer, length)) return NULL;
+    source->_position += length;
+    return buffer;
+}
+
+void rp2040_source_from_stream(rp2040_source_t* source, uint32_t length, rp2040_source_stream_t read, void* arg) {
+    memset(source, 0, sizeof(rp2040_source_t));
+    source->length     = length;
+    source->sequential = true;
+    source->fetch      = stream_fetch;
+    source->_stream    = read;
+    source->_arg       = arg;
+}
+
+typedef struct {
+    rp2040_source_t* input;
+    uint32_t         input_offset;
+    const uint8_t*   in;
+    uint32_t         in_length;
+    uint32_t         in_position;
+    uint8_t          bits;
+    uint8_t          bit_count;
+    uint8_t          window_bits;
+    uint8_t          lookahead_bits;
+    uint16_t         head;
+    uint16_t         backref_offset;
+    uint16_t         backref_count;
+    uint32_t         crc;           // Of the data decompressed so far
+    uint32_t         expected_crc;  // From the header
+    uint8_t          in_buffer[256];
+    uint8_t          window[];
+} decoder_t;
+
+static int get_bits(decoder_t* decoder, uint8_t count) {
+    int value = 0;
+    while (count--) {
+        if (decoder->bit_count == 0) {
+            if (decoder->in_position >= decoder->in_length) {
+                uint32_t length = decoder->input->length - decoder->input_offset;
+                if (length == 0) return -1;
+                if (length > sizeof(decoder->in_buffer)) length = sizeof(decoder->in_buffer);
+                decoder->in = decoder->input->fetch(decoder->input, decoder->input_offset, decoder->in_buffer, length);
+                if (decoder->in == NULL) return -1;
+                decoder->input_offset += length;
+                decoder->in_length     = length;
+                decoder->in_position   = 0;
+            }
+            decoder->bits      = decoder->in[decoder->in_position++];
+            decoder->bit_count = 8;
+        }
+        decoder->bit_count--;
+        value = (value << 1) | ((decoder->bits >> decoder->bit_count) & 0x01);
+    }
+    return value;
+}
+
+static const uint8_t* decompress_fetch(rp2040_source_t* source, uint32_t offset, uint8_t* buffer, uint32_t length) {
+    decoder_t* decoder = (decoder_t*) source->ctx;
+    uint16_t   mask    = (1 << decoder->window_bits) - 1;
+    if (offset != source->_position) return NULL;
+
+    for (uint32_t position = 0; position < length;) {
+        if (decoder->backref_count > 0) {
+            uint8_t value                           = decoder->window[(decoder->head - decoder->backref_offset) & mask];
+            decoder->window[decoder->head++ & mask] = value;
+            buffer[position++]                      = value;
+            decoder->backref_count--;
+            continue;
+        }
+        int tag = get_bits(decoder, 1);
+        if (tag < 0) return NULL;
+        if (tag) {
+            int value = get_bits(decoder, 8);
+            if (value < 0) return NULL;
+            decoder->window[decoder->head++ & mask] = value;
+            buffer[position++]                      = value;
+        } else {
+            int index = get_bits(decoder, decoder->window_bits);
+            int count = get_bits(decoder, decoder->lookahead_bits);
+            if (index < 0 || count < 0) return NULL;
+            decoder->backref_offset = index + 1;
+            decoder->backref_count  = count + 1;
+        }
+    }
+    source->_position += length;
+    decoder->crc       = rp2040_bl_crc32(decoder->crc, buffer, length);
+    if (source->_position == source->length && decoder->crc != decoder->expected_crc) {
+        ESP_LOGE(TAG, "Decompressed image CRC 0x%08" PRIx32 " does not match 0x%08" PRIx32, decoder->crc, decoder->expected_crc);
+        return NULL;
+    }
+    return buffer;
+}
+
+static void decompress_close(rp2040_source_t* source) { free(source->ctx); }
+
+esp_err_t rp2040_source_decompress(rp2040_source_t* source, rp2040_source_t* compressed) {
+    memset(source, 0, sizeof(rp2040_source_t));
+    uint8_t        header_buffer[16];
+    const uint8_t* header = compressed->length >= sizeof(header_buffer) ? compressed->fetch(compressed, 0, header_buffer, sizeof(header_buffer)) : NULL;
+    if (header == NULL || memcmp(header, "RPHS", 4) != 0) {
+        ESP_LOGE(TAG, "Not a compressed image");
+        return ESP_ERR_INVALID_ARG;
+    }
+    uint8_t window_bits    = header[4];
+    uint8_t lookahead_bits = header[5];
+    if (window_bits < 4 || window_bits > RP2040_SOURCE_MAX_WINDOW_BITS || lookahead_bits < 3 || lookahead_bits >= window_bits) {
+        ESP_LOGE(TAG, "Unsupported compression parameters (window %u, lookahead %u)", window_bits, lookahead_bits);
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+
+    // The window is the only state that grows with the compression parameters, and it is bounded
+    size_t     size    = sizeof(decoder_t) + (1 << window_bits);
+    decoder_t* decoder = calloc(1, size);
+    if (decoder == NULL) return ESP_ERR_NO_MEM;
+    decoder->input          = compressed;
+    decoder->input_offset   = sizeof(header_buffer);
+    decoder->window_bits    = window_bits;
+    decoder->lookahead_bits = lookahead_bits;
+    memcpy(&decoder->expected_crc, &header[12], 4);
+
+    memcpy(&source->length, &header[8], 4);
+    source->sequential = true;
+    source->fetch      = decompress_fetch;
+    source->close      = decompress_close;
+    source->ctx        = decoder;
+    source->heap_bytes = size + compressed->heap_bytes;
+    ESP_LOGI(TAG, "Decompressing %" PRIu32 " byte image using %zu bytes of working memory", source->length, size);
+    return ESP_OK;
+}
+
+// Single producer, single consumer ring of chunk indices. head is only written by the consumer and tail only by the
+// producer, both count up and wrap around. Every queue can hold all chunks of the pool, so a push never fails.
+typedef struct {
+    atomic_uint head;
+    atomic_uint tail;
+    uint8_t     slots[RP2040_SOURCE_PREFETCH_MAX_CHUNKS];
+} chunk_queue_t;
+
+static void queue_push(chunk_queue_t* queue, uint8_t index) {
+    unsigned tail                                         = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    queue->slots[tail % RP2040_SOURCE_PREFETCH_MAX_CHUNKS] = index;
+    atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+}
+
+static bool queue_pop(chunk_queue_t* queue, uint8_t* index) {
+    unsigned head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    if (head == atomic_load_explicit(&queue->tail, memory_order_acquire)) return false;
+    *index = queue->slots[head % RP2040_SOURCE_PREFETCH_MAX_CHUNKS];
+    atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+    return true;
+}
+
+typedef struct {
+    const uint8_t* data;  // NULL if the inner source failed
+    uint8_t*       buffer;
+    uint32_t       offset;
+    uint32_t       length;
+    unsigned       generation;
+} prefetch_chunk_t;
+
+typedef struct {
+    rp2040_source_t*  inner;
+    uint32_t          chunk_size;
+    uint8_t           chunk_count;
+    chunk_queue_t     ready;  // Filled chunks, from the prefetch task to the caller
+    chunk_queue_t     free;   // Chunks that can be refilled, from the caller to the prefetch task
+    prefetch_chunk_t  chunks[RP2040_SOURCE_PREFETCH_MAX_CHUNKS];
+    SemaphoreHandle_t ready_signal;  // Wakes up the caller after a push to ready, only used when it is empty
+    SemaphoreHandle_t free_signal;   // Wakes up the prefetch task after a push to free, a restart or when closing
+    atomic_uint       generation;    // Incremented by the caller to restart the prefetch task at restart_offset
+    atomic_uint       restart_offset;
+    atomic_bool       stop;
+    atomic_bool       stopped;     // The prefetch task no longer uses the inner source
+    atomic_int        references;  // The caller and the prefetch task, the last one to let go frees the state
+    unsigned          consumer_generation;  // Only accessed by the caller
+    int               current;              // Chunk returned by the last fetch, until the next fetch
+} prefetch_t;
+
+static void prefetch_free(prefetch_t* prefetch) {
+    if (prefetch->ready_signal != NULL) vSemaphoreDelete(prefetch->ready_signal);
+    if (prefetch->free_signal != NULL) vSemaphoreDelete(prefetch->free_signal);
+    free(prefetch);
+}
+
+static void prefetch_release(prefetch_t* prefetch) {
+    if (atomic_fetch_sub(&prefetch->references, 1) == 1) prefetch_free(prefetch);
+}
+
+static void prefetch_task(void* arg) {
+    prefetch_t*      prefetch   = (prefetch_t*) arg;
+    rp2040_source_t* inner      = prefetch->inner;
+    unsigned         generation = 0;
+    uint32_t         position   = 0;
+    while (!atomic_load(&prefetch->stop)) {
+        unsigned latest = atomic_load_explicit(&prefetch->generation, memory_order_acquire);
+        if (latest != generation) {
+            generation = latest;
+            position   = atomic_load_explicit(&prefetch->restart_offset, memory_order_relaxed);
+        }
+        uint8_t index;
+        if (position >= inner->length || !queue_pop(&prefetch->free, &index)) {
+            xSemaphoreTake(prefetch->free_signal, portMAX_DELAY);
+            continue;
+        }
+        prefetch_chunk_t* chunk = &prefetch->chunks[index];
+        chunk->offset           = position;
+        chunk->length           = inner->length - position < prefetch->chunk_size ? inner->length - position : prefetch->chunk_size;
+        chunk->generation       = generation;
+        chunk->data             = inner->fetch(inner, position, chunk->buffer, chunk->length);
+
+        // After a failure the task waits for a restart, the caller receives the failed chunk first
+        position = chunk->data != NULL ? position + chunk->length : inner->length;
+        queue_push(&prefetch->ready, index);
+        xSemaphoreGive(prefetch->ready_signal);
+    }
+    atomic_store(&prefetch->stopped, true);
+    xSemaphoreGive(prefetch->ready_signal);
+    prefetch_release(prefetch);
+    vTaskDelete(NULL);
+}
+
+static void release_current(prefetch_t* prefetch) {
+    if (prefetch->current < 0) return;
+    queue_push(&prefetch->free, prefetch->current);
+    xSemaphoreGive(prefetch->free_signal);
+    prefetch->current = -1;
+}
+
+static void restart(prefetch_t* prefetch, uint32_t offset) {
+    prefetch->consumer_generation++;
+    atomic_store_explicit(&prefetch->restart_offset, offset, memory_order_relaxed);
+    atomic_store_explicit(&prefetch->generation, prefetch->consumer_generation, memory_order_release);
+    xSemaphoreGive(prefetch->free_signal);
+}
+
+// Chunk that contains offset, waiting for the prefetch task when it has not been read yet
+static prefetch_chunk_t* chunk_at(prefetch_t* prefetch, uint32_t offset) {
+    // Skipping less than the data the pool holds is cheaper than restarting
+    uint32_t reach = prefetch->chunk_size * prefetch->chunk_count;
+    while (true) {
+        if (prefetch->current >= 0) {
+            prefetch_chunk_t* chunk = &prefetch->chunks[prefetch->current];
+            uint32_t          end   = chunk->offset + chunk->length;
+            if (chunk->data != NULL && offset >= chunk->offset && offset < end) return chunk;
+            // Decided before the chunk is handed back, the prefetch task may refill it right away
+            bool seek = chunk->data == NULL || offset < chunk->offset || offset - end >= reach;
+            release_current(prefetch);
+            if (seek) restart(prefetch, offset);
+        }
+        uint8_t index;
+        while (!queue_pop(&prefetch->ready, &index)) xSemaphoreTake(prefetch->ready_signal, portMAX_DELAY);
+        prefetch->current = index;
+        if (prefetch->chunks[index].generation != prefetch->consumer_generation) {
+            release_current(prefetch);
+            continue;
+        }
+        if (prefetch->chunks[index].data == NULL && offset >= prefetch->chunks[index].offset) return NULL;
+    }
+}
+
+static const uint8_t* prefetch_fetch(rp2040_source_t* source, uint32_t offset, uint8_t* buffer, uint32_t length) {
+    prefetch_t* prefetch = (prefetch_t*) source->ctx;
+    if (offset > source->length || length > source->length - offset) return NULL;
+    for (uint32_t position = 0; position < length;) {
+        prefetch_chunk_t* chunk = chunk_at(prefetch, offset + position);
+        if (chunk == NULL) return NULL;
+        uint32_t skip = offset + position - chunk->offset;
+        uint32_t size = chunk->length - skip < length - position ? chunk->length - skip : length - position;
+        // The chunk stays valid until the next fetch, so data within a single chunk is not copied
+        if (size == length) return chunk->data + skip;
+        memcpy(buffer + position, chunk->data + skip, size);
+        position += size;
+    }
+    return buffer;
+}
+
+static bool prefetch_populated(rp2040_source_t* source, uint32_t offset, uint32_t length) {
+    rp2040_source_t* inner = ((prefetch_t*) source->ctx)->inner;
+    return inner->populated(inner, offset, length);
+}
+
+static void prefetch_close(rp2040_source_t* source) {
+    prefetch_t* prefetch = (prefetch_t*) source->ctx;
+    atomic_store(&prefetch->stop, true);
+    xSemaphoreGive(prefetch->free_signal);
+    // A fetch from the inner source that is in progress has to complete first
+    while (!atomic_load(&prefetch->stopped)) xSemaphoreTake(prefetch->ready_signal, portMAX_DELAY);
+    prefetch_release(prefetch);
+}
+
+// Single core chips, including the Linux host target, have no second core to pin the task to
+static BaseType_t prefetch_core(int core) {
+    if (core >= 0) return core;
+#if configNUMBER_OF_CORES > 1
+    if (core == RP2040_SOURCE_PREFETCH_CORE) return 1;
+#endif
+    return tskNO_AFFINITY;
+}
+
+esp_err_t rp2040_source_prefetch(rp2040_source_t* source, rp2040_source_t* inner, const rp2040_prefetch_config_t* config) {
+    memset(source, 0, sizeof(rp2040_source_t));
+    if (config->chunk_size == 0 || config->chunk_count == 0 || config->chunk_count > RP2040_SOURCE_PREFETCH_MAX_CHUNKS) return ESP_ERR_INVALID_ARG;
+
+    prefetch_t* prefetch = calloc(1, sizeof(prefetch_t) + (size_t) config->chunk_size * config->chunk_count);
+    if (prefetch == NULL) return ESP_ERR_NO_MEM;
+    prefetch->inner        = inner;
+    prefetch->chunk_size   = config->chunk_size;
+    prefetch->chunk_count  = config->chunk_count;
+    prefetch->current      = -1;
+    prefetch->references   = 2;
+    prefetch->ready_signal = xSemaphoreCreateBinary();
+    prefetch->free_signal  = xSemaphoreCreateBinary();
+    if (prefetch->ready_signal == NULL || prefetch->free_signal == NULL) {
+        prefetch_free(prefetch);
+        return ESP_ERR_NO_MEM;
+    }
+    uint8_t* buffers = (uint8_t*) (prefetch + 1);
+    for (uint8_t index = 0; index < config->chunk_count; index++) {
+        prefetch->chunks[index].buffer = buffers + (size_t) index * config->chunk_size;
+        queue_push(&prefetch->free, index);
+    }
+    BaseType_t core = prefetch_core(config->core);
+    if (xTaskCreatePinnedToCore(prefetch_task, "rp2040_prefetch", config->stack_size, prefetch, config->priority, NULL, core) != pdPASS) {
+        prefetch_free(prefetch);
+        return ESP_ERR_NO_MEM;
+    }
+
+    source->length     = inner->length;
+    source->address    = inner->address;
+    source->sequential = inner->sequential;
+    source->fetch      = prefetch_fetch;
+    source->populated  = inner->populated != NULL ? prefetch_populated : NULL;
+    source->close      = prefetch_close;
+    source->ctx        = prefetch;
+    source->heap_bytes = sizeof(prefetch_t) + config->chunk_size * config->chunk_count + config->stack_size + inner->heap_bytes;
+    return ESP_OK;
+}
+
+void rp2040_source_close(rp2040_source_t* source) {
+    if (source->close != NULL) source->close(source);
+    source->close = NULL;
+}
+
+static bool buffer_write(rp2040_sink_t* sink, uint32_t offset, const uint8_t* data, uint32_t length) {
+    memcpy((uint8_t*) sink->ctx + offset, data, length);
+    return true;
+}
+
+void rp2040_sink_to_buffer(rp2040_sink_t* sink, uint8_t* buffer) {
+    memset(sink, 0, sizeof(rp2040_sink_t));
+    sink->write = buffer_write;
+    sink->ctx   = buffer;
+}
+
+static bool file_write(rp2040_sink_t* sink, uint32_t offset, const uint8_t* data, uint32_t length) {
+    FILE* file = (FILE*) sink->ctx;
+    if (offset != sink->_position && fseek(file, offset, SEEK_SET) != 0) return false;
+    size_t written  = fwrite(data, 1, length, file);
+    sink->_position = offset + written;
+    return written == length;
+}
+
+static void file_sink_close(rp2040_sink_t* sink) { fclose((FILE*) sink->ctx); }
+
+esp_err_t rp2040_sink_open_file(rp2040_sink_t* sink, const char* path) {
+    memset(sink, 0, sizeof(rp2040_sink_t));
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) {
+        ESP_LOGE(TAG, "Failed to create %s", path);
+        return ESP_FAIL;
+    }
+    sink->write = file_write;
+    sink->close = file_sink_close;
+    sink->ctx   = file;
+    return ESP_OK;
+}
+
+static bool partition_write(rp2040_sink_t* sink, uint32_t offset, const uint8_t* data, uint32_t length) {
+    const esp_partition_t* partition = sink->_partition;
+    if (offset + length > partition->size) return false;
+
+    // Sectors are erased as the data reaches them. Rewriting data that was already written erases its sector
+    // again, so rewrites have to start on a sector boundary
+    if (offset < sink->_position) sink->_erased = offset - (offset % partition->erase_size);
+    while (sink->_erased < offset + length) {
+        if (esp_partition_erase_range(partition, sink->_erased, partition->erase_size) != ESP_OK) return false;
+        sink->_erased += partition->erase_size;
+    }
+    if (esp_partition_write(partition, offset, data, length) != ESP_OK) return false;
+    sink->_position = offset + length;
+    return true;
+}
+
+void rp2040_sink_to_partition(rp2040_sink_t* sink, const esp_partition_t* partition) {
+    memset(sink, 0, sizeof(rp2040_sink_t));
+    sink->write      = partition_write;
+    sink->_partition = partition;
+}
+
+void rp2040_sink_close(rp2040_sink_t* sink) {
+    if (sink->close != NULL) sink->close(sink);
+    sink->close = NULL;
+}
@@ -0,0 +1,862 @@
+/**
+ * Copyright (c) 2024 Orange-Murker
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "rp2040update.h"
+
+#include <esp_check.h>
+#include <esp_log.h>
+#include <esp_random.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <inttypes.h>
+#include <nvs.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rp2040bl.h"
+
+#define RP2040_UPDATE_BOOT_TIMEOUT_MS 5000
+#define RP2040_UPDATE_BOOT_POLL_MS    10
+#define RP2040_UPDATE_SYNC_TIMEOUT_MS 1000
+#define RP2040_UPDATE_STEP_WAIT_MS    20   // Longest a step waits for a reply, so callers of rp2040_update_step keep control
+#define RP2040_UPDATE_ERASE_BATCH_MS  500  // Longest expected duration of a single erase command
+#define RP2040_UPDATE_COMPARE_AHEAD   32   // Sectors compared ahead of the one being written, also limits the erase batch
+
+#define RP2040_UPDATE_JOURNAL_KEY "journal"
+
+static const char* TAG = "RP2040 update";
+
+static bool nvs_journal_load(void* ctx, rp2040_update_journal_entry_t* entry) {
+    size_t size = sizeof(rp2040_update_journal_entry_t);
+    return nvs_get_blob((nvs_handle_t) (uintptr_t) ctx, RP2040_UPDATE_JOURNAL_KEY, entry, &size) == ESP_OK && size == sizeof(rp2040_update_journal_entry_t);
+}
+
+static bool nvs_journal_store(void* ctx, const rp2040_update_journal_entry_t* entry) {
+    nvs_handle_t handle = (nvs_handle_t) (uintptr_t) ctx;
+    if (nvs_set_blob(handle, RP2040_UPDATE_JOURNAL_KEY, entry, sizeof(rp2040_update_journal_entry_t)) != ESP_OK) return false;
+    return nvs_commit(handle) == ESP_OK;
+}
+
+static void nvs_journal_clear(void* ctx) {
+    nvs_handle_t handle = (nvs_handle_t) (uintptr_t) ctx;
+    nvs_erase_key(handle, RP2040_UPDATE_JOURNAL_KEY);
+    nvs_commit(handle);
+}
+
+esp_err_t rp2040_update_journal_open_nvs(rp2040_update_journal_t* journal, const char* name_space) {
+    nvs_handle_t handle;
+    esp_err_t    res = nvs_open(name_space, NVS_READWRITE, &handle);
+    if (res != ESP_OK) return res;
+    journal->load  = nvs_journal_load;
+    journal->store = nvs_journal_store;
+    journal->clear = nvs_journal_clear;
+    journal->ctx   = (void*) (uintptr_t) handle;
+    return ESP_OK;
+}
+
+void rp2040_update_journal_close_nvs(rp2040_update_journal_t* journal) { nvs_close((nvs_handle_t) (uintptr_t) journal->ctx); }
+
+const char* rp2040_update_state_to_name(rp2040_update_state_t state) {
+    switch (state) {
+        case RP2040_UPDATE_STATE_IDLE: return "idle";
+        case RP2040_UPDATE_STATE_REBOOT: return "reboot";
+        case RP2040_UPDATE_STATE_WAIT_BOOTLOADER: return "wait for bootloader";
+        case RP2040_UPDATE_STATE_SYNC: return "sync";
+        case RP2040_UPDATE_STATE_INFO: return "info";
+        case RP2040_UPDATE_STATE_CHECK: return "check";
+        case RP2040_UPDATE_STATE_COMPARE: return "compare";
+        case RP2040_UPDATE_STATE_ERASE: return "erase";
+        case RP2040_UPDATE_STATE_WRITE: return "write";
+        case RP2040_UPDATE_STATE_VERIFY: return "verify";
+        case RP2040_UPDATE_STATE_SEAL: return "seal";
+        case RP2040_UPDATE_STATE_GO: return "go";
+        case RP2040_UPDATE_STATE_DONE: return "done";
+        case RP2040_UPDATE_STATE_FAILED: return "failed";
+    }
+    return "unknown";
+}
+
+const char* rp2040_update_verify_to_name(rp2040_update_verify_t verify) {
+    switch (verify) {
+        case RP2040_UPDATE_VERIFY_WRITE_CRC: return "write CRC";
+        case RP2040_UPDATE_VERIFY_CRC: return "image CRC";
+        case RP2040_UPDATE_VERIFY_SAMPLED: return "sampled readback";
+        case RP2040_UPDATE_VERIFY_FULL: return "full readback";
+    }
+    return "unknown";
+}
+
+int64_t rp2040_update_estimate_verify_time(rp2040_bl_t* bl, rp2040_update_verify_t verify, uint32_t length, uint32_t chunk_size, uint32_t samples) {
+    uint32_t baudrate = rp2040_bl_get_baudrate(bl);
+    uint32_t chunks   = (length + chunk_size - 1) / chunk_size;
+    if (samples > chunks) samples = chunks;
+    // A READ is a 12 byte command followed by a 4 byte reply header and the data, a CRCC is answered with 8 bytes
+    int64_t read_time = (int64_t) (12 + 4 + chunk_size) * 10 * 1000000 / baudrate + bl->timing.turnaround_us;
+    int64_t crc_time  = (int64_t) (12 + 8) * 10 * 1000000 / baudrate + bl->timing.turnaround_us + (length + 1023) / 1024 * bl->timing.crc_us;
+    switch (verify) {
+        case RP2040_UPDATE_VERIFY_WRITE_CRC: return 0;
+        case RP2040_UPDATE_VERIFY_CRC: return crc_time;
+        case RP2040_UPDATE_VERIFY_SAMPLED: return samples * read_time;
+        case RP2040_UPDATE_VERIFY_FULL: return chunks * read_time;
+    }
+    return 0;
+}
+
+static void set_state(rp2040_update_t* update, rp2040_update_state_t state) {
+    update->_state = state;
+    if (update->progress != NULL) update->progress(state, update->_position, update->_length, update->progress_arg);
+}
+
+static esp_err_t fail(rp2040_update_t* update, esp_err_t res, const char* message) {
+    ESP_LOGE(TAG, "%s (in state %s at 0x%08" PRIx32 ")", message, rp2040_update_state_to_name(update->_state), update->_flash_start + update->_position);
+    rp2040_bl_log_stats(update->bl);
+    set_state(update, RP2040_UPDATE_STATE_FAILED);
+    return res;
+}
+
+// Poll the firmware version until the RP2040 runs its bootloader, or its firmware again
+static esp_err_t wait_for_reboot(RP2040* device, bool bootloader) {
+    int64_t deadline = esp_timer_get_time() + RP2040_UPDATE_BOOT_TIMEOUT_MS * 1000LL;
+    while (esp_timer_get_time() < deadline) {
+        // The RP2040 does not respond on I2C while it reboots, errors are expected here
+        uint8_t version;
+        if (rp2040_get_firmware_version(device, &version) == ESP_OK && (version == 0xFF) == bootloader) return ESP_OK;
+        vTaskDelay(pdMS_TO_TICKS(RP2040_UPDATE_BOOT_POLL_MS));
+    }
+    return ESP_ERR_TIMEOUT;
+}
+
+static esp_err_t check_flash(RP2040* device, rp2040_bl_t* bl, const rp2040_update_manifest_t* manifest, bool unsealed, bool* needed) {
+    if (!rp2040_bl_sync_wait(bl, RP2040_UPDATE_SYNC_TIMEOUT_MS * 1000LL, NULL)) return ESP_ERR_TIMEOUT;
+    uint32_t flash_start, flash_size, erase_size, write_size, max_data_len, crc;
+    if (!rp2040_bl_get_info(bl, &flash_start, &flash_size, &erase_size, &write_size, &max_data_len)) return ESP_FAIL;
+
+    // The bootloader calculates CRCs over whole words. An update pads the image with the erased flash value, so the CRC of
+    // the manifest is continued over that padding.
+    static const uint8_t padding[3] = {0xFF, 0xFF, 0xFF};
+    uint32_t             length     = manifest->length, expected = manifest->crc;
+    if (length % 4 != 0) {
+        expected  = rp2040_bl_crc32(expected, padding, 4 - length % 4);
+        length   += 4 - length % 4;
+    }
+    if (length > flash_size) {
+        *needed = true;
+        return ESP_OK;
+    }
+    if (!rp2040_bl_crc(bl, flash_start, length, &crc)) return ESP_FAIL;
+    *needed = crc != expected;
+    if (*needed) {
+        ESP_LOGI(TAG, "Flash CRC 0x%08" PRIx32 " does not match the image CRC 0x%08" PRIx32, crc, expected);
+        return ESP_OK;
+    }
+    // The bootloader only starts a sealed image. Matching flash found in the bootloader may be an update that was
+    // interrupted before its seal, so it is sealed again.
+    if (unsealed && !rp2040_bl_seal(bl, flash_start, length, expected)) return ESP_FAIL;
+    if (!rp2040_bl_go(bl, flash_start)) return ESP_FAIL;
+    if (wait_for_reboot(device, false) != ESP_OK) {
+        ESP_LOGW(TAG, "Firmware did not start after its CRC matched");
+        *needed = true;
+    }
+    return ESP_OK;
+}
+
+esp_err_t rp2040_update_check(RP2040* device, rp2040_bl_t* bl, const rp2040_update_manifest_t* manifest, bool* needed) {
+    // A single register read decides the common case
+    uint8_t version;
+    ESP_RETURN_ON_ERROR(rp2040_get_firmware_version(device, &version), TAG, "Failed to read RP2040 firmware version");
+    if (version != 0xFF && (version != manifest->version || !manifest->ambiguous)) {
+        *needed = version != manifest->version;
+        return ESP_OK;
+    }
+
+    if (version != 0xFF) {
+        ESP_RETURN_ON_ERROR(rp2040_reboot_to_bootloader(device), TAG, "Failed to reboot RP2040 to bootloader");
+        ESP_RETURN_ON_ERROR(wait_for_reboot(device, true), TAG, "Timeout waiting for RP2040 bootloader");
+    }
+    // The update installs the UART again when it runs, so it is left as it was found
+    bool installed = uart_is_driver_installed(bl->uart);
+    ESP_RETURN_ON_ERROR(rp2040_bl_install_uart(bl), TAG, "Failed to install bootloader UART");
+    esp_err_t res = check_flash(device, bl, manifest, version == 0xFF, needed);
+    if (!installed) rp2040_bl_uninstall_uart(bl);
+    return res;
+}
+
+esp_err_t rp2040_update_init(rp2040_update_t* update) {
+    if (update->bl == NULL || update->source == NULL || update->source->fetch == NULL || update->source->length == 0) return ESP_ERR_INVALID_ARG;
+    if (update->journal != NULL && update->source->sequential) ESP_LOGW(TAG, "Updates from sequential sources can not be resumed");
+    rp2040_update_deinit(update);  // The chunk size of a previous run may differ
+    memset(&update->stats, 0, sizeof(update->stats));
+    memset(&update->bl->stats, 0, sizeof(update->bl->stats));
+    update->_state             = RP2040_UPDATE_STATE_IDLE;
+    update->_position          = 0;
+    update->_sent              = 0;
+    update->_erased            = 0;
+    update->_compared_start    = 0;
+    update->_compared          = 0;
+    update->_dirty             = 0;
+    update->_prepared          = 0;
+    update->_pending_head      = 0;
+    update->_pending_count     = 0;
+    update->_length            = 0;
+    update->_verify_offset     = 0;
+    update->_verify_crc        = 0;
+    update->_samples_verified  = 0;
+    update->_verify_retry      = false;
+    update->_sector_write_time = 0;
+    update->_transfer_time     = 0;
+    return ESP_OK;
+}
+
+void rp2040_update_deinit(rp2040_update_t* update) {
+    free(update->_buffer);
+    free(update->_verify_buffer);
+    update->_buffer        = NULL;
+    update->_verify_buffer = NULL;
+}
+
+// Fetch part of the image, padding everything past the end of the source with the erased flash value
+static const uint8_t* read_image(rp2040_update_t* update, uint32_t offset, uint32_t length) {
+    rp2040_source_t* source    = update->source;
+    uint32_t         available = 0;
+    if (offset < source->length) {
+        available = source->length - offset;
+        if (available > length) available = length;
+    }
+    if (available == length) return source->fetch(source, offset, update->_buffer, length);
+
+    if (available > 0) {
+        const uint8_t* data = source->fetch(source, offset, update->_buffer, available);
+        if (data == NULL) return NULL;
+        if (data != update->_buffer) memcpy(update->_buffer, data, available);
+    }
+    memset(update->_buffer + available, 0xFF, length - available);
+    return update->_buffer;
+}
+
+static uint32_t sector_end(rp2040_update_t* update, uint32_t position) {
+    uint32_t end = (position / update->_erase_size + 1) * update->_erase_size;
+    return end < update->_length ? end : update->_length;
+}
+
+// Sparse images report the ranges that are only padding, those are neither erased nor written
+static bool populated(rp2040_update_t* update, uint32_t offset, uint32_t length) {
+    rp2040_source_t* source = update->source;
+    return source->populated == NULL || source->populated(source, offset, length);
+}
+
+static bool sector_populated(rp2040_update_t* update, uint32_t position) {
+    uint32_t start = position - (position % update->_erase_size);
+    return populated(update, start, sector_end(update, start) - start);
+}
+
+// Continues the CRC in crc over part of the image. Sectors without data keep their current contents,
+// so their CRC is read from the flash.
+static bool image_crc(rp2040_update_t* update, uint32_t offset, uint32_t length, uint32_t* crc) {
+    while (length > 0) {
+        if (!sector_populated(update, offset)) {
+            uint32_t run = 0;
+            while (run < length && !sector_populated(update, offset + run)) run = sector_end(update, offset + run) - offset;
+            if (run > length) run = length;
+            uint32_t remote_crc;
+            if (!rp2040_bl_crc(update->bl, update->_flash_start + offset, run, &remote_crc)) return false;
+            *crc    = rp2040_bl_crc32_combine(*crc, remote_crc, run);
+            offset += run;
+            length -= run;
+            continue;
+        }
+        uint32_t chunk = length < update->_chunk_size ? length : update->_chunk_size;
+        if (offset + chunk > sector_end(update, offset)) chunk = sector_end(update, offset) - offset;
+        const uint8_t* data  = read_image(update, offset, chunk);
+        if (data == NULL) return false;
+        *crc    = rp2040_bl_crc32(*crc, data, chunk);
+        offset += chunk;
+        length -= chunk;
+    }
+    return true;
+}
+
+// Sequential sources can only be read once, so they are always written in full
+static bool full_write(rp2040_update_t* update) { return update->full_write || update->source->sequential; }
+
+static uint32_t sector_length(rp2040_update_t* update) {
+    uint32_t length = update->_erase_size - (update->_position % update->_erase_size);
+    if (update->_position + length > update->_length) length = update->_length - update->_position;
+    return length;
+}
+
+static rp2040_update_state_t next_sector_state(rp2040_update_t* update) {
+    while (update->_position < update->_length && !sector_populated(update, update->_position)) {
+        update->_position += sector_length(update);
+        update->_sent      = update->_position;
+        update->stats.sectors_unpopulated++;
+    }
+    if (update->_position >= update->_length) {
+        update->_verify_start_time = esp_timer_get_time();
+        return RP2040_UPDATE_STATE_VERIFY;
+    }
+    if (update->_position < update->_erased) {
+        // Erased together with an earlier sector
+        update->_sector_start_time = esp_timer_get_time();
+        return RP2040_UPDATE_STATE_WRITE;
+    }
+    return full_write(update) ? RP2040_UPDATE_STATE_ERASE : RP2040_UPDATE_STATE_COMPARE;
+}
+
+static void journal_store(rp2040_update_t* update) {
+    if (update->journal == NULL || update->source->sequential) return;
+    rp2040_update_journal_entry_t entry = {
+        .length      = update->_length,
+        .crc         = update->_crc,
+        .flash_start = update->_flash_start,
+        .erase_size  = update->_erase_size,
+        .position    = update->_position,
+    };
+    if (!update->journal->store(update->journal->ctx, &entry)) ESP_LOGW(TAG, "Failed to store update progress");
+}
+
+static uint32_t verify_samples(rp2040_update_t* update) {
+    return update->verify_samples > 0 ? update->verify_samples : RP2040_UPDATE_VERIFY_SAMPLES;
+}
+
+static esp_err_t step_info(rp2040_update_t* update) {
+    if (!rp2040_bl_get_info(update->bl, &update->_flash_start, &update->_flash_size, &update->_erase_size, &update->_write_size, &update->_max_data_len)) {
+        return fail(update, ESP_FAIL, "Failed to read bootloader info");
+    }
+    if (update->_erase_size == 0 || update->_write_size == 0 || update->_erase_size % update->_write_size != 0 || update->_max_data_len < update->_write_size) {
+        return fail(update, ESP_ERR_INVALID_RESPONSE, "Unsupported flash geometry");
+    }
+
+    // Chunks never cross an erase sector and are always a multiple of the write size
+    uint32_t chunk_size = update->_max_data_len < update->_erase_size ? update->_max_data_len : update->_erase_size;
+    update->_chunk_size = chunk_size - (chunk_size % update->_write_size);
+    update->_length     = (update->source->length + update->_write_size - 1) / update->_write_size * update->_write_size;
+    if (update->_length > update->_flash_size) return fail(update, ESP_ERR_INVALID_SIZE, "Image does not fit in RP2040 flash");
+    if (update->source->address != 0 && update->source->address != update->_flash_start) {
+        return fail(update, ESP_ERR_INVALID_ARG, "Image is not linked for the flash address of the bootloader");
+    }
+
+    // A single chunk buffer is all the update needs, whatever the size of the image
+    free(update->_buffer);
+    update->_buffer = malloc(update->_chunk_size);
+    if (update->_buffer == NULL) return fail(update, ESP_ERR_NO_MEM, "Failed to allocate chunk buffer");
+    update->stats.heap_bytes = update->_chunk_size + update->source->heap_bytes;
+
+    ESP_LOGI(TAG, "Flash at 0x%08" PRIx32 ", %" PRIu32 " bytes, erase size %" PRIu32 ", write size %" PRIu32 ", chunk size %" PRIu32,
+             update->_flash_start, update->_flash_size, update->_erase_size, update->_write_size, update->_chunk_size);
+    for (rp2040_update_verify_t verify = RP2040_UPDATE_VERIFY_WRITE_CRC; verify <= RP2040_UPDATE_VERIFY_FULL; verify++) {
+        int64_t     time     = rp2040_update_estimate_verify_time(update->bl, verify, update->_length, update->_chunk_size, verify_samples(update));
+        const char* selected = verify == update->verify ? ", selected" : "";
+        ESP_LOGI(TAG, "Verification by %s takes about %" PRId64 " ms%s", rp2040_update_verify_to_name(verify), time / 1000, selected);
+    }
+    set_state(update, RP2040_UPDATE_STATE_CHECK);
+    return ESP_ERR_NOT_FINISHED;
+}
+
+static esp_err_t step_check(rp2040_update_t* update) {
+    update->_write_start_time = esp_timer_get_time();
+    update->_crc              = 0;
+    if (update->source->sequential) {
+        // The CRC is accumulated while the image is being written instead
+        set_state(update, next_sector_state(update));
+        return ESP_ERR_NOT_FINISHED;
+    }
+
+    // An interrupted update of the same image can continue where it left off
+    rp2040_update_journal_entry_t entry;
+    uint32_t                      resume = 0;
+    if (update->journal != NULL && update->journal->load(update->journal->ctx, &entry) && entry.length == update->_length &&
+        entry.flash_start == update->_flash_start && entry.erase_size == update->_erase_size && entry.position <= update->_length) {
+        resume = entry.position;
+    }
+
+    uint32_t resume_crc;
+    if (!image_crc(update, 0, resume, &update->_crc)) return fail(update, ESP_FAIL, "Failed to read image");
+    resume_crc = update->_crc;
+    if (!image_crc(update, resume, update->_length - resume, &update->_crc)) return fail(update, ESP_FAIL, "Failed to read image");
+    if (resume > 0 && entry.crc != update->_crc) resume = 0;
+
+    uint32_t crc;
+    if (!update->full_write) {
+        // A single CRC over the whole image detects an unchanged image without touching any sector
+        if (!rp2040_bl_crc(update->bl, update->_flash_start, update->_length, &crc)) return fail(update, ESP_FAIL, "Failed to read flash CRC");
+        if (crc == update->_crc) {
+            update->stats.sectors_skipped = (update->_length + update->_erase_size - 1) / update->_erase_size;
+            update->_position             = update->_length;
+            update->_sent                 = update->_length;
+            update->_verify_start_time    = esp_timer_get_time();
+            // Sealed again, as an update that was interrupted before its seal leaves the same flash. The bootloader does
+            // not start an unsealed image, and the seal is a single command.
+            ESP_LOGI(TAG, "Image already present in flash, sealing it");
+            set_state(update, RP2040_UPDATE_STATE_SEAL);
+            return ESP_ERR_NOT_FINISHED;
+        }
+    }
+
+    // Sectors written before the interruption are verified with a single CRC instead of being rewritten
+    if (resume > 0 && update->_position == 0) {
+        if (!rp2040_bl_crc(update->bl, update->_flash_start, resume, &crc)) return fail(update, ESP_FAIL, "Failed to read flash CRC");
+        if (crc == resume_crc) {
+            update->_position           = resume;
+            update->_sent               = resume;
+            update->stats.resumed_bytes = resume;
+            ESP_LOGI(TAG, "Resuming interrupted update at 0x%08" PRIx32, update->_flash_start + resume);
+        }
+    }
+
+    set_state(update, next_sector_state(update));
+    return ESP_ERR_NOT_FINISHED;
+}
+
+// Whether the sector at position differs from the image. The erase scheduler compares sectors ahead of the one being written,
+// the results of the last RP2040_UPDATE_COMPARE_AHEAD sectors are kept. Returns ESP_ERR_NOT_FINISHED if the sector had to
+// be compared, so a step compares at most one sector.
+static esp_err_t sector_dirty(rp2040_update_t* update, uint32_t position, bool* dirty) {
+    if (full_write(update)) {
+        *dirty = true;
+        return ESP_OK;
+    }
+    uint32_t index = (position - update->_compared_start) / update->_erase_size;
+    if (position >= update->_compared_start && index < update->_compared) {
+        *dirty = (update->_dirty >> index) & 1;
+        return ESP_OK;
+    }
+    if (position < update->_compared_start || index != update->_compared) {
+        update->_compared_start = position;
+        update->_compared       = 0;
+        update->_dirty          = 0;
+        index                   = 0;
+    } else if (index == RP2040_UPDATE_COMPARE_AHEAD) {
+        // Forget the oldest sector
+        update->_compared_start += update->_erase_size;
+        update->_dirty         >>= 1;
+        update->_compared--;
+        index--;
+    }
+
+    uint32_t length    = sector_end(update, position) - position;
+    uint32_t local_crc = 0, remote_crc;
+    if (!image_crc(update, position, length, &local_crc)) return fail(update, ESP_FAIL, "Failed to read image");
+    if (!rp2040_bl_crc(update->bl, update->_flash_start + position, length, &remote_crc)) return fail(update, ESP_FAIL, "Failed to read sector CRC");
+    *dirty = local_crc != remote_crc;
+    if (*dirty) update->_dirty |= 1UL << index;
+    update->_compared++;
+    return ESP_ERR_NOT_FINISHED;
+}
+
+static esp_err_t step_compare(rp2040_update_t* update) {
+    bool      dirty;
+    esp_err_t res = sector_dirty(update, update->_position, &dirty);
+    if (res != ESP_OK && res != ESP_ERR_NOT_FINISHED) return res;
+
+    if (!dirty) {
+        update->_position += sector_length(update);
+        update->_sent      = update->_position;
+        update->stats.sectors_skipped++;
+        journal_store(update);
+        set_state(update, next_sector_state(update));
+    } else {
+        set_state(update, RP2040_UPDATE_STATE_ERASE);
+    }
+    return ESP_ERR_NOT_FINISHED;
+}
+
+// Sectors past the end of the image keep their contents, only the sector the image ends in is erased completely
+static uint32_t erase_end(rp2040_update_t* update) {
+    uint32_t end = (update->_length + update->_erase_size - 1) / update->_erase_size * update->_erase_size;
+    return end < update->_flash_size ? end : update->_flash_size;
+}
+
+static uint32_t block_size(rp2040_update_t* update) {
+    uint32_t block = update->bl->timing.block_size;
+    if (block <= update->_erase_size || block % update->_erase_size != 0 || block / update->_erase_size > RP2040_UPDATE_COMPARE_AHEAD) return 0;
+    return block;
+}
+
+// Expected cost of writing a sector that did not change again, because it shares an erase block with sectors that did
+static int64_t rewrite_time(rp2040_update_t* update) {
+    const rp2040_bl_timing_t* timing   = &update->bl->timing;
+    uint32_t                  write_us = timing->learned_write_us != 0 ? timing->learned_write_us : timing->write_us;
+    int64_t                   transfer = rp2040_bl_estimate_transfer_time(update->_erase_size, update->_chunk_size, rp2040_bl_get_baudrate(update->bl));
+    return transfer + (int64_t) (update->_erase_size / update->_write_size) * write_us;
+}
+
+// Whether to erase the block at position with a single block erase instead of erasing its changed sectors. Its unchanged
+// sectors then have to be written again, rewritten is set to their number. Blocks with sectors that have to keep their
+// contents, because they are past the end of the image or hold no data in a sparse image, are never erased as a whole.
+static esp_err_t erase_whole_block(rp2040_update_t* update, uint32_t position, bool* whole, uint32_t* rewritten) {
+    rp2040_bl_t* bl    = update->bl;
+    uint32_t     block = block_size(update);
+    *whole             = false;
+    if (block == 0 || (update->_flash_start + position) % block != 0 || position + block > erase_end(update)) return ESP_OK;
+    if (position + block - update->_position > RP2040_UPDATE_COMPARE_AHEAD * update->_erase_size) return ESP_OK;
+
+    int64_t  sectors_cost = 0;
+    uint32_t unchanged = 0, run = 0;  // Runs of changed sectors are erased with a command each
+    for (uint32_t offset = position; offset < position + block; offset += update->_erase_size) {
+        if (!sector_populated(update, offset)) return ESP_OK;
+        bool      dirty;
+        esp_err_t res = sector_dirty(update, offset, &dirty);
+        if (res != ESP_OK) return res;
+        if (dirty) {
+            run += update->_erase_size;
+            continue;
+        }
+        if (run > 0) sectors_cost += rp2040_bl_estimate_erase_time(bl, update->_flash_start + offset - run, run);
+        unchanged++;
+        run = 0;
+    }
+    if (run == block) {
+        *whole = true;
+        return ESP_OK;
+    }
+    if (run > 0) sectors_cost += rp2040_bl_estimate_erase_time(bl, update->_flash_start + position + block - run, run);
+    int64_t block_cost = rp2040_bl_estimate_erase_time(bl, update->_flash_start + position, block) + unchanged * rewrite_time(update);
+    *whole             = block_cost < sectors_cost;
+    *rewritten         = unchanged;
+    return ESP_OK;
+}
+
+// Erase the changed sectors from _position on with as few commands as possible. A batch extends over consecutive sectors
+// that have to be erased, and over whole blocks where erasing the block is cheaper than erasing its sectors, until it
+// is expected to take longer than RP2040_UPDATE_ERASE_BATCH_MS. The bootloader does not accept commands while it erases,
+// so there is nothing to overlap the stall with and erasing in address order costs as much as any other order.
+static bool batch_fits(rp2040_update_t* update, uint32_t end) {
+    uint32_t length = end - update->_position;
+    if (length > RP2040_UPDATE_COMPARE_AHEAD * update->_erase_size) return false;
+    return rp2040_bl_estimate_erase_time(update->bl, update->_flash_start + update->_position, length) <= RP2040_UPDATE_ERASE_BATCH_MS * 1000LL;
+}
+
+static esp_err_t plan_erase(rp2040_update_t* update, uint32_t* length, uint32_t* rewritten) {
+    uint32_t end   = update->_position;
+    uint32_t limit = erase_end(update);
+    *rewritten     = 0;
+    while (end < limit) {
+        // A sector never costs more than a block, so sectors that would not fit anyway are not compared
+        uint32_t next = end + update->_erase_size < limit ? end + update->_erase_size : limit;
+        if (end > update->_position && !batch_fits(update, next)) break;
+
+        bool      whole, dirty;
+        uint32_t  block_rewritten = 0;
+        esp_err_t res             = erase_whole_block(update, end, &whole, &block_rewritten);
+        if (res != ESP_OK) return res;
+        if (whole) {
+            next = end + block_size(update);
+            if (end > update->_position && !batch_fits(update, next)) break;
+            *rewritten += block_rewritten;
+            end         = next;
+            continue;
+        }
+        if (!sector_populated(update, end)) break;
+        res = sector_dirty(update, end, &dirty);
+        if (res != ESP_OK) return res;
+        if (!dirty) break;
+        end = next;
+    }
+    *length = end - update->_position;
+    return ESP_OK;
+}
+
+static esp_err_t step_erase(rp2040_update_t* update) {
+    if (rp2040_bl_pending(update->bl) == 0) {
+        // Sectors that still have to be compared are compared one per step before the batch is sent
+        uint32_t  length, rewritten;
+        esp_err_t res = plan_erase(update, &length, &rewritten);
+        if (res != ESP_OK) return res;
+        update->_sector_start_time = esp_timer_get_time();
+        if (!rp2040_bl_erase_start(update->bl, update->_flash_start + update->_position, length)) return fail(update, ESP_FAIL, "Failed to erase sectors");
+        update->_erased                  = update->_position + length;
+        update->stats.sectors_rewritten += rewritten;
+        update->stats.erase_commands++;
+    }
+    esp_err_t res = rp2040_bl_poll(update->bl, RP2040_UPDATE_STEP_WAIT_MS * 1000LL);
+    if (res == ESP_ERR_NOT_FINISHED) return res;
+    if (res != ESP_OK || !rp2040_bl_erase_finish(update->bl)) return fail(update, ESP_FAIL, "Failed to erase sectors");
+    set_state(update, RP2040_UPDATE_STATE_WRITE);
+    return ESP_ERR_NOT_FINISHED;
+}
+
+static uint32_t chunk_length(rp2040_update_t* update) {
+    uint32_t length = sector_end(update, update->_sent) - update->_sent;
+    if (length > update->_chunk_size) length = update->_chunk_size;
+    // Pages without data already hold the padding once the sector has been erased
+    while (length > update->_write_size && !populated(update, update->_sent + length - update->_write_size, update->_write_size)) {
+        length -= update->_write_size;
+    }
+    return length;
+}
+
+static bool page_populated(rp2040_update_t* update) { return populated(update, update->_sent, update->_write_size); }
+
+static esp_err_t prepare_chunk(rp2040_update_t* update) {
+    if (!page_populated(update)) return ESP_OK;  // Skipped by step_write
+    uint32_t       length = chunk_length(update);
+    const uint8_t* data   = read_image(update, update->_sent, length);
+    if (data == NULL) return ESP_FAIL;
+    update->_prepared      = length;
+    update->_prepared_data = data;
+    return ESP_OK;
+}
+
+static esp_err_t step_write(rp2040_update_t* update) {
+    int64_t  start  = esp_timer_get_time();
+    uint32_t end    = sector_end(update, update->_position);
+    uint8_t  window = update->write_window;
+    if (window < 1) window = 1;
+    if (window > RP2040_UPDATE_MAX_WRITE_WINDOW) window = RP2040_UPDATE_MAX_WRITE_WINDOW;
+
+    bool gap = update->_sent < end && update->_prepared == 0 && !page_populated(update);
+    if (gap && update->_pending_count == 0) {
+        update->_sent     += update->_write_size;
+        update->_position  = update->_sent;
+    } else if (!gap && update->_sent < end && update->_pending_count < window) {
+        if (update->_prepared == 0 && prepare_chunk(update) != ESP_OK) return fail(update, ESP_FAIL, "Failed to read image");
+        if (!rp2040_bl_write_start(update->bl, update->_flash_start + update->_sent, update->_prepared, update->_prepared_data)) {
+            return fail(update, ESP_FAIL, "Failed to send chunk");
+        }
+        uint8_t index                  = (update->_pending_head + update->_pending_count) % RP2040_UPDATE_MAX_WRITE_WINDOW;
+        update->_pending_length[index] = update->_prepared;
+        update->_pending_count++;
+        update->_sent     += update->_prepared;
+        update->_prepared  = 0;
+
+        // The command has been copied into the UART TX buffer, prepare the next chunk while it is being transmitted
+        if (update->_sent < end && prepare_chunk(update) != ESP_OK) return fail(update, ESP_FAIL, "Failed to read image");
+    } else {
+        // The step returns while the reply is incomplete, the next one continues to receive it
+        esp_err_t res = rp2040_bl_poll(update->bl, RP2040_UPDATE_STEP_WAIT_MS * 1000LL);
+        uint32_t  crc;
+        if (res != ESP_ERR_NOT_FINISHED) {
+            if (res != ESP_OK || !rp2040_bl_write_finish(update->bl, &crc)) return fail(update, ESP_FAIL, "Failed to write chunk");
+            uint8_t index = update->_pending_head;
+            // The verified CRC of every chunk is folded into the image CRC instead of calculating it a second time
+            if (update->source->sequential) update->_crc = rp2040_bl_crc32_combine(update->_crc, crc, update->_pending_length[index]);
+            update->_pending_head = (index + 1) % RP2040_UPDATE_MAX_WRITE_WINDOW;
+            update->_pending_count--;
+            update->_position           += update->_pending_length[index];
+            update->stats.bytes_written += update->_pending_length[index];
+        }
+    }
+    update->_transfer_time += esp_timer_get_time() - start;
+
+    if (update->_position == end) {
+        update->stats.sectors_written++;
+        update->_sector_write_time += esp_timer_get_time() - update->_sector_start_time;
+        journal_store(update);
+        set_state(update, next_sector_state(update));
+    } else {
+        set_state(update, RP2040_UPDATE_STATE_WRITE);
+    }
+    return ESP_ERR_NOT_FINISHED;
+}
+
+// Chunk read back at offset, chunks never cross a sector
+static uint32_t verify_length(rp2040_update_t* update, uint32_t offset) {
+    uint32_t length = sector_end(update, offset) - offset;
+    return length < update->_chunk_size ? length : update->_chunk_size;
+}
+
+// Random chunk of the image, moved forward to the next sector with data in sparse images
+static uint32_t sample_offset(rp2040_update_t* update) {
+    uint32_t chunks  = (update->_length + update->_chunk_size - 1) / update->_chunk_size;
+    uint32_t sectors = (update->_length + update->_erase_size - 1) / update->_erase_size;
+    uint32_t offset  = esp_random() % chunks * update->_chunk_size;
+    for (uint32_t tries = 0; tries < sectors && !sector_populated(update, offset); tries++) {
+        offset = sector_end(update, offset);
+        if (offset >= update->_length) offset = 0;
+    }
+    return offset;
+}
+
+static esp_err_t finish_verify(rp2040_update_t* update, rp2040_update_verify_t verify) {
+    update->stats.verify_duration_us = esp_timer_get_time() - update->_verify_start_time;
+    if (verify != RP2040_UPDATE_VERIFY_WRITE_CRC) {
+        ESP_LOGI(TAG, "Verified %" PRIu32 " bytes by %s in %" PRId64 " ms", update->stats.verified_bytes, rp2040_update_verify_to_name(verify),
+                 update->stats.verify_duration_us / 1000);
+    }
+    set_state(update, RP2040_UPDATE_STATE_SEAL);
+    return ESP_ERR_NOT_FINISHED;
+}
+
+static esp_err_t step_verify(rp2040_update_t* update) {
+    rp2040_update_verify_t verify = update->verify;
+    // Sequential sources can not be read again to compare random chunks
+    if (verify == RP2040_UPDATE_VERIFY_SAMPLED && update->source->sequential) verify = RP2040_UPDATE_VERIFY_CRC;
+
+    // The CRC in every write reply has been checked while writing
+    if (verify == RP2040_UPDATE_VERIFY_WRITE_CRC) return finish_verify(update, verify);
+    if (verify == RP2040_UPDATE_VERIFY_CRC) {
+        uint32_t crc;
+        if (!rp2040_bl_crc(update->bl, update->_flash_start, update->_length, &crc)) return fail(update, ESP_FAIL, "Failed to read flash CRC");
+        if (crc != update->_crc) return fail(update, ESP_ERR_INVALID_CRC, "Flash CRC does not match the image");
+        update->stats.verified_bytes = update->_length;
+        return finish_verify(update, verify);
+    }
+
+    // Readback, one chunk per step
+    bool sampled = verify == RP2040_UPDATE_VERIFY_SAMPLED;
+    if (rp2040_bl_pending(update->bl) == 0) {
+        if (sampled) {
+            if (update->_samples_verified >= verify_samples(update)) return finish_verify(update, verify);
+            if (!update->_verify_retry) update->_verify_offset = sample_offset(update);
+        } else {
+            while (update->_verify_offset < update->_length && !sector_populated(update, update->_verify_offset)) {
+                update->_verify_offset = sector_end(update, update->_verify_offset);
+            }
+            if (update->_verify_offset >= update->_length) {
+                // Data read back from sequential sources is compared with the CRC of the image instead
+                if (update->source->sequential && update->_verify_crc != update->_crc) {
+                    return fail(update, ESP_ERR_INVALID_CRC, "Read back data does not match the image");
+                }
+                return finish_verify(update, verify);
+            }
+        }
+        if (update->_verify_buffer == NULL) {
+            update->_verify_buffer = malloc(update->_chunk_size);
+            if (update->_verify_buffer == NULL) return fail(update, ESP_ERR_NO_MEM, "Failed to allocate readback buffer");
+            update->stats.heap_bytes += update->_chunk_size;
+        }
+        uint32_t length = verify_length(update, update->_verify_offset);
+        if (!rp2040_bl_read_start(update->bl, update->_flash_start + update->_verify_offset, length, update->_verify_buffer)) {
+            return fail(update, ESP_FAIL, "Failed to read back image");
+        }
+    }
+    esp_err_t res = rp2040_bl_poll(update->bl, RP2040_UPDATE_STEP_WAIT_MS * 1000LL);
+    if (res == ESP_ERR_NOT_FINISHED) return res;
+    if (res != ESP_OK || !rp2040_bl_read_finish(update->bl)) return fail(update, ESP_FAIL, "Failed to read back image");
+
+    uint32_t length = verify_length(update, update->_verify_offset);
+    if (update->source->sequential) {
+        update->_verify_crc = rp2040_bl_crc32(update->_verify_crc, update->_verify_buffer, length);
+    } else {
+        const uint8_t* data = read_image(update, update->_verify_offset, length);
+        if (data == NULL) return fail(update, ESP_FAIL, "Failed to read image");
+        if (memcmp(data, update->_verify_buffer, length) != 0) {
+            // The link has no error detection, so a mismatch is read again before the flash is blamed
+            if (update->_verify_retry) return fail(update, ESP_ERR_INVALID_CRC, "Read back data does not match the image");
+            ESP_LOGW(TAG, "Read back data at 0x%08" PRIx32 " does not match the image, reading it again", update->_flash_start + update->_verify_offset);
+            update->_verify_retry = true;
+            return ESP_ERR_NOT_FINISHED;
+        }
+    }
+    update->_verify_retry = false;
+    update->stats.verified_bytes += length;
+    if (sampled) {
+        update->_samples_verified++;
+    } else {
+        update->_verify_offset += length;
+    }
+    return ESP_ERR_NOT_FINISHED;
+}
+
+static esp_err_t step_seal(rp2040_update_t* update) {
+    update->stats.write_duration_us = update->_verify_start_time - update->_write_start_time;
+    if (!rp2040_bl_seal(update->bl, update->_flash_start, update->_length, update->_crc)) {
+        // The bootloader refuses to seal flash that does not match the CRC, which is told apart from a failed command
+        uint32_t crc;
+        if (rp2040_bl_crc(update->bl, update->_flash_start, update->_length, &crc) && crc != update->_crc) {
+            return fail(update, ESP_ERR_INVALID_CRC, "Flash does not match the image");
+        }
+        return fail(update, ESP_FAIL, "Failed to seal image");
+    }
+    if (update->journal != NULL) update->journal->clear(update->journal->ctx);
+    set_state(update, RP2040_UPDATE_STATE_GO);
+    return ESP_ERR_NOT_FINISHED;
+}
+
+static void finish_stats(rp2040_update_t* update) {
+    rp2040_update_stats_t* stats = &update->stats;
+    stats->duration_us           = esp_timer_get_time() - update->_start_time;
+    if (stats->write_duration_us > 0) stats->bytes_per_second = (uint32_t) ((uint64_t) stats->bytes_written * 1000000 / stats->write_duration_us);
+    if (update->_transfer_time > 0) stats->transfer_bytes_per_second = (uint32_t) ((uint64_t) stats->bytes_written * 1000000 / update->_transfer_time);
+    stats->link_bytes_per_second = rp2040_bl_get_baudrate(update->bl) / 10;  // 8N1 framing
+
+    // Estimate the time a skipped sector would have taken from the sectors that were written, or from the link speed if none were
+    int64_t sector_time = rp2040_bl_estimate_transfer_time(update->_erase_size, update->_chunk_size, rp2040_bl_get_baudrate(update->bl));
+    if (stats->sectors_written > 0) sector_time = update->_sector_write_time / stats->sectors_written;
+    stats->time_saved_us = stats->sectors_skipped * sector_time - (stats->write_duration_us - update->_sector_write_time);
+
+    ESP_LOGI(TAG, "Wrote %" PRIu32 " bytes in %" PRId64 " ms (%" PRIu32 " bytes/s), update took %" PRId64 " ms", stats->bytes_written,
+             stats->write_duration_us / 1000, stats->bytes_per_second, stats->duration_us / 1000);
+    ESP_LOGI(TAG, "Transfer rate %" PRIu32 " bytes/s, %" PRIu32 "%% of the %" PRIu32 " bytes/s link", stats->transfer_bytes_per_second,
+             (uint32_t) ((uint64_t) stats->transfer_bytes_per_second * 100 / stats->link_bytes_per_second), stats->link_bytes_per_second);
+    ESP_LOGI(TAG, "%" PRIu32 " sectors written, %" PRIu32 " unchanged sectors skipped saving %" PRId64 " ms", stats->sectors_written, stats->sectors_skipped,
+             stats->time_saved_us / 1000);
+    ESP_LOGI(TAG, "Erased in %" PRIu32 " commands, %" PRIu32 " unchanged sectors written again to erase whole blocks", stats->erase_commands,
+             stats->sectors_rewritten);
+    if (update->source->populated != NULL) {
+        ESP_LOGI(TAG, "Sent %" PRIu32 " bytes of the %" PRIu32 " byte padded image, %" PRIu32 " sectors without data left untouched", stats->bytes_written,
+                 update->_length, stats->sectors_unpopulated);
+    }
+    rp2040_bl_log_stats(update->bl);
+}
+
+esp_err_t rp2040_update_step(rp2040_update_t* update) {
+    switch (update->_state) {
+        case RP2040_UPDATE_STATE_IDLE:
+            update->_start_time = esp_timer_get_time();
+            if (update->device == NULL || update->device->_fw_version == 0xFF) {
+                set_state(update, RP2040_UPDATE_STATE_SYNC);
+            } else {
+                set_state(update, RP2040_UPDATE_STATE_REBOOT);
+            }
+            return ESP_ERR_NOT_FINISHED;
+        case RP2040_UPDATE_STATE_REBOOT:
+            if (rp2040_reboot_to_bootloader(update->device) != ESP_OK) return fail(update, ESP_FAIL, "Failed to reboot RP2040 to bootloader");
+            update->_deadline = esp_timer_get_time() + RP2040_UPDATE_BOOT_TIMEOUT_MS * 1000LL;
+            set_state(update, RP2040_UPDATE_STATE_WAIT_BOOTLOADER);
+            return ESP_ERR_NOT_FINISHED;
+        case RP2040_UPDATE_STATE_WAIT_BOOTLOADER:
+            {
+                // The RP2040 does not respond on I2C while it reboots, errors are expected here
+                uint8_t version;
+                if (rp2040_get_firmware_version(update->device, &version) == ESP_OK && version == 0xFF) {
+                    set_state(update, RP2040_UPDATE_STATE_SYNC);
+                    return ESP_ERR_NOT_FINISHED;
+                }
+                if (esp_timer_get_time() > update->_deadline) return fail(update, ESP_ERR_TIMEOUT, "Timeout waiting for RP2040 bootloader");
+                vTaskDelay(pdMS_TO_TICKS(RP2040_UPDATE_BOOT_POLL_MS));
+                return ESP_ERR_NOT_FINISHED;
+            }
+        case RP2040_UPDATE_STATE_SYNC:
+            {
+                esp_err_t res = rp2040_bl_install_uart(update->bl);
+                if (res != ESP_OK) return fail(update, res, "Failed to install bootloader UART");
+                if (update->baudrates != NULL) rp2040_bl_detect_baudrate(update->bl, update->baudrates, update->baudrate_count, update->source->length);
+                int64_t sync_time;
+                if (!rp2040_bl_sync_wait(update->bl, RP2040_UPDATE_SYNC_TIMEOUT_MS * 1000LL, &sync_time)) {
+                    return fail(update, ESP_ERR_TIMEOUT, "Failed to sync with RP2040 bootloader");
+                }
+                update->stats.bootloader_time_us = esp_timer_get_time() - update->_start_time;
+                ESP_LOGI(TAG, "Bootloader answered after %" PRId64 " us, %" PRId64 " us after the first SYNC", update->stats.bootloader_time_us, sync_time);
+                set_state(update, RP2040_UPDATE_STATE_INFO);
+                return ESP_ERR_NOT_FINISHED;
+            }
+        case RP2040_UPDATE_STATE_INFO: return step_info(update);
+        case RP2040_UPDATE_STATE_CHECK: return step_check(update);
+        case RP2040_UPDATE_STATE_COMPARE: return step_compare(update);
+        case RP2040_UPDATE_STATE_ERASE: return step_erase(update);
+        case RP2040_UPDATE_STATE_WRITE: return step_write(update);
+        case RP2040_UPDATE_STATE_VERIFY: return step_verify(update);
+        case RP2040_UPDATE_STATE_SEAL: return step_seal(update);
+        case RP2040_UPDATE_STATE_GO:
+            if (!rp2040_bl_go(update->bl, update->_flash_start)) return fail(update, ESP_FAIL, "Failed to start firmware");
+            finish_stats(update);
+            set_state(update, RP2040_UPDATE_STATE_DONE);
+            return ESP_OK;
+        case RP2040_UPDATE_STATE_DONE: return ESP_OK;
+        case RP2040_UPDATE_STATE_FAILED: return ESP_FAIL;
+    }
+    return ESP_ERR_INVALID_STATE;
+}
+
+esp_err_t rp2040_update_run(rp2040_update_t* update) {
+    esp_err_t res;
+    do {
+        res = rp2040_update_step(update);
+    } while (res == ESP_ERR_NOT_FINISHED);
+    return res;
+}
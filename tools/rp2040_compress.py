@@ -0,0 +1,121 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2024 Orange-Murker
+#
+# SPDX-License-Identifier: MIT
+#
+# Creates the compressed image container read by rp2040_source_decompress: a 16 byte header followed by a heatshrink
+# stream. Also prints the length and CRC for rp2040_update_manifest_t.
+#
+#   rp2040_compress.py firmware.bin firmware.rphs
+#   rp2040_compress.py firmware.bin firmware.rphs --stream firmware.hs -w 11 -l 4
+#
+# The stream is compressed by this script unless --stream passes one made by the heatshrink tool with the same window
+# and lookahead sizes (heatshrink -e -w 11 -l 4 firmware.bin firmware.hs).
+
+import argparse
+import struct
+import sys
+import zlib
+
+MAX_WINDOW_BITS = 12  # RP2040_SOURCE_MAX_WINDOW_BITS
+MAX_CANDIDATES = 64  # Earlier occurrences tried for every match, trades compression ratio against run time
+
+
+class BitWriter:
+    def __init__(self):
+        self.data = bytearray()
+        self.value = 0
+        self.count = 0
+
+    def put(self, value, bits):
+        for bit in range(bits - 1, -1, -1):
+            self.value = (self.value << 1) | ((value >> bit) & 1)
+            self.count += 1
+            if self.count == 8:
+                self.data.append(self.value)
+                self.value = 0
+                self.count = 0
+
+    def flush(self):
+        if self.count > 0:
+            self.data.append(self.value << (8 - self.count))
+            self.value = 0
+            self.count = 0
+        return bytes(self.data)
+
+
+def compress(data, window_bits, lookahead_bits):
+    """Heatshrink encoding: a 1 bit followed by a literal byte, or a 0 bit followed by the distance minus one in
+    window_bits and the length minus one in lookahead_bits of a match in the preceding window."""
+    window = 1 << window_bits
+    max_length = 1 << lookahead_bits
+    min_length = (1 + window_bits + lookahead_bits) // 8 + 1  # Shorter matches take more bits than literals
+    positions = {}  # Earlier positions of every 3 byte sequence
+    output = BitWriter()
+
+    def remember(position):
+        positions.setdefault(data[position:position + 3], []).append(position)
+
+    position = 0
+    while position < len(data):
+        best_length, best_distance = 0, 0
+        limit = min(max_length, len(data) - position)
+        for candidate in reversed(positions.get(data[position:position + 3], [])[-MAX_CANDIDATES:]):
+            distance = position - candidate
+            if distance > window:
+                break
+            length = 0
+            while length < limit and data[candidate + length] == data[position + length]:
+                length += 1
+            if length > best_length:
+                best_length, best_distance = length, distance
+                if length == limit:
+                    break
+        if best_length >= min_length:
+            output.put(0, 1)
+            output.put(best_distance - 1, window_bits)
+            output.put(best_length - 1, lookahead_bits)
+            for offset in range(best_length):
+                remember(position + offset)
+            position += best_length
+        else:
+            output.put(1, 1)
+            output.put(data[position], 8)
+            remember(position)
+            position += 1
+    return output.flush()
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Create a compressed RP2040 firmware image for rp2040_source_decompress")
+    parser.add_argument("image", help="uncompressed firmware image (.bin)")
+    parser.add_argument("output", help="compressed image container to write")
+    parser.add_argument("-w", "--window", type=int, default=11, help="window size in bits, 4 to 12 (default 11)")
+    parser.add_argument("-l", "--lookahead", type=int, default=4, help="lookahead size in bits (default 4)")
+    parser.add_argument("--stream", help="use this heatshrink stream instead of compressing the image")
+    args = parser.parse_args()
+
+    if not 4 <= args.window <= MAX_WINDOW_BITS or not 3 <= args.lookahead < args.window:
+        parser.error("window must be 4 to %d bits and lookahead at least 3 bits and less than the window" % MAX_WINDOW_BITS)
+
+    with open(args.image, "rb") as file:
+        image = file.read()
+    if args.stream is not None:
+        with open(args.stream, "rb") as file:
+            stream = file.read()
+    else:
+        stream = compress(image, args.window, args.lookahead)
+
+    crc = zlib.crc32(image)  # The CRC-32 calculated by rp2040_bl_crc32 and the bootloader
+    header = b"RPHS" + struct.pack("<BBHII", args.window, args.lookahead, 0, len(image), crc)
+    with open(args.output, "wb") as file:
+        file.write(header + stream)
+
+    print("%s: %d bytes compressed to %d bytes" % (args.output, len(image), len(header) + len(stream)))
+    print("manifest: .length = %d, .crc = 0x%08X" % (len(image), crc))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())